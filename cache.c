@@ -0,0 +1,306 @@
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "extern.h"
+
+#ifdef HAVE_UTHASH
+#  include <uthash.h>
+#else
+#  include "compat-uthash.h"
+#endif
+
+/*
+ * Cache of formatted top-level declarations keyed by the source code of the
+ * declaration. The cache is persisted in a file on the following format:
+ *
+ * 	knfmt-cache <version> <max width> <tab width> <soft width>\n
+ * 	<source length> <output length>\n<source><output>
+ * 	...
+ *
+ * A cache file written using another version or configuration is ignored.
+ * Entries are written in order of recent use, the least recently used ones are
+ * evicted once the cache exceeds CACHE_SIZE_MAX bytes.
+ */
+
+#define CACHE_VERSION	1
+#define CACHE_HDR_SIZE	64
+#define CACHE_SIZE_MAX	(64 * 1024 * 1024)
+
+struct cache_entry {
+	const char	*ce_src;
+	size_t		 ce_srclen;
+	const char	*ce_out;
+	size_t		 ce_outlen;
+	int		 ce_alloc;	/* allocated as opposed to loaded */
+	int		 ce_used;	/* used by this process */
+	UT_hash_handle	 ce_hh;
+};
+
+struct cache {
+	const char		*ca_path;
+	const struct config	*ca_cf;
+	struct buffer		*ca_bf;		/* storage of loaded entries */
+	struct cache_entry	*ca_entries;
+	int			 ca_dirty;
+
+	struct {
+		unsigned long	s_nhits;
+		unsigned long	s_nmisses;
+		unsigned long	s_nevictions;
+	} ca_stats;
+};
+
+static int	cache_read(struct cache *);
+static int	cache_hdr(const struct buffer *, size_t *, char *, size_t);
+static void	cache_clear(struct cache *);
+
+struct cache *
+cache_alloc(const char *path, const struct config *cf)
+{
+	struct cache *ca;
+
+	ca = calloc(1, sizeof(*ca));
+	if (ca == NULL)
+		err(1, NULL);
+	ca->ca_path = path;
+	ca->ca_cf = cf;
+
+	if (access(path, F_OK) == -1 && errno == ENOENT)
+		return ca;
+	if (cache_read(ca)) {
+		/* Start over, the invalid cache is replaced once written. */
+		cache_clear(ca);
+		ca->ca_dirty = 1;
+	}
+	return ca;
+}
+
+void
+cache_free(struct cache *ca)
+{
+	if (ca == NULL)
+		return;
+
+	if (ca->ca_cf->cf_verbose >= 2) {
+		fprintf(stderr,
+		    "[C] %s: %lu hit(s), %lu miss(es), %lu eviction(s)\n",
+		    __func__, ca->ca_stats.s_nhits, ca->ca_stats.s_nmisses,
+		    ca->ca_stats.s_nevictions);
+	}
+	cache_clear(ca);
+	free(ca);
+}
+
+/*
+ * Returns the formatted output associated with the given source code or NULL
+ * if absent.
+ */
+const char *
+cache_get(struct cache *ca, const char *src, size_t srclen, size_t *outlen)
+{
+	struct cache_entry *ce;
+
+	HASH_FIND(ce_hh, ca->ca_entries, src, srclen, ce);
+	if (ce == NULL) {
+		ca->ca_stats.s_nmisses++;
+		return NULL;
+	}
+	ca->ca_stats.s_nhits++;
+	ce->ce_used = 1;
+	*outlen = ce->ce_outlen;
+	return ce->ce_out;
+}
+
+void
+cache_put(struct cache *ca, const char *src, size_t srclen, const char *out,
+    size_t outlen)
+{
+	struct cache_entry *ce;
+	char *buf;
+
+	HASH_FIND(ce_hh, ca->ca_entries, src, srclen, ce);
+	if (ce != NULL)
+		return;
+
+	ce = calloc(1, sizeof(*ce));
+	if (ce == NULL)
+		err(1, NULL);
+	buf = malloc(srclen + outlen);
+	if (buf == NULL)
+		err(1, NULL);
+	memcpy(buf, src, srclen);
+	memcpy(&buf[srclen], out, outlen);
+	ce->ce_src = buf;
+	ce->ce_srclen = srclen;
+	ce->ce_out = &buf[srclen];
+	ce->ce_outlen = outlen;
+	ce->ce_alloc = 1;
+	ce->ce_used = 1;
+	HASH_ADD_KEYPTR(ce_hh, ca->ca_entries, ce->ce_src, ce->ce_srclen, ce);
+	ca->ca_dirty = 1;
+}
+
+/*
+ * Persist the cache if modified. The cache file is replaced atomically as it
+ * could be used concurrently by another process.
+ */
+int
+cache_write(struct cache *ca)
+{
+	char path[PATH_MAX];
+	const struct config *cf = ca->ca_cf;
+	struct cache_entry *ce, *tmp;
+	FILE *fp;
+	size_t size = 0;
+	int fd, i, n;
+
+	if (!ca->ca_dirty)
+		return 0;
+
+	n = snprintf(path, sizeof(path), "%s.XXXXXXXX", ca->ca_path);
+	if (n < 0 || n >= (int)sizeof(path)) {
+		warnc(ENAMETOOLONG, "%s", ca->ca_path);
+		return 1;
+	}
+	fd = mkstemp(path);
+	if (fd == -1) {
+		warn("mkstemp: %s", path);
+		return 1;
+	}
+	fp = fdopen(fd, "w");
+	if (fp == NULL) {
+		warn("fdopen: %s", path);
+		close(fd);
+		goto err;
+	}
+
+	fprintf(fp, "knfmt-cache %d %u %u %u\n", CACHE_VERSION, cf->cf_mw,
+	    cf->cf_tw, cf->cf_sw);
+	/*
+	 * Write entries used by this process first, followed by the remaining
+	 * ones in the order they were read.
+	 */
+	for (i = 1; i >= 0; i--) {
+		HASH_ITER(ce_hh, ca->ca_entries, ce, tmp) {
+			if (ce->ce_used != i)
+				continue;
+			size += ce->ce_srclen + ce->ce_outlen;
+			if (size > CACHE_SIZE_MAX) {
+				ca->ca_stats.s_nevictions++;
+				continue;
+			}
+			fprintf(fp, "%zu %zu\n", ce->ce_srclen, ce->ce_outlen);
+			fwrite(ce->ce_src, ce->ce_srclen, 1, fp);
+			fwrite(ce->ce_out, ce->ce_outlen, 1, fp);
+		}
+	}
+	if (ferror(fp) | (fclose(fp) == EOF)) {
+		warn("write: %s", path);
+		goto err;
+	}
+	if (rename(path, ca->ca_path) == -1) {
+		warn("rename: %s", ca->ca_path);
+		goto err;
+	}
+	ca->ca_dirty = 0;
+	return 0;
+
+err:
+	(void)unlink(path);
+	return 1;
+}
+
+static int
+cache_read(struct cache *ca)
+{
+	char hdr[CACHE_HDR_SIZE];
+	const struct config *cf = ca->ca_cf;
+	struct buffer *bf;
+	size_t off = 0;
+	unsigned int mw, sw, tw;
+	int version;
+	int n = 0;
+
+	bf = ca->ca_bf = buffer_read(ca->ca_path);
+	if (bf == NULL)
+		return 1;
+
+	if (cache_hdr(bf, &off, hdr, sizeof(hdr)) == 0)
+		n = sscanf(hdr, "knfmt-cache %d %u %u %u", &version, &mw, &tw,
+		    &sw);
+	if (n != 4) {
+		warnx("%s: invalid cache", ca->ca_path);
+		return 1;
+	}
+	/* Silently discard a cache written using another configuration. */
+	if (version != CACHE_VERSION || mw != cf->cf_mw || tw != cf->cf_tw ||
+	    sw != cf->cf_sw)
+		return 1;
+
+	while (off < bf->bf_len) {
+		struct cache_entry *ce;
+		size_t outlen, srclen;
+
+		if (cache_hdr(bf, &off, hdr, sizeof(hdr)) ||
+		    sscanf(hdr, "%zu %zu", &srclen, &outlen) != 2 ||
+		    srclen > bf->bf_len - off ||
+		    outlen > bf->bf_len - off - srclen) {
+			warnx("%s: invalid cache", ca->ca_path);
+			return 1;
+		}
+
+		ce = calloc(1, sizeof(*ce));
+		if (ce == NULL)
+			err(1, NULL);
+		ce->ce_src = &bf->bf_ptr[off];
+		ce->ce_srclen = srclen;
+		ce->ce_out = &bf->bf_ptr[off + srclen];
+		ce->ce_outlen = outlen;
+		HASH_ADD_KEYPTR(ce_hh, ca->ca_entries, ce->ce_src,
+		    ce->ce_srclen, ce);
+		off += srclen + outlen;
+	}
+
+	return 0;
+}
+
+/*
+ * Read a newline terminated header starting at the given offset into buf.
+ */
+static int
+cache_hdr(const struct buffer *bf, size_t *off, char *buf, size_t bufsiz)
+{
+	const char *nl;
+	size_t len;
+
+	nl = memchr(&bf->bf_ptr[*off], '\n', bf->bf_len - *off);
+	if (nl == NULL)
+		return 1;
+	len = nl - &bf->bf_ptr[*off];
+	if (len >= bufsiz)
+		return 1;
+	memcpy(buf, &bf->bf_ptr[*off], len);
+	buf[len] = '\0';
+	*off += len + 1;
+	return 0;
+}
+
+static void
+cache_clear(struct cache *ca)
+{
+	struct cache_entry *ce, *tmp;
+
+	HASH_ITER(ce_hh, ca->ca_entries, ce, tmp) {
+		HASH_DELETE(ce_hh, ca->ca_entries, ce);
+		if (ce->ce_alloc)
+			free((char *)ce->ce_src);
+		free(ce);
+	}
+	buffer_free(ca->ca_bf);
+	ca->ca_bf = NULL;
+}
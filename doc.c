@@ -8,8 +8,6 @@
 
 #include "extern.h"
 
-TAILQ_HEAD(doc_list, doc);
-
 struct doc {
 	enum doc_type	dc_type;
 
@@ -19,7 +17,11 @@ struct doc {
 
 	/* children */
 	union {
-		struct doc_list	 dc_list;
+		struct {
+			struct doc	**dc_docs;
+			unsigned int	  dc_ndocs;
+			unsigned int	  dc_siz;
+		};
 		struct doc	*dc_doc;
 	};
 
@@ -29,10 +31,41 @@ struct doc {
 			const char	*dc_str;
 			size_t		 dc_len;
 		};
-		int	dc_int;
+		int		 dc_int;
+		/* storage of the first children, see doc_append() */
+		struct doc	*dc_inline[2];
+	};
+};
+
+/*
+ * Flat representation of a document, see doc_flatten(). All descendants of a
+ * document immediately follows the same document.
+ */
+struct doc_op {
+	enum doc_type	op_type;
+	unsigned int	op_size;	/* number of descendants */
+	size_t		op_width;	/* width including descendants */
+
+	/* value */
+	union {
+		struct {
+			const char	*op_str;
+			size_t		 op_len;
+		};
+		int	op_int;
 	};
+};
 
-	TAILQ_ENTRY(doc)	dc_entry;
+/*
+ * Document being traversed using an explicit stack. While flattening, the frame
+ * refers to the document tree and otherwise to the flat representation.
+ */
+struct doc_frame {
+	const struct doc	*fr_dc;
+	size_t			 fr_next;	/* next child to flatten */
+	size_t			 fr_idx;	/* index of flat document */
+	size_t			 fr_end;	/* end of all descendants */
+	int			 fr_val;	/* state to restore once done */
 };
 
 struct doc_state {
@@ -61,6 +94,21 @@ struct doc_state {
 		unsigned int	s_nfits_cache;
 	} st_stats;
 
+	struct {
+		struct doc_frame	*s_frames;
+		size_t			 s_len;
+		size_t			 s_siz;
+	} st_stack;
+
+	struct {
+		struct doc_op		 *f_ops;
+		/* origin of each document, only used while tracing */
+		const struct doc	**f_docs;
+		size_t			  f_len;
+		size_t			  f_siz;
+		size_t			  f_width;
+	} st_flat;
+
 	unsigned int	st_pos;
 	unsigned int	st_depth;
 	unsigned int	st_refit;
@@ -73,28 +121,45 @@ struct doc_state {
 };
 
 static void	doc_exec1(const struct doc *, struct doc_state *);
-static int	doc_fits(const struct doc *, struct doc_state *);
-static int	doc_fits1(const struct doc *, struct doc_state *);
-static void	doc_indent(const struct doc *, struct doc_state *, int);
-static void	doc_indent1(const struct doc *, struct doc_state *, int);
-static void	doc_print(const struct doc *, struct doc_state *, const char *,
-    size_t, int);
-static void	doc_trim(const struct doc *, struct doc_state *);
+static void	doc_exec_push(const struct doc_op *, struct doc_state *);
+static void	doc_exec_pop(struct doc_state *);
+static int	doc_fits(const struct doc_op *, struct doc_state *);
+static int	doc_fits1(const struct doc_op *, struct doc_state *);
+static void	doc_flatten(const struct doc *, struct doc_state *);
+static void	doc_indent(const struct doc_op *, struct doc_state *, int);
+static void	doc_indent1(const struct doc_op *, struct doc_state *, int);
+static void	doc_print(const struct doc_op *, struct doc_state *,
+    const char *, size_t, int);
+static void	doc_newline(const struct doc_op *, struct doc_state *,
+    unsigned int, int);
+static void	doc_trim(const struct doc_op *, struct doc_state *);
 static int	doc_parens(const struct doc_state *);
 static int	doc_has_list(const struct doc *);
+static int	doc_is_shared(const struct doc *);
+
+static struct doc_frame	*doc_push(struct doc_state *);
+static struct doc_op	*doc_op_alloc(struct doc_state *, const struct doc *);
+static void		 doc_state_free(struct doc_state *);
 
 static struct doc	*__doc_alloc_mute(int, struct doc *, const char *, int);
+static void		 __doc_token_suffixes(const struct token *,
+    struct doc *, const char *, int);
+static struct doc	*__doc_alloc_newline(int, struct doc *, const char *,
+    int);
 
 #define DOC_TRACE(st)	(UNLIKELY((st)->st_cf->cf_verbose >= 2 &&	\
 	((st)->st_flags & DOC_STATE_FLAG_WIDTH) == 0))
 
-#define doc_trace(dc, st, fmt, ...) do {				\
+/* Document from which the given flat document originates. */
+#define doc_origin(op, st) \
+	((st)->st_flat.f_docs[(op) - (st)->st_flat.f_ops])
+
+#define doc_trace(st, fmt, ...) do {					\
 	if (DOC_TRACE(st))						\
-		__doc_trace((dc), (st), (fmt), __VA_ARGS__);		\
+		__doc_trace((st), (fmt), __VA_ARGS__);			\
 } while (0)
-static void	__doc_trace(const struct doc *, const struct doc_state *,
-    const char *, ...)
-	__attribute__((__format__(printf, 3, 4)));
+static void	__doc_trace(const struct doc_state *, const char *, ...)
+	__attribute__((__format__(printf, 2, 3)));
 
 #define doc_trace_enter(dc, st) do {					\
 	if (DOC_TRACE(st))						\
@@ -108,10 +173,48 @@ static void	__doc_trace_enter(const struct doc *, struct doc_state *);
 } while (0)
 static void	__doc_trace_leave(const struct doc *, struct doc_state *);
 
+#define doc_event(st, id, op, val) do {					\
+	if (UNLIKELY((st)->st_cf->cf_trace != NULL &&			\
+	    ((st)->st_flags & DOC_STATE_FLAG_WIDTH) == 0))		\
+		__doc_event((st), (id), (op), (val));			\
+} while (0)
+static void	__doc_event(const struct doc_state *, enum trace_id,
+    const struct doc_op *, int);
+
 static char		*docstr(const struct doc *, char *, size_t);
 static const char	*indentstr(const struct doc *);
 static const char	*statestr(const struct doc_state *, unsigned int,
     char *, size_t);
+static unsigned char	 modestr(const struct doc_state *);
+
+/*
+ * Documents lacking both children and a unique value are shared among all
+ * parents, avoiding an allocation per occurrence. Shared documents are never
+ * altered and therefore safe to share among threads, the const qualifier is
+ * only dropped while handing them out.
+ */
+static const struct doc	doc_line = {
+	.dc_type	= DOC_LINE
+};
+static const struct doc	doc_softline = {
+	.dc_type	= DOC_SOFTLINE
+};
+static const struct doc	doc_hardline = {
+	.dc_type	= DOC_HARDLINE
+};
+static const struct doc	doc_space = {
+	.dc_type	= DOC_LITERAL,
+	.dc_str		= " ",
+	.dc_len		= 1,
+};
+
+/*
+ * Document discarding everything appended to it, see doc_discard(). All
+ * documents allocated with it as the parent are the document itself.
+ */
+static const struct doc	doc_sink = {
+	.dc_type	= DOC_CONCAT
+};
 
 void
 doc_exec(const struct doc *dc, struct buffer *bf, const struct config *cf)
@@ -127,8 +230,54 @@ doc_exec(const struct doc *dc, struct buffer *bf, const struct config *cf)
 	doc_exec1(dc, &st);
 	buffer_appendc(bf, '\0');
 
-	doc_trace(dc, &st, "%s: nfits %u/%u", __func__,
-	    st.st_stats.s_nfits_cache, st.st_stats.s_nfits);
+	doc_trace(&st, "%s: nfits %u/%u", __func__, st.st_stats.s_nfits_cache,
+	    st.st_stats.s_nfits);
+	doc_state_free(&st);
+}
+
+/*
+ * Incremental variant of doc_exec(), allowing the children of the given
+ * concatenation document to be executed one at a time using doc_exec_append()
+ * while the same document is still being constructed. The output is identical
+ * to executing the whole document at once.
+ */
+struct doc_state *
+doc_exec_enter(const struct doc *dc, struct buffer *bf, const struct config *cf)
+{
+	struct doc_state *st;
+
+	assert(dc->dc_type == DOC_CONCAT);
+
+	st = calloc(1, sizeof(*st));
+	if (st == NULL)
+		err(1, NULL);
+	buffer_reset(bf);
+	st->st_cf = cf;
+	st->st_bf = bf;
+	st->st_mode = BREAK;
+	st->st_fits.f_fits = -1;
+	doc_trace_enter(dc, st);
+	return st;
+}
+
+void
+doc_exec_append(const struct doc *dc, struct doc_state *st)
+{
+	/* The cache could span over the previous child, see doc_exec1(). */
+	st->st_fits.f_fits = -1;
+	doc_exec1(dc, st);
+}
+
+void
+doc_exec_leave(const struct doc *dc, struct doc_state *st)
+{
+	doc_trace_leave(dc, st);
+	buffer_appendc(st->st_bf, '\0');
+
+	doc_trace(st, "%s: nfits %u/%u", __func__, st->st_stats.s_nfits_cache,
+	    st->st_stats.s_nfits);
+	doc_state_free(st);
+	free(st);
 }
 
 unsigned int
@@ -144,6 +293,7 @@ doc_width(const struct doc *dc, struct buffer *bf, const struct config *cf)
 	st.st_fits.f_fits = -1;
 	st.st_flags = DOC_STATE_FLAG_WIDTH;
 	doc_exec1(dc, &st);
+	doc_state_free(&st);
 
 	return st.st_pos;
 }
@@ -151,76 +301,198 @@ doc_width(const struct doc *dc, struct buffer *bf, const struct config *cf)
 void
 doc_free(struct doc *dc)
 {
-	if (dc == NULL)
-		return;
+	struct doc *buf[64];
+	struct doc **stack = buf;
+	size_t len = 0;
+	size_t siz = sizeof(buf) / sizeof(buf[0]);
 
-	switch (dc->dc_type) {
-	case DOC_CONCAT: {
-		struct doc *concat;
+	/*
+	 * Avoid recursion as documents can be nested arbitrarily deep, the
+	 * children are instead pushed onto a stack of documents to free.
+	 */
+	if (dc != NULL)
+		stack[len++] = dc;
+	while (len > 0) {
+		struct doc **docs = NULL;
+		size_t ndocs = 0;
+
+		dc = stack[--len];
+		if (doc_is_shared(dc))
+			continue;
+
+		switch (dc->dc_type) {
+		case DOC_CONCAT:
+			docs = dc->dc_docs;
+			ndocs = dc->dc_ndocs;
+			break;
+
+		case DOC_GROUP:
+		case DOC_INDENT:
+		case DOC_DEDENT:
+			if (dc->dc_doc != NULL) {
+				docs = &dc->dc_doc;
+				ndocs = 1;
+			}
+			break;
 
-		while ((concat = TAILQ_FIRST(&dc->dc_list)) != NULL) {
-			TAILQ_REMOVE(&dc->dc_list, concat, dc_entry);
-			doc_free(concat);
+		case DOC_ALIGN:
+		case DOC_LITERAL:
+		case DOC_VERBATIM:
+		case DOC_LINE:
+		case DOC_SOFTLINE:
+		case DOC_HARDLINE:
+		case DOC_NEWLINE:
+		case DOC_MUTE:
+			break;
 		}
-		break;
-	}
 
-	case DOC_GROUP:
-	case DOC_INDENT:
-	case DOC_DEDENT:
-		doc_free(dc->dc_doc);
-		break;
+		if (len + ndocs > siz) {
+			struct doc **tmp = NULL;
+
+			while (len + ndocs > siz)
+				siz *= 2;
+			if (stack != buf)
+				tmp = stack;
+			tmp = reallocarray(tmp, siz, sizeof(*stack));
+			if (tmp == NULL)
+				err(1, NULL);
+			if (stack == buf)
+				memcpy(tmp, buf, len * sizeof(*stack));
+			stack = tmp;
+		}
+		if (ndocs > 0)
+			memcpy(&stack[len], docs, ndocs * sizeof(*stack));
+		len += ndocs;
 
-	case DOC_ALIGN:
-	case DOC_LITERAL:
-	case DOC_VERBATIM:
-	case DOC_LINE:
-	case DOC_SOFTLINE:
-	case DOC_HARDLINE:
-	case DOC_NEWLINE:
-	case DOC_MUTE:
-		break;
+		if (dc->dc_type == DOC_CONCAT && dc->dc_docs != dc->dc_inline)
+			free(dc->dc_docs);
+		free(dc);
 	}
+	if (stack != buf)
+		free(stack);
+}
 
-	free(dc);
+/*
+ * Returns a document discarding everything appended to it. Used while the
+ * source code is only recognized without any intent to lay it out, such as
+ * while peeking, in which the construction of documents would be wasted.
+ */
+struct doc *
+doc_discard(void)
+{
+	return (struct doc *)&doc_sink;
+}
+
+/*
+ * Returns the child at the given index of the parent document, or NULL if
+ * absent.
+ */
+const struct doc *
+doc_child(const struct doc *parent, size_t i)
+{
+	if (doc_has_list(parent))
+		return i < parent->dc_ndocs ? parent->dc_docs[i] : NULL;
+	return i == 0 ? parent->dc_doc : NULL;
 }
 
+/*
+ * Remove the given child of the parent document. As shared documents can occur
+ * more than once, the last occurrence is removed.
+ */
 void
 doc_remove(struct doc *dc, struct doc *parent)
 {
+	unsigned int i;
+
+	if (parent == &doc_sink)
+		return;
+
 	assert(doc_has_list(parent));
-	TAILQ_REMOVE(&parent->dc_list, dc, dc_entry);
+	for (i = parent->dc_ndocs; i > 0; i--) {
+		if (parent->dc_docs[i - 1] == dc)
+			break;
+	}
+	assert(i > 0);
+	memmove(&parent->dc_docs[i - 1], &parent->dc_docs[i],
+	    (parent->dc_ndocs - i) * sizeof(*parent->dc_docs));
+	parent->dc_ndocs--;
 	doc_free(dc);
 }
 
 void
 doc_remove_tail(struct doc *parent)
 {
-	struct doc *dc;
-
 	assert(doc_has_list(parent));
-	dc = TAILQ_LAST(&parent->dc_list, doc_list);
-	if (dc == NULL)
+	if (parent->dc_ndocs == 0)
 		return;
-	TAILQ_REMOVE(&parent->dc_list, dc, dc_entry);
-	doc_free(dc);
+	doc_free(parent->dc_docs[--parent->dc_ndocs]);
 }
 
 void
 doc_set_indent(struct doc *dc, int indent)
 {
+	if (dc == &doc_sink)
+		return;
+	assert(!doc_is_shared(dc));
 	dc->dc_int = indent;
 }
 
+const char *
+doc_type_str(enum doc_type type)
+{
+	switch (type) {
+#define CASE(t) case t: return &#t[sizeof("DOC_") - 1]
+	CASE(DOC_CONCAT);
+	CASE(DOC_GROUP);
+	CASE(DOC_INDENT);
+	CASE(DOC_DEDENT);
+	CASE(DOC_ALIGN);
+	CASE(DOC_LITERAL);
+	CASE(DOC_VERBATIM);
+	CASE(DOC_LINE);
+	CASE(DOC_SOFTLINE);
+	CASE(DOC_HARDLINE);
+	CASE(DOC_NEWLINE);
+	CASE(DOC_MUTE);
+#undef CASE
+	}
+	return NULL;
+}
+
 void
 doc_append(struct doc *dc, struct doc *parent)
 {
-	if (doc_has_list(parent)) {
-		TAILQ_INSERT_TAIL(&parent->dc_list, dc, dc_entry);
-	} else {
+	if (parent == &doc_sink) {
+		doc_free(dc);
+		return;
+	}
+
+	if (!doc_has_list(parent)) {
 		assert(parent->dc_doc == NULL);
 		parent->dc_doc = dc;
+		return;
 	}
+
+	/*
+	 * The first children are stored in the document itself, as most
+	 * concatenations only have a few children.
+	 */
+	if (parent->dc_ndocs == parent->dc_siz) {
+		struct doc **docs;
+		unsigned int siz = parent->dc_siz * 2;
+
+		docs = reallocarray(parent->dc_docs == parent->dc_inline ?
+		    NULL : parent->dc_docs, siz, sizeof(*docs));
+		if (docs == NULL)
+			err(1, NULL);
+		if (parent->dc_docs == parent->dc_inline) {
+			memcpy(docs, parent->dc_inline,
+			    sizeof(parent->dc_inline));
+		}
+		parent->dc_docs = docs;
+		parent->dc_siz = siz;
+	}
+	parent->dc_docs[parent->dc_ndocs++] = dc;
 }
 
 struct doc *
@@ -228,14 +500,33 @@ __doc_alloc(enum doc_type type, struct doc *parent, const char *fun, int lno)
 {
 	struct doc *dc;
 
-	dc = calloc(1, sizeof(*dc));
-	if (dc == NULL)
-		err(1, NULL);
-	dc->dc_type = type;
-	dc->dc_fun = fun;
-	dc->dc_lno = lno;
-	if (doc_has_list(dc))
-		TAILQ_INIT(&dc->dc_list);
+	if (parent == &doc_sink)
+		return parent;
+
+	switch (type) {
+	case DOC_LINE:
+		dc = (struct doc *)&doc_line;
+		break;
+	case DOC_SOFTLINE:
+		dc = (struct doc *)&doc_softline;
+		break;
+	case DOC_HARDLINE:
+		dc = (struct doc *)&doc_hardline;
+		break;
+	default:
+		dc = calloc(1, sizeof(*dc));
+		if (dc == NULL)
+			err(1, NULL);
+		dc->dc_type = type;
+		dc->dc_fun = fun;
+		dc->dc_lno = lno;
+		if (doc_has_list(dc)) {
+			dc->dc_docs = dc->dc_inline;
+			dc->dc_siz = sizeof(dc->dc_inline) /
+			    sizeof(dc->dc_inline[0]);
+		}
+		break;
+	}
 	if (parent != NULL)
 		doc_append(dc, parent);
 
@@ -248,6 +539,9 @@ __doc_alloc_indent(enum doc_type type, int ind, struct doc *dc,
 {
 	struct doc *concat, *group, *indent;
 
+	if (dc == &doc_sink)
+		return dc;
+
 	group = __doc_alloc(DOC_GROUP, dc, fun, lno);
 	indent = __doc_alloc(type, group, fun, lno);
 	indent->dc_int = ind;
@@ -260,12 +554,38 @@ __doc_literal(const char *str, struct doc *dc, const char *fun, int lno)
 {
 	struct doc *literal;
 
+	if (dc == &doc_sink)
+		return dc;
+
+	/* A single space is by far the most common literal. */
+	if (str[0] == ' ' && str[1] == '\0') {
+		literal = (struct doc *)&doc_space;
+		if (dc != NULL)
+			doc_append(literal, dc);
+		return literal;
+	}
+
 	literal = __doc_alloc(DOC_LITERAL, dc, fun, lno);
 	literal->dc_str = str;
 	literal->dc_len = strlen(str);
 	return literal;
 }
 
+struct doc *
+__doc_verbatim_str(const char *str, size_t len, struct doc *dc,
+    const char *fun, int lno)
+{
+	struct doc *verbatim;
+
+	if (dc == &doc_sink)
+		return dc;
+
+	verbatim = __doc_alloc(DOC_VERBATIM, dc, fun, lno);
+	verbatim->dc_str = str;
+	verbatim->dc_len = len;
+	return verbatim;
+}
+
 struct doc *
 __doc_token(const struct token *tk, struct doc *dc, enum doc_type type,
     const char *fun, int lno)
@@ -274,6 +594,9 @@ __doc_token(const struct token *tk, struct doc *dc, enum doc_type type,
 	struct token *tmp;
 	int dangling = 0;
 
+	if (dc == &doc_sink)
+		return dc;
+
 	/* Fake token created by lexer_recover_hard(), emit nothing. */
 	if (tk->tk_flags & TOKEN_FLAG_FAKE)
 		return NULL;
@@ -290,130 +613,170 @@ __doc_token(const struct token *tk, struct doc *dc, enum doc_type type,
 	if (tk->tk_flags & TOKEN_FLAG_UNMUTE)
 		__doc_alloc_mute(-1, dc, fun, lno);
 
-	TAILQ_FOREACH(tmp, &tk->tk_prefixes, tk_entry) {
-		__doc_token(tmp, dc, DOC_VERBATIM, __func__, __LINE__);
+	/*
+	 * Dangling tokens are emitted as verbatim documents which are ignored
+	 * while muted. Only the trailing hard line(s) must be preserved.
+	 */
+	if ((tk->tk_flags & TOKEN_FLAG_MUTE) == 0) {
+		TAILQ_FOREACH(tmp, &tk->tk_prefixes, tk_entry) {
+			__doc_token(tmp, dc, DOC_VERBATIM, __func__, __LINE__);
+		}
 	}
 
 	token = __doc_alloc(type, dc, fun, lno);
 	token->dc_str = tk->tk_str;
 	token->dc_len = tk->tk_len;
 
-	TAILQ_FOREACH(tmp, &tk->tk_suffixes, tk_entry) {
+	__doc_token_suffixes(tk, dc, fun, lno);
+
+	return dangling ? dc : token;
+}
+
+/*
+ * Emit the source code spanning the given tokens verbatim, read from the buffer
+ * the tokens originate from. Used for declarations skipped by the parser, see
+ * lexer_budget_recover().
+ */
+struct doc *
+__doc_verbatim(const struct token *beg, const struct token *end,
+    const struct buffer *bf, struct doc *dc, const char *fun, int lno)
+{
+	struct doc *verbatim;
+	struct token *tmp;
+	size_t off;
+
+	if (dc == &doc_sink)
+		return dc;
+
+	if (beg->tk_flags & TOKEN_FLAG_UNMUTE)
+		__doc_alloc_mute(-1, dc, fun, lno);
+
+	TAILQ_FOREACH(tmp, &beg->tk_prefixes, tk_entry) {
 		__doc_token(tmp, dc, DOC_VERBATIM, __func__, __LINE__);
 	}
 
-	/* lexer_comment() signalled that hard line(s) must be emitted. */
-	if (tk->tk_flags & TOKEN_FLAG_NEWLINE) {
-		struct doc *newline;
+	/* Include any indentation preceding the first token. */
+	for (off = beg->tk_off; off > 0; off--) {
+		char c = bf->bf_ptr[off - 1];
 
-		newline = __doc_alloc(DOC_NEWLINE, dc, fun, lno);
-		newline->dc_int = tk->tk_int;
+		if (c == '\n')
+			break;
+		if (c != ' ' && c != '\t') {
+			off = beg->tk_off;
+			break;
+		}
 	}
 
+	/*
+	 * Include trailing comments and hard line(s), except for the last hard
+	 * line which is expected to be emitted by the caller.
+	 */
+	verbatim = __doc_alloc(DOC_VERBATIM, dc, fun, lno);
+	verbatim->dc_str = &bf->bf_ptr[off];
+	verbatim->dc_len = token_end(end, bf) - off;
+
 	/* Mute if we're about to branch. */
-	tmp = TAILQ_NEXT(tk, tk_entry);
+	tmp = TAILQ_NEXT(end, tk_entry);
 	if (tmp != NULL && token_is_branch(tmp))
 		__doc_alloc_mute(1, dc, fun, lno);
 
-	return dangling ? dc : token;
+	return verbatim;
 }
 
+/*
+ * Execute the given document. The document is first flattened, allowing it to
+ * be executed using a linear traversal. Documents can be nested arbitrarily
+ * deep, therefore recursion is avoided by instead maintaining an explicit stack
+ * of documents being executed.
+ */
 static void
 doc_exec1(const struct doc *dc, struct doc_state *st)
 {
-	doc_trace_enter(dc, st);
+	size_t len = st->st_stack.s_len;
+	size_t i;
+
+	doc_flatten(dc, st);
+	for (i = 0; i < st->st_flat.f_len; i++) {
+		doc_exec_push(&st->st_flat.f_ops[i], st);
+		while (st->st_stack.s_len > len &&
+		    st->st_stack.s_frames[st->st_stack.s_len - 1].fr_end ==
+		    i + 1)
+			doc_exec_pop(st);
+	}
+}
 
-	switch (dc->dc_type) {
-	case DOC_CONCAT: {
-		struct doc *concat;
-		int ndocs = 0;
+/*
+ * Start executing the given document. Documents with children are pushed onto
+ * the stack and finished by doc_exec_pop() once all descendants are executed.
+ */
+static void
+doc_exec_push(const struct doc_op *op, struct doc_state *st)
+{
+	struct doc_frame *fr;
+	int push = 0;
+	int val = 0;
+
+	doc_trace_enter(doc_origin(op, st), st);
+	doc_event(st, TRACE_DOC_ENTER, op, 0);
 
+	switch (op->op_type) {
+	case DOC_CONCAT:
 		/*
 		 * If the document has more than one child the cache must be
-		 * invalidated since it spans over all children.
+		 * invalidated since it spans over all children. The first child
+		 * is followed by its descendants and then the next child.
 		 */
-		TAILQ_FOREACH(concat, &dc->dc_list, dc_entry) {
-			if (++ndocs > 1)
-				break;
-		}
-		if (ndocs > 1)
+		if (op->op_size > 0 && op[1].op_size + 1 < op->op_size)
 			st->st_fits.f_fits = -1;
-
-		TAILQ_FOREACH(concat, &dc->dc_list, dc_entry) {
-			doc_exec1(concat, st);
-		}
+		push = 1;
 		break;
-	}
-
-	case DOC_GROUP: {
-		unsigned int oldmode;
 
+	case DOC_GROUP:
+		val = st->st_mode;
 		switch (st->st_mode) {
 		case MUNGE:
-			if (st->st_refit == 0) {
-				doc_exec1(dc->dc_doc, st);
+			if (st->st_refit == 0)
 				break;
-			}
 			/* FALLTHROUGH */
 		case BREAK:
 			st->st_refit = 0;
-			oldmode = st->st_mode;
-			st->st_mode = doc_fits(dc, st) ? MUNGE : BREAK;
-			doc_exec1(dc->dc_doc, st);
-			st->st_mode = oldmode;
+			st->st_mode = doc_fits(op, st) ? MUNGE : BREAK;
 			break;
 		}
+		push = 1;
 		break;
-	}
 
 	case DOC_INDENT:
-		if (dc->dc_int == DOC_INDENT_PARENS)
+		if (op->op_int == DOC_INDENT_PARENS)
 			st->st_parens++;
-		else if (dc->dc_int == DOC_INDENT_FORCE)
-			doc_indent(dc, st, st->st_indent.i_cur);
+		else if (op->op_int == DOC_INDENT_FORCE)
+			doc_indent(op, st, st->st_indent.i_cur);
 		else
-			st->st_indent.i_cur += dc->dc_int;
-		doc_exec1(dc->dc_doc, st);
-		if (dc->dc_int == DOC_INDENT_PARENS) {
-			st->st_parens--;
-		} else if (dc->dc_int == DOC_INDENT_FORCE) {
-			/* nothing */
-		} else {
-			st->st_indent.i_cur -= dc->dc_int;
-		}
-		/*
-		 * While reaching the first column, there's no longer any
-		 * previous indentation to consider.
-		 */
-		if (st->st_indent.i_cur == 0)
-			st->st_indent.i_pre = 0;
+			st->st_indent.i_cur += op->op_int;
+		push = 1;
 		break;
 
-	case DOC_DEDENT: {
-		int indent;
-
-		if (dc->dc_int == DOC_DEDENT_NONE) {
-			indent = st->st_indent.i_cur;
+	case DOC_DEDENT:
+		if (op->op_int == DOC_DEDENT_NONE) {
+			val = st->st_indent.i_cur;
 		} else {
-			indent = dc->dc_int;
-			if (indent > st->st_indent.i_cur)
-				indent = st->st_indent.i_cur;
+			val = op->op_int;
+			if (val > st->st_indent.i_cur)
+				val = st->st_indent.i_cur;
 		}
-		doc_trim(dc, st);
-		st->st_indent.i_cur -= indent;
-		doc_indent(dc, st, st->st_indent.i_cur);
-		doc_exec1(dc->dc_doc, st);
-		st->st_indent.i_cur += indent;
+		doc_trim(op, st);
+		st->st_indent.i_cur -= val;
+		doc_indent(op, st, st->st_indent.i_cur);
+		push = 1;
 		break;
-	}
 
 	case DOC_ALIGN:
 		if ((st->st_flags & DOC_STATE_FLAG_WIDTH) == 0)
-			doc_indent1(dc, st, dc->dc_int);
+			doc_indent1(op, st, op->op_int);
 		break;
 
 	case DOC_LITERAL:
-		doc_print(dc, st, dc->dc_str, dc->dc_len, 1);
+		doc_print(op, st, op->op_str, op->op_len, 1);
 		break;
 
 	case DOC_VERBATIM: {
@@ -426,21 +789,21 @@ doc_exec1(const struct doc *dc, struct doc_state *st)
 		 * A verbatim block is either a comment or preprocessor
 		 * directive.
 		 */
-		int isblock = dc->dc_len > 1 &&
-		    dc->dc_str[dc->dc_len - 1] == '\n';
+		int isblock = op->op_len > 1 &&
+		    op->op_str[op->op_len - 1] == '\n';
 
 		/*
 		 * Verbatims must never be indented, therefore trim the current
 		 * line.
 		 */
-		doc_trim(dc, st);
+		doc_trim(op, st);
 		oldpos = st->st_pos;
 
 		/* Verbatim blocks must always start on a new line. */
 		if (isblock && st->st_pos > 0)
-			doc_print(dc, st, "\n", 1, 0);
+			doc_print(op, st, "\n", 1, 0);
 
-		doc_print(dc, st, dc->dc_str, dc->dc_len, 1);
+		doc_print(op, st, op->op_str, op->op_len, 1);
 
 		/*
 		 * Restore the indentation after emitting a verbatim block.
@@ -454,7 +817,7 @@ doc_exec1(const struct doc *dc, struct doc_state *st)
 		 */
 		if (isblock) {
 			st->st_pos = 0;
-			doc_indent(dc, st,
+			doc_indent(op, st,
 			    oldpos > 0 ? st->st_indent.i_cur : st->st_indent.i_pre);
 		}
 
@@ -464,12 +827,13 @@ doc_exec1(const struct doc *dc, struct doc_state *st)
 	case DOC_LINE:
 		switch (st->st_mode) {
 		case BREAK:
-			doc_print(dc, st, "\n", 1, 1);
+			doc_print(op, st, "\n", 1, 1);
 			break;
 		case MUNGE:
-			doc_print(dc, st, " ", 1, 1);
-			doc_trace(dc, st, "%s: refit %u -> %d", __func__,
+			doc_print(op, st, " ", 1, 1);
+			doc_trace(st, "%s: refit %u -> %d", __func__,
 			    st->st_refit, 1);
+			doc_event(st, TRACE_DOC_REFIT, op, 1);
 			st->st_refit = 1;
 			break;
 		}
@@ -478,7 +842,7 @@ doc_exec1(const struct doc *dc, struct doc_state *st)
 	case DOC_SOFTLINE:
 		switch (st->st_mode) {
 		case BREAK:
-			doc_print(dc, st, "\n", 1, 1);
+			doc_print(op, st, "\n", 1, 1);
 			break;
 		case MUNGE:
 			break;
@@ -486,7 +850,7 @@ doc_exec1(const struct doc *dc, struct doc_state *st)
 		break;
 
 	case DOC_HARDLINE:
-		doc_print(dc, st, "\n", 1, 1);
+		doc_print(op, st, "\n", 1, 1);
 		break;
 
 	case DOC_NEWLINE:
@@ -494,20 +858,73 @@ doc_exec1(const struct doc *dc, struct doc_state *st)
 		 * Signal to doc_print() that we've got pending hard line(s) to
 		 * emit.
 		 */
-		st->st_newline = dc->dc_int;
+		st->st_newline = op->op_int;
 		break;
 
 	case DOC_MUTE:
 		if ((st->st_flags & DOC_STATE_FLAG_WIDTH) == 0)
-			st->st_mute += dc->dc_int;
+			st->st_mute += op->op_int;
 		break;
 	}
 
-	doc_trace_leave(dc, st);
+	if (!push) {
+		doc_trace_leave(doc_origin(op, st), st);
+		return;
+	}
+	fr = doc_push(st);
+	fr->fr_idx = op - st->st_flat.f_ops;
+	fr->fr_end = fr->fr_idx + op->op_size + 1;
+	fr->fr_val = val;
+}
+
+/*
+ * Finish executing the document on top of the stack, restoring any state
+ * altered by doc_exec_push().
+ */
+static void
+doc_exec_pop(struct doc_state *st)
+{
+	const struct doc_frame *fr;
+	const struct doc_op *op;
+
+	fr = &st->st_stack.s_frames[--st->st_stack.s_len];
+	op = &st->st_flat.f_ops[fr->fr_idx];
+
+	switch (op->op_type) {
+	case DOC_GROUP:
+		st->st_mode = fr->fr_val;
+		break;
+
+	case DOC_INDENT:
+		if (op->op_int == DOC_INDENT_PARENS) {
+			st->st_parens--;
+		} else if (op->op_int == DOC_INDENT_FORCE) {
+			/* nothing */
+		} else {
+			st->st_indent.i_cur -= op->op_int;
+		}
+		/*
+		 * While reaching the first column, there's no longer any
+		 * previous indentation to consider.
+		 */
+		if (st->st_indent.i_cur == 0)
+			st->st_indent.i_pre = 0;
+		break;
+
+	case DOC_DEDENT:
+		st->st_indent.i_cur += fr->fr_val;
+		break;
+
+	default:
+		break;
+	}
+
+	doc_trace_leave(doc_origin(op, st), st);
+	doc_event(st, TRACE_DOC_LEAVE, op, 0);
 }
 
 static int
-doc_fits(const struct doc *dc, struct doc_state *st)
+doc_fits(const struct doc_op *op, struct doc_state *st)
 {
 	struct doc_state sst;
 	int cached = 0;
@@ -527,7 +944,9 @@ doc_fits(const struct doc *dc, struct doc_state *st)
 		/* Should not perform any printing. */
 		sst.st_bf = NULL;
 		sst.st_mode = MUNGE;
-		st->st_fits.f_fits = doc_fits1(dc, &sst);
+		st->st_fits.f_fits = doc_fits1(op, &sst);
+		/* The stack could have been reallocated. */
+		st->st_stack = sst.st_stack;
 		st->st_fits.f_pos = st->st_pos;
 		st->st_fits.f_ppos = sst.st_pos;
 	} else {
@@ -535,62 +954,237 @@ doc_fits(const struct doc *dc, struct doc_state *st)
 			st->st_stats.s_nfits_cache++;
 		cached = 1;
 	}
-	doc_trace(dc, st, "%s: %u %s %u%s", __func__, st->st_fits.f_ppos,
+	doc_trace(st, "%s: %u %s %u%s", __func__, st->st_fits.f_ppos,
 	    st->st_fits.f_fits ? "<=" : ">", st->st_cf->cf_mw,
 	    cached ? " (cached)" : "");
+	doc_event(st, TRACE_DOC_FITS, op,
+	    (st->st_fits.f_fits ? TRACE_FITS : 0) |
+	    (cached ? TRACE_FITS_CACHED : 0));
 
 	return st->st_fits.f_fits;
 }
 
+/*
+ * Returns non-zero if the given document fits on the current line. As the
+ * position only increases, it is enough to consider the width of the document
+ * and all its descendants. Otherwise, they are traversed linearly, only the
+ * concatenations are pushed onto the stack as they must also fit once all
+ * children are traversed.
+ */
 static int
-doc_fits1(const struct doc *dc, struct doc_state *st)
+doc_fits1(const struct doc_op *op, struct doc_state *st)
 {
-	switch (dc->dc_type) {
-	case DOC_CONCAT: {
-		struct doc *concat;
+	size_t beg = op - st->st_flat.f_ops;
+	size_t end = beg + op->op_size + 1;
+	size_t len = st->st_stack.s_len;
+	size_t i;
+	int fits = 1;
 
-		TAILQ_FOREACH(concat, &dc->dc_list, dc_entry) {
-			if (!doc_fits1(concat, st))
-				return 0;
+	/*
+	 * Without any width, the position could still exceed the maximum width
+	 * already.
+	 */
+	if (op->op_width > 0) {
+		fits = st->st_pos + op->op_width <= st->st_cf->cf_mw;
+		st->st_pos += op->op_width;
+		return fits;
+	}
+
+	for (i = beg; fits && i < end; i++) {
+		struct doc_frame *fr;
+		int check = 1;
+
+		op = &st->st_flat.f_ops[i];
+		switch (op->op_type) {
+		case DOC_CONCAT:
+			fr = doc_push(st);
+			fr->fr_end = i + op->op_size + 1;
+			check = 0;
+			break;
+
+		case DOC_GROUP:
+		case DOC_INDENT:
+		case DOC_DEDENT:
+			check = 0;
+			break;
+
+		case DOC_ALIGN:
+			break;
+
+		case DOC_LITERAL:
+			st->st_pos += op->op_len;
+			break;
+
+		case DOC_VERBATIM:
+			check = 0;
+			break;
+
+		case DOC_LINE:
+			st->st_pos++;
+			break;
+
+		case DOC_SOFTLINE:
+			break;
+
+		case DOC_HARDLINE:
+		case DOC_NEWLINE:
+			check = 0;
+			break;
+
+		case DOC_MUTE:
+			break;
+		}
+		if (check && st->st_pos > st->st_cf->cf_mw)
+			fits = 0;
+
+		while (fits && st->st_stack.s_len > len) {
+			fr = &st->st_stack.s_frames[st->st_stack.s_len - 1];
+			if (fr->fr_end != i + 1)
+				break;
+			st->st_stack.s_len--;
+			if (st->st_pos > st->st_cf->cf_mw)
+				fits = 0;
 		}
-		break;
 	}
 
-	case DOC_GROUP:
-	case DOC_INDENT:
-	case DOC_DEDENT:
-		return doc_fits1(dc->dc_doc, st);
+	st->st_stack.s_len = len;
+	return fits;
+}
 
-	case DOC_ALIGN:
-		break;
+/*
+ * Flatten the given document by storing it and all its descendants in
+ * pre-order. The number of descendants allows a document to be skipped in
+ * constant time. The width of each document, as if laid out on a single line,
+ * allows doc_fits() to run in constant time.
+ */
+static void
+doc_flatten(const struct doc *dc, struct doc_state *st)
+{
+	size_t len = st->st_stack.s_len;
+
+	st->st_flat.f_len = 0;
+	st->st_flat.f_width = 0;
+	while (dc != NULL) {
+		struct doc_frame *fr;
+		struct doc_op *op;
+
+		op = doc_op_alloc(st, dc);
+		switch (dc->dc_type) {
+		case DOC_CONCAT:
+		case DOC_GROUP:
+		case DOC_INDENT:
+		case DOC_DEDENT:
+			fr = doc_push(st);
+			fr->fr_dc = dc;
+			fr->fr_next = 0;
+			fr->fr_idx = st->st_flat.f_len - 1;
+			/* Adjusted once all descendants are flattened. */
+			op->op_width = st->st_flat.f_width;
+			break;
 
-	case DOC_LITERAL:
-		st->st_pos += dc->dc_len;
-		break;
+		case DOC_LITERAL:
+			op->op_width = op->op_len;
+			st->st_flat.f_width += op->op_width;
+			break;
 
-	case DOC_VERBATIM:
-		return 1;
+		case DOC_LINE:
+			op->op_width = 1;
+			st->st_flat.f_width += op->op_width;
+			break;
 
-	case DOC_LINE:
-		st->st_pos++;
-		break;
+		default:
+			break;
+		}
 
-	case DOC_SOFTLINE:
-		break;
+		/*
+		 * Continue with the next sibling. The number of descendants is
+		 * known once all children are flattened.
+		 */
+		dc = NULL;
+		while (st->st_stack.s_len > len) {
+			fr = &st->st_stack.s_frames[st->st_stack.s_len - 1];
+			dc = doc_child(fr->fr_dc, fr->fr_next);
+			if (dc != NULL) {
+				fr->fr_next++;
+				break;
+			}
+			op = &st->st_flat.f_ops[fr->fr_idx];
+			op->op_size = st->st_flat.f_len - fr->fr_idx - 1;
+			op->op_width = st->st_flat.f_width - op->op_width;
+			st->st_stack.s_len--;
+		}
+	}
+}
 
-	case DOC_HARDLINE:
-	case DOC_NEWLINE:
-		return 1;
+static struct doc_frame *
+doc_push(struct doc_state *st)
+{
+	if (st->st_stack.s_len == st->st_stack.s_siz) {
+		struct doc_frame *frames;
+		size_t siz;
+
+		siz = st->st_stack.s_siz > 0 ? st->st_stack.s_siz * 2 : 64;
+		frames = reallocarray(st->st_stack.s_frames, siz,
+		    sizeof(*frames));
+		if (frames == NULL)
+			err(1, NULL);
+		st->st_stack.s_frames = frames;
+		st->st_stack.s_siz = siz;
+	}
+	return &st->st_stack.s_frames[st->st_stack.s_len++];
+}
 
-	case DOC_MUTE:
-		break;
+static struct doc_op *
+doc_op_alloc(struct doc_state *st, const struct doc *dc)
+{
+	struct doc_op *op;
+
+	if (st->st_flat.f_len == st->st_flat.f_siz) {
+		size_t siz;
+
+		siz = st->st_flat.f_siz > 0 ? st->st_flat.f_siz * 2 : 64;
+		op = reallocarray(st->st_flat.f_ops, siz, sizeof(*op));
+		if (op == NULL)
+			err(1, NULL);
+		st->st_flat.f_ops = op;
+		/* The origin is only needed while tracing. */
+		if (st->st_cf->cf_verbose >= 2) {
+			const struct doc **docs;
+
+			docs = reallocarray(st->st_flat.f_docs, siz,
+			    sizeof(*docs));
+			if (docs == NULL)
+				err(1, NULL);
+			st->st_flat.f_docs = docs;
+		}
+		st->st_flat.f_siz = siz;
+	}
+	if (st->st_flat.f_docs != NULL)
+		st->st_flat.f_docs[st->st_flat.f_len] = dc;
+
+	op = &st->st_flat.f_ops[st->st_flat.f_len++];
+	op->op_type = dc->dc_type;
+	op->op_size = 0;
+	op->op_width = 0;
+	if (dc->dc_type == DOC_LITERAL || dc->dc_type == DOC_VERBATIM) {
+		op->op_str = dc->dc_str;
+		op->op_len = dc->dc_len;
+	} else {
+		op->op_int = dc->dc_int;
 	}
+	return op;
+}
 
-	return st->st_pos <= st->st_cf->cf_mw;
+static void
+doc_state_free(struct doc_state *st)
+{
+	free(st->st_stack.s_frames);
+	free(st->st_flat.f_ops);
+	free(st->st_flat.f_docs);
 }
 
 static void
-doc_indent(const struct doc *dc, struct doc_state *st, int indent)
+doc_indent(const struct doc_op *op, struct doc_state *st, int indent)
 {
 	int parens = 0;
 
@@ -602,27 +1196,39 @@ doc_indent(const struct doc *dc, struct doc_state *st, int indent)
 		st->st_indent.i_pre = indent;
 	}
 
-	doc_indent1(dc, st, indent);
+	doc_indent1(op, st, indent);
 
 	if (!parens)
 		st->st_indent.i_pos = st->st_bf->bf_len;
 }
 
 static void
-doc_indent1(const struct doc *UNUSED(dc), struct doc_state *st, int indent)
+doc_indent1(const struct doc_op *UNUSED(op), struct doc_state *st, int indent)
 {
-	for (; indent >= 8; indent -= 8) {
-		buffer_appendc(st->st_bf, '\t');
-		st->st_pos += 8 - (st->st_pos % 8);
+	static const char tabs[] = "\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t";
+	static const char spaces[] = "       ";
+	size_t ntabs, nspaces;
+
+	if (indent <= 0)
+		return;
+
+	ntabs = indent / 8;
+	nspaces = indent % 8;
+	if (ntabs > 0) {
+		/* The first tab only advances to the next tab stop. */
+		st->st_pos = (st->st_pos / 8 + ntabs) * 8;
+		for (; ntabs > sizeof(tabs) - 1; ntabs -= sizeof(tabs) - 1)
+			buffer_append(st->st_bf, tabs, sizeof(tabs) - 1);
+		buffer_append(st->st_bf, tabs, ntabs);
 	}
-	for (; indent > 0; indent--) {
-		buffer_appendc(st->st_bf, ' ');
-		st->st_pos++;
+	if (nspaces > 0) {
+		buffer_append(st->st_bf, spaces, nspaces);
+		st->st_pos += nspaces;
 	}
 }
 
 static void
-doc_print(const struct doc *dc, struct doc_state *st, const char *str,
+doc_print(const struct doc_op *op, struct doc_state *st, const char *str,
     size_t len, int doindent)
 {
 	int newline = len == 1 && str[0] == '\n';
@@ -630,61 +1236,82 @@ doc_print(const struct doc *dc, struct doc_state *st, const char *str,
 	/* Emit any pending hard line(s). */
 	if (st->st_newline > 0) {
 		int space = len == 1 && str[0] == ' ';
-		int n;
+		unsigned int n;
 
 		n = st->st_newline;
 		st->st_newline = 0;
-		for (; n > 0; n--)
-			doc_print(dc, st, "\n", 1, doindent && n - 1 == 0);
+		doc_newline(op, st, n, doindent);
 		if (newline || space)
 			return;
 	}
 
 	if (newline) {
-		/* Skip new lines while testing. */
-		if (st->st_cf->cf_flags & CONFIG_FLAG_TEST)
-			return;
-
-		/* Never emit more than two consecutive lines. */
-		if (st->st_line >= 2)
-			return;
-		st->st_line++;
-	} else {
-		st->st_line = 0;
+		doc_newline(op, st, 1, doindent);
+		return;
 	}
 
-	if (newline)
-		doc_trim(dc, st);
-
-	if (st->st_mute == 0 || dc->dc_type == DOC_HARDLINE)
+	st->st_line = 0;
+	if (st->st_mute == 0 || op->op_type == DOC_HARDLINE)
 		buffer_append(st->st_bf, str, len);
 	st->st_pos += len;
+}
 
-	if (newline) {
-		st->st_pos = 0;
-		if (doindent)
-			doc_indent(dc, st, st->st_indent.i_cur);
-	}
+/*
+ * Emit the given number of new lines at once, only the last one is followed by
+ * indentation.
+ */
+static void
+doc_newline(const struct doc_op *op, struct doc_state *st, unsigned int n,
+    int doindent)
+{
+	static const char newlines[] = "\n\n";
+	unsigned int nlines;
+
+	/* Skip new lines while testing. */
+	if (st->st_cf->cf_flags & CONFIG_FLAG_TEST)
+		return;
+
+	/* Never emit more than two consecutive lines. */
+	if (st->st_line >= 2)
+		return;
+	nlines = 2 - st->st_line;
+	if (nlines > n)
+		nlines = n;
+	st->st_line += nlines;
+
+	doc_trim(op, st);
+	if (st->st_mute == 0 || op->op_type == DOC_HARDLINE)
+		buffer_append(st->st_bf, newlines, nlines);
+	st->st_pos = 0;
+
+	/* Omit the indentation if the last new line was omitted. */
+	if (doindent && nlines == n)
+		doc_indent(op, st, st->st_indent.i_cur);
 }
 
 static void
-doc_trim(const struct doc *dc, struct doc_state *st)
+doc_trim(const struct doc_op *op, struct doc_state *st)
 {
 	struct buffer *bf = st->st_bf;
+	const char *ptr = bf->bf_ptr;
+	size_t len = bf->bf_len;
 	unsigned int oldpos = st->st_pos;
+	unsigned int pos = oldpos;
 
-	while (bf->bf_len > 0) {
-		unsigned char ch;
+	for (; len > 0; len--) {
+		unsigned char ch = ptr[len - 1];
 
-		ch = bf->bf_ptr[bf->bf_len - 1];
 		if (ch != ' ' && ch != '\t')
 			break;
-		bf->bf_len--;
-		st->st_pos -= ch == '\t' ? 8 - (st->st_pos % 8) : 1;
+		pos -= ch == '\t' ? 8 - (pos % 8) : 1;
 	}
-	if (oldpos > st->st_pos)
-		doc_trace(dc, st, "%s: trimmed %u character(s)", __func__,
+	bf->bf_len = len;
+	st->st_pos = pos;
+	if (oldpos > pos) {
+		doc_trace(st, "%s: trimmed %u character(s)", __func__,
 		    oldpos - st->st_pos);
+		doc_event(st, TRACE_DOC_TRIM, op, oldpos - pos);
+	}
 }
 
 /*
@@ -710,19 +1337,61 @@ doc_has_list(const struct doc *dc)
 	return 0;
 }
 
+static int
+doc_is_shared(const struct doc *dc)
+{
+	return dc == &doc_line || dc == &doc_softline || dc == &doc_hardline ||
+	    dc == &doc_space || dc == &doc_sink;
+}
+
 static struct doc *
 __doc_alloc_mute(int mute, struct doc *parent, const char *fun, int lno)
 {
 	struct doc *dc;
 
 	dc = __doc_alloc(DOC_MUTE, parent, fun, lno);
-	dc->dc_int = mute;
+	if (dc != &doc_sink)
+		dc->dc_int = mute;
+	return dc;
+}
+
+static void
+__doc_token_suffixes(const struct token *tk, struct doc *dc, const char *fun,
+    int lno)
+{
+	struct token *tmp;
+
+	TAILQ_FOREACH(tmp, &tk->tk_suffixes, tk_entry) {
+		if ((tk->tk_flags & TOKEN_FLAG_MUTE) == 0)
+			__doc_token(tmp, dc, DOC_VERBATIM, __func__, __LINE__);
+		else if (tmp->tk_flags & TOKEN_FLAG_NEWLINE)
+			__doc_alloc_newline(tmp->tk_int, dc, __func__,
+			    __LINE__);
+	}
+
+	/* lexer_comment() signalled that hard line(s) must be emitted. */
+	if (tk->tk_flags & TOKEN_FLAG_NEWLINE)
+		__doc_alloc_newline(tk->tk_int, dc, fun, lno);
+
+	/* Mute if we're about to branch. */
+	tmp = TAILQ_NEXT(tk, tk_entry);
+	if (tmp != NULL && token_is_branch(tmp))
+		__doc_alloc_mute(1, dc, fun, lno);
+}
+
+static struct doc *
+__doc_alloc_newline(int nlines, struct doc *parent, const char *fun, int lno)
+{
+	struct doc *dc;
+
+	dc = __doc_alloc(DOC_NEWLINE, parent, fun, lno);
+	if (dc != &doc_sink)
+		dc->dc_int = nlines;
 	return dc;
 }
 
 static void
-__doc_trace(const struct doc *UNUSED(dc), const struct doc_state *st,
-    const char *fmt, ...)
+__doc_trace(const struct doc_state *st, const char *fmt, ...)
 {
 	char buf[32];
 	va_list ap;
@@ -856,30 +1525,45 @@ __doc_trace_leave(const struct doc *dc, struct doc_state *st)
 	fprintf(stderr, "\n");
 }
 
+static void
+__doc_event(const struct doc_state *st, enum trace_id id,
+    const struct doc_op *op, int val)
+{
+	/* While entering, record the value of the document. */
+	if (id == TRACE_DOC_ENTER) {
+		switch (op->op_type) {
+		case DOC_INDENT:
+		case DOC_DEDENT:
+		case DOC_ALIGN:
+		case DOC_NEWLINE:
+		case DOC_MUTE:
+			val = op->op_int;
+			break;
+		case DOC_LITERAL:
+		case DOC_VERBATIM:
+			val = op->op_len;
+			break;
+		default:
+			break;
+		}
+	}
+	trace_doc(st->st_cf->cf_trace, id, op - st->st_flat.f_ops, op->op_type,
+	    modestr(st), st->st_pos, st->st_stack.s_len, val);
+}
+
 static char *
 docstr(const struct doc *dc, char *buf, size_t bufsiz)
 {
-	const char *str = NULL;
+	const char *str;
 	int n;
 
-	switch (dc->dc_type) {
-#define CASE(t) case t: str = &#t[sizeof("DOC_") - 1]; break
-	CASE(DOC_CONCAT);
-	CASE(DOC_GROUP);
-	CASE(DOC_INDENT);
-	CASE(DOC_DEDENT);
-	CASE(DOC_ALIGN);
-	CASE(DOC_LITERAL);
-	CASE(DOC_VERBATIM);
-	CASE(DOC_LINE);
-	CASE(DOC_SOFTLINE);
-	CASE(DOC_HARDLINE);
-	CASE(DOC_NEWLINE);
-	CASE(DOC_MUTE);
-#undef CASE
-	}
+	str = doc_type_str(dc->dc_type);
 
-	n = snprintf(buf, bufsiz, "%s<%s:%d>", str, dc->dc_fun, dc->dc_lno);
+	if (doc_is_shared(dc))
+		n = snprintf(buf, bufsiz, "%s", str);
+	else
+		n = snprintf(buf, bufsiz, "%s<%s:%d>", str, dc->dc_fun,
+		    dc->dc_lno);
 	if (n < 0 || n >= (ssize_t)bufsiz)
 		errc(1, ENAMETOOLONG, "%s", __func__);
 
@@ -905,20 +1589,23 @@ static const char *
 statestr(const struct doc_state *st, unsigned int depth, char *buf,
     size_t bufsiz)
 {
-	unsigned char mode = 'U';
 	int n;
 
+	n = snprintf(buf, bufsiz, "[D] [%c,%3u,%3u,%3d]", modestr(st),
+	    st->st_pos, depth, st->st_mute);
+	if (n < 0 || n >= (ssize_t)bufsiz)
+		errc(1, ENAMETOOLONG, "%s", __func__);
+	return buf;
+}
+
+static unsigned char
+modestr(const struct doc_state *st)
+{
 	switch (st->st_mode) {
 	case BREAK:
-		mode = 'B';
-		break;
+		return 'B';
 	case MUNGE:
-		mode = 'M';
-		break;
+		return 'M';
 	}
-	n = snprintf(buf, bufsiz, "[D] [%c,%3u,%3u,%3d]", mode, st->st_pos,
-	    depth, st->st_mute);
-	if (n < 0 || n >= (ssize_t)bufsiz)
-		errc(1, ENAMETOOLONG, "%s", __func__);
-	return buf;
+	return 'U';
 }
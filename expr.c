@@ -31,6 +31,13 @@ enum expr_pc {
 #define PCUNARY		0x80000000u
 #define PC(pc)		((pc) & ~PCUNARY)
 
+/*
+ * Maximum depth of an expression, see expr_depth(). Declarations containing
+ * deeper expressions are emitted verbatim as the recursive construction of the
+ * corresponding documents would otherwise exhaust the stack.
+ */
+#define EXPR_DEPTH_MAX	1024
+
 enum expr_type {
 	EXPR_UNARY,
 	EXPR_BINARY,
@@ -52,6 +59,7 @@ enum expr_type {
 
 struct expr {
 	enum expr_type		 ex_type;
+	unsigned int		 ex_depth;
 	const struct token	*ex_tk;
 	struct expr		*ex_lhs;
 	struct expr		*ex_rhs;
@@ -68,6 +76,11 @@ struct expr {
 
 struct expr_state;
 
+struct expr_spine {
+	struct expr	*sp_ex;
+	struct doc	*sp_dc;
+};
+
 struct expr_rule {
 	enum expr_pc	 er_pc;
 	int		 er_rassoc;
@@ -82,9 +95,18 @@ struct expr_state {
 	const struct token		*es_stop;
 	struct lexer			*es_lx;
 	struct token			*es_tk;
+	struct doc			*es_dc;		/* parent of recover documents */
+	unsigned int			 es_depth;	/* number of nested rules */
 	unsigned int			 es_nest;	/* number of nested expressions */
 	unsigned int			 es_parens;	/* number of nested parenthesis */
 	unsigned int			 es_soft;	/* number of soft lines */
+
+	/* Left associative binary expressions pending layout. */
+	struct {
+		struct expr_spine	*s_ptr;
+		size_t			 s_len;
+		size_t			 s_siz;
+	} es_spine;
 };
 
 static struct expr	*expr_exec1(struct expr_state *, enum expr_pc);
@@ -103,9 +125,14 @@ static struct expr	*expr_exec_unary(struct expr_state *, struct expr *);
 
 static struct expr	*expr_alloc(enum expr_type, const struct expr_state *);
 static void		 expr_free(struct expr *);
+static int		 expr_depth(struct expr_state *, struct expr *);
 
 static struct doc	*expr_doc(struct expr *, struct expr_state *,
     struct doc *);
+static struct doc	*expr_doc1(struct expr *, struct expr_state *,
+    struct doc *);
+static struct doc	*expr_doc_binary(struct expr *, struct expr_state *,
+    struct doc *, struct doc *);
 static struct doc	*expr_doc_indent(const struct expr_state *,
     struct doc *, unsigned int, int);
 static struct doc	*expr_doc_tokens(const struct expr *, struct doc *);
@@ -117,9 +144,12 @@ static struct doc	*__expr_doc_soft(const struct expr_state *,
 
 static void	expr_state_init(struct expr_state *,
     const struct expr_exec_arg *);
+static void	expr_spine_push(struct expr_state *, struct expr *,
+    struct doc *);
 
 static const struct expr_rule	*expr_rule_find(const struct token *, int);
 
+static int	isbinary(const struct expr *);
 static int	iscast(struct expr_state *);
 static int	isliteral(const struct token *);
 
@@ -197,6 +227,7 @@ expr_exec(const struct expr_exec_arg *ea)
 
 	dc = expr_doc(ex, &es, ea->ea_dc);
 	expr_free(ex);
+	free(es.es_spine.s_ptr);
 	return dc;
 }
 
@@ -209,6 +240,8 @@ expr_peek(const struct expr_exec_arg *ea)
 	int error;
 
 	expr_state_init(&es, ea);
+	/* The expression is never laid out, refrain from constructing it. */
+	es.es_dc = doc_discard();
 	ex = expr_exec1(&es, PC0);
 	error = lexer_get_error(es.es_lx);
 	if (ex != NULL && error == 0)
@@ -227,6 +260,11 @@ expr_exec1(struct expr_state *es, enum expr_pc pc)
 	if (lexer_is_branch(es->es_lx))
 		return expr_alloc(EXPR_BRANCH, es);
 
+	if (es->es_depth >= EXPR_DEPTH_MAX) {
+		lexer_budget_exhaust(es->es_lx);
+		return NULL;
+	}
+
 	if (lexer_get_error(es->es_lx) ||
 	    (lexer_back(es->es_lx, &tk) && tk == es->es_stop) ||
 	    (!lexer_peek(es->es_lx, &es->es_tk) || es->es_tk == es->es_stop))
@@ -248,10 +286,16 @@ expr_exec1(struct expr_state *es, enum expr_pc pc)
 		es->es_er = er;
 		if (!lexer_pop(es->es_lx, &es->es_tk))
 			return NULL;
+		es->es_depth++;
 		ex = es->es_er->er_func(es, NULL);
+		es->es_depth--;
 	}
 	if (ex == NULL)
 		return NULL;
+	if (expr_depth(es, ex)) {
+		expr_free(ex);
+		return NULL;
+	}
 
 	for (;;) {
 		struct expr *tmp;
@@ -273,10 +317,12 @@ expr_exec1(struct expr_state *es, enum expr_pc pc)
 
 		if (!lexer_pop(es->es_lx, &es->es_tk))
 			break;
+		es->es_depth++;
 		tmp = es->es_er->er_func(es, ex);
+		es->es_depth--;
 		if (tmp == NULL)
 			return NULL;
-		if (lexer_get_error(es->es_lx)) {
+		if (lexer_get_error(es->es_lx) || expr_depth(es, tmp)) {
 			expr_free(tmp);
 			return NULL;
 		}
@@ -295,7 +341,7 @@ expr_exec_recover(struct expr_state *es)
 	if (es->es_ea->ea_recover == NULL)
 		return NULL;
 
-	dc = es->es_ea->ea_recover(es->es_ea->ea_arg);
+	dc = es->es_ea->ea_recover(es->es_dc, es->es_ea->ea_arg);
 	if (dc == NULL)
 		return NULL;
 
@@ -527,37 +573,124 @@ expr_alloc(enum expr_type type, const struct expr_state *es)
 	return ex;
 }
 
+/*
+ * Free the expression without recursion by rotating the left expression up
+ * until absent, the right expression is then freed next.
+ */
 static void
 expr_free(struct expr *ex)
 {
-	if (ex == NULL)
-		return;
-
-	expr_free(ex->ex_lhs);
-	expr_free(ex->ex_rhs);
-	if (ex->ex_type == EXPR_TERNARY)
-		expr_free(ex->ex_ternary);
-	else if (ex->ex_type == EXPR_RECOVER)
-		doc_free(ex->ex_dc);
-	free(ex);
+	while (ex != NULL) {
+		struct expr *tmp;
+
+		if (ex->ex_lhs != NULL) {
+			tmp = ex->ex_lhs;
+			ex->ex_lhs = tmp->ex_rhs;
+			tmp->ex_rhs = ex;
+			ex = tmp;
+			continue;
+		}
+		if (ex->ex_type == EXPR_TERNARY && ex->ex_ternary != NULL) {
+			ex->ex_lhs = ex->ex_ternary;
+			ex->ex_ternary = NULL;
+			continue;
+		}
+
+		if (ex->ex_type == EXPR_RECOVER)
+			doc_free(ex->ex_dc);
+		tmp = ex->ex_rhs;
+		free(ex);
+		ex = tmp;
+	}
+}
+
+/*
+ * Take note of the depth of the given expression. Returns non-zero if the
+ * maximum depth is exceeded, causing the current declaration to be emitted
+ * verbatim.
+ */
+static int
+expr_depth(struct expr_state *es, struct expr *ex)
+{
+	unsigned int depth = 0;
+
+	if (ex->ex_rhs != NULL && ex->ex_rhs->ex_depth > depth)
+		depth = ex->ex_rhs->ex_depth;
+	if (ex->ex_type == EXPR_TERNARY && ex->ex_ternary != NULL &&
+	    ex->ex_ternary->ex_depth > depth)
+		depth = ex->ex_ternary->ex_depth;
+	depth++;
+	if (ex->ex_lhs != NULL) {
+		unsigned int lhs = ex->ex_lhs->ex_depth;
+
+		/*
+		 * The left expression of a binary expression is laid out
+		 * without any further recursion, see expr_doc().
+		 */
+		if (!isbinary(ex))
+			lhs++;
+		if (lhs > depth)
+			depth = lhs;
+	}
+	ex->ex_depth = depth;
+	if (ex->ex_depth <= EXPR_DEPTH_MAX)
+		return 0;
+	lexer_budget_exhaust(es->es_lx);
+	return 1;
 }
 
+/*
+ * Left associative chains of binary expressions, such as a long sequence of
+ * additions or adjacent string literals, are laid out iteratively as they can
+ * be arbitrarily long. The left expression is laid out first followed by each
+ * pending binary expression on the way back up.
+ */
 static struct doc *
 expr_doc(struct expr *ex, struct expr_state *es, struct doc *parent)
 {
-	struct doc *concat, *group;
+	struct doc *concat;
+	size_t base = es->es_spine.s_len;
 
-	group = doc_alloc(DOC_GROUP, parent);
-	concat = doc_alloc(DOC_CONCAT, group);
+	for (;;) {
+		concat = doc_alloc(DOC_CONCAT, doc_alloc(DOC_GROUP, parent));
 
-	/*
-	 * Testing backdoor wrapping each expression in parenthesis used for
-	 * validation of operator precedence.
-	 */
-	if ((es->es_cf->cf_flags & CONFIG_FLAG_TEST) &&
-	    ex->ex_type != EXPR_PARENS)
-		doc_literal("(", concat);
+		/*
+		 * Testing backdoor wrapping each expression in parenthesis
+		 * used for validation of operator precedence.
+		 */
+		if ((es->es_cf->cf_flags & CONFIG_FLAG_TEST) &&
+		    ex->ex_type != EXPR_PARENS)
+			doc_literal("(", concat);
+
+		if (!isbinary(ex))
+			break;
+		expr_spine_push(es, ex, concat);
+		parent = concat;
+		ex = ex->ex_lhs;
+	}
+
+	concat = expr_doc1(ex, es, concat);
+	for (;;) {
+		struct expr_spine sp;
+
+		/* Testing backdoor, see above. */
+		if ((es->es_cf->cf_flags & CONFIG_FLAG_TEST) &&
+		    ex->ex_type != EXPR_PARENS)
+			doc_literal(")", concat);
 
+		if (es->es_spine.s_len == base)
+			break;
+		sp = es->es_spine.s_ptr[--es->es_spine.s_len];
+		ex = sp.sp_ex;
+		concat = expr_doc_binary(ex, es, sp.sp_dc, concat);
+	}
+
+	return concat;
+}
+
+static struct doc *
+expr_doc1(struct expr *ex, struct expr_state *es, struct doc *concat)
+{
 	switch (ex->ex_type) {
 	case EXPR_UNARY:
 		if (es->es_nest > 0)
@@ -567,24 +700,12 @@ expr_doc(struct expr *ex, struct expr_state *es, struct doc *parent)
 			expr_doc(ex->ex_lhs, es, concat);
 		break;
 
-	case EXPR_BINARY: {
-		struct doc *lhs;
-
-		lhs = expr_doc(ex->ex_lhs, es, concat);
-		doc_literal(" ", lhs);
-		doc_token(ex->ex_tk, lhs);
-
-		if (ex->ex_tk->tk_flags & TOKEN_FLAG_ASSIGN) {
-			doc_literal(" ", concat);
-		} else {
-			concat = doc_alloc(DOC_CONCAT,
-			    doc_alloc(DOC_GROUP, concat));
-			doc_alloc(DOC_LINE, concat);
-		}
-		concat = expr_doc(ex->ex_rhs, es, concat);
-
+	case EXPR_BINARY:
+	case EXPR_ARG:
+	case EXPR_CONCAT:
+		/* Only reached without any left expression, see expr_doc(). */
+		concat = expr_doc_binary(ex, es, concat, concat);
 		break;
-	}
 
 	case EXPR_TERNARY: {
 		struct doc *ternary;
@@ -675,21 +796,6 @@ expr_doc(struct expr *ex, struct expr_state *es, struct doc *parent)
 			doc_token(ex->ex_tokens[1], concat);	/* ) */
 		break;
 
-	case EXPR_ARG: {
-		struct doc *lhs = concat;
-
-		if (ex->ex_lhs != NULL)
-			lhs = expr_doc(ex->ex_lhs, es, concat);
-		doc_token(ex->ex_tk, lhs);
-		doc_alloc(DOC_LINE, lhs);
-		concat = doc_alloc(DOC_CONCAT, doc_alloc(DOC_GROUP, concat));
-		doc_alloc(DOC_SOFTLINE, concat);
-		es->es_soft++;
-		concat = expr_doc(ex->ex_rhs, es, concat);
-		es->es_soft--;
-		break;
-	}
-
 	case EXPR_CAST:
 		if (ex->ex_tokens[0] != NULL)
 			doc_token(ex->ex_tokens[0], concat);	/* ( */
@@ -717,12 +823,6 @@ expr_doc(struct expr *ex, struct expr_state *es, struct doc *parent)
 		}
 		break;
 
-	case EXPR_CONCAT:
-		concat = expr_doc(ex->ex_lhs, es, concat);
-		doc_alloc(DOC_LINE, concat);
-		concat = expr_doc(ex->ex_rhs, es, concat);
-		break;
-
 	case EXPR_LITERAL:
 		doc_token(ex->ex_tk, concat);
 		break;
@@ -740,10 +840,50 @@ expr_doc(struct expr *ex, struct expr_state *es, struct doc *parent)
 		break;
 	}
 
-	/* Testing backdoor, see above. */
-	if ((es->es_cf->cf_flags & CONFIG_FLAG_TEST) &&
-	    ex->ex_type != EXPR_PARENS)
-		doc_literal(")", concat);
+	return concat;
+}
+
+/*
+ * Lay out the remainder of the given binary expression, the left expression
+ * has already been laid out in the lhs document.
+ */
+static struct doc *
+expr_doc_binary(struct expr *ex, struct expr_state *es, struct doc *concat,
+    struct doc *lhs)
+{
+	switch (ex->ex_type) {
+	case EXPR_BINARY:
+		doc_literal(" ", lhs);
+		doc_token(ex->ex_tk, lhs);
+
+		if (ex->ex_tk->tk_flags & TOKEN_FLAG_ASSIGN) {
+			doc_literal(" ", concat);
+		} else {
+			concat = doc_alloc(DOC_CONCAT,
+			    doc_alloc(DOC_GROUP, concat));
+			doc_alloc(DOC_LINE, concat);
+		}
+		concat = expr_doc(ex->ex_rhs, es, concat);
+		break;
+
+	case EXPR_ARG:
+		doc_token(ex->ex_tk, lhs);
+		doc_alloc(DOC_LINE, lhs);
+		concat = doc_alloc(DOC_CONCAT, doc_alloc(DOC_GROUP, concat));
+		doc_alloc(DOC_SOFTLINE, concat);
+		es->es_soft++;
+		concat = expr_doc(ex->ex_rhs, es, concat);
+		es->es_soft--;
+		break;
+
+	case EXPR_CONCAT:
+		doc_alloc(DOC_LINE, lhs);
+		concat = expr_doc(ex->ex_rhs, es, lhs);
+		break;
+
+	default:
+		break;
+	}
 
 	return concat;
 }
@@ -821,6 +961,29 @@ expr_state_init(struct expr_state *es, const struct expr_exec_arg *ea)
 	es->es_ea = ea;
 	es->es_lx = ea->ea_lx;
 	es->es_stop = ea->ea_stop;
+	/* Expression nested in one which is only recognized. */
+	if (ea->ea_dc == doc_discard())
+		es->es_dc = ea->ea_dc;
+}
+
+static void
+expr_spine_push(struct expr_state *es, struct expr *ex, struct doc *dc)
+{
+	struct expr_spine *sp;
+
+	if (es->es_spine.s_len == es->es_spine.s_siz) {
+		size_t siz = es->es_spine.s_siz;
+
+		siz = siz == 0 ? 16 : siz * 2;
+		sp = reallocarray(es->es_spine.s_ptr, siz, sizeof(*sp));
+		if (sp == NULL)
+			err(1, NULL);
+		es->es_spine.s_ptr = sp;
+		es->es_spine.s_siz = siz;
+	}
+	sp = &es->es_spine.s_ptr[es->es_spine.s_len++];
+	sp->sp_ex = ex;
+	sp->sp_dc = dc;
 }
 
 static const struct expr_rule *
@@ -842,6 +1005,23 @@ expr_rule_find(const struct token *tk, int unary)
 	return NULL;
 }
 
+/*
+ * Returns non-zero if the given expression is a binary expression whose left
+ * expression is laid out iteratively, see expr_doc().
+ */
+static int
+isbinary(const struct expr *ex)
+{
+	switch (ex->ex_type) {
+	case EXPR_BINARY:
+	case EXPR_ARG:
+	case EXPR_CONCAT:
+		return ex->ex_lhs != NULL;
+	default:
+		return 0;
+	}
+}
+
 /*
  * Returns non-zero if a cast is present. The lexer must be positioned at the
  * beginning of an expression wrapped in parenthesis.
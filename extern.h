@@ -16,19 +16,46 @@
  * config ----------------------------------------------------------------------
  */
 
+struct config_range {
+	unsigned int	cr_beg;
+	unsigned int	cr_end;
+};
+
 struct config {
-	unsigned int	cf_flags;
+	unsigned int		 cf_flags;
 #define CONFIG_FLAG_DIFF		0x00000001u
 #define CONFIG_FLAG_INPLACE		0x00000002u
+#define CONFIG_FLAG_RECURSIVE		0x00000004u
+#define CONFIG_FLAG_PIPELINE		0x00000008u
+#define CONFIG_FLAG_FSYNC		0x00000010u
 #define CONFIG_FLAG_TEST		0x80000000u
 
-	unsigned int	cf_verbose;
-	unsigned int	cf_mw;		/* max width per line */
-	unsigned int	cf_tw;		/* tab width */
-	unsigned int	cf_sw;		/* soft width */
+	unsigned int		 cf_verbose;
+	unsigned int		 cf_mw;		/* max width per line */
+	unsigned int		 cf_tw;		/* tab width */
+	unsigned int		 cf_sw;		/* soft width */
+	unsigned int		 cf_jobs;	/* concurrent jobs per file */
+
+	unsigned long		 cf_budget;	/* work budget per declaration */
+	unsigned long		 cf_budget_file;	/* work budget per file */
+	unsigned long		 cf_deadline;	/* deadline per file in milliseconds */
+
+	unsigned int		 cf_shard;	/* 1-based shard to format */
+	unsigned int		 cf_nshards;	/* number of shards */
+
+	struct config_range	*cf_lines;	/* line ranges to format */
+	size_t			 cf_nlines;
+	const char		*cf_generated;	/* marker of generated files */
+
+	struct cache		*cf_cache;	/* cache of formatted declarations */
+	struct macros		*cf_macros;	/* known macros */
+	struct readahead	*cf_readahead;	/* files to read ahead */
+	struct output		*cf_output;	/* sink of formatted output */
+	struct trace		*cf_trace;	/* binary trace */
 };
 
 void	config_init(struct config *);
+int	config_shard(const struct config *, const char *);
 
 /*
  * buffer ----------------------------------------------------------------------
@@ -87,6 +114,7 @@ struct token {
 	unsigned int	tk_lno;
 	unsigned int	tk_cno;
 	unsigned int	tk_markers;
+	unsigned int	tk_nest;	/* nesting of brackets */
 	unsigned int	tk_flags;
 #define TOKEN_FLAG_TYPE		0x00000001u
 #define TOKEN_FLAG_QUALIFIER	0x00000002u
@@ -101,6 +129,7 @@ struct token {
 #define TOKEN_FLAG_NEWLINE	0x00000400u
 #define TOKEN_FLAG_FAKE		0x00000800u
 #define TOKEN_FLAG_FREE		0x00001000u
+#define TOKEN_FLAG_MUTE		0x00002000u
 #define TOKEN_FLAG_TYPE_ARGS	0x08000000u
 #define TOKEN_FLAG_TYPE_FUNC	0x10000000u
 
@@ -130,6 +159,9 @@ int	 token_has_dangling(const struct token *);
 int	 token_has_line(const struct token *);
 int	 token_is_branch(const struct token *);
 int	 token_is_decl(const struct token *, enum token_type);
+int	 token_is_macro_decl(const struct token *);
+int	 token_is_plain(const struct token *);
+size_t	 token_end(const struct token *, const struct buffer *);
 void	 token_trim(struct token *);
 char	*token_sprintf(const struct token *);
 
@@ -150,19 +182,33 @@ struct lexer_recover_markers {
 	struct token	*lm_markers[NMARKERS];
 };
 
-void		 lexer_init(void);
-void		 lexer_shutdown(void);
-struct lexer	*lexer_alloc(const char *, struct error *,
+struct lexer	*lexer_alloc(const char *, struct buffer *, struct error *,
     const struct config *);
 void		 lexer_free(struct lexer *);
 
 const struct buffer	*lexer_get_buffer(const struct lexer *);
+struct buffer		*lexer_release_buffer(struct lexer *);
 int			 lexer_get_error(const struct lexer *);
 
+void	lexer_budget_enter(struct lexer *);
+void	lexer_budget_exhaust(struct lexer *);
+int	lexer_budget_exhausted(const struct lexer *);
+int	lexer_budget_recover(struct lexer *, struct token **, struct token **);
+int	lexer_range_skip(struct lexer *, struct token **, struct token **);
+int	lexer_is_range_end(struct lexer *);
+
+int	lexer_cache_span(struct lexer *, struct token **, struct token **,
+    const char **, size_t *);
+void	lexer_cache_skip(struct lexer *, struct token *, struct token *);
+
+int	lexer_chunks(struct lexer *, struct token **, int);
+void	lexer_chunk_enter(struct lexer *, struct token *);
+
 void	lexer_recover_enter(struct lexer_recover_markers *);
 void	lexer_recover_leave(struct lexer_recover_markers *);
 void	lexer_recover_mark(struct lexer *, struct lexer_recover_markers *);
 void	lexer_recover_purge(struct lexer_recover_markers *);
+void	lexer_recover_macro(struct lexer *);
 
 #define lexer_recover(a, b)						\
 	__lexer_recover((a), (b), __func__, __LINE__)
@@ -223,11 +269,11 @@ void	lexer_dump(const struct lexer *);
  * parser ----------------------------------------------------------------------
  */
 
-struct parser		*parser_alloc(const char *, struct error *,
-    const struct config *);
+struct parser		*parser_alloc(const char *, struct buffer *,
+    struct error *, const struct config *);
 void			 parser_free(struct parser *);
 const struct buffer	*parser_exec(struct parser *);
-struct doc		*parser_exec_expr_recover(void *);
+struct doc		*parser_exec_expr_recover(struct doc *, void *);
 
 struct lexer	*parser_get_lexer(struct parser *);
 
@@ -244,9 +290,11 @@ struct expr_exec_arg {
 	/*
 	 * Callback invoked when an invalid expression is encountered. If the
 	 * same callback returns a document implies that the expression parser
-	 * can continue.
+	 * can continue. The document must be allocated using the given parent,
+	 * which is either NULL or a document discarding everything appended to
+	 * it while the expression is only recognized, see doc_discard().
 	 */
-	struct doc	*(*ea_recover)(void *);
+	struct doc	*(*ea_recover)(struct doc *, void *);
 	void		*ea_arg;
 };
 
@@ -283,6 +331,15 @@ void		doc_remove(struct doc *, struct doc *);
 void		doc_remove_tail(struct doc *);
 void		doc_set_indent(struct doc *, int);
 
+struct doc_state	*doc_exec_enter(const struct doc *, struct buffer *,
+    const struct config *);
+void			 doc_exec_append(const struct doc *,
+    struct doc_state *);
+void			 doc_exec_leave(const struct doc *, struct doc_state *);
+const struct doc	*doc_child(const struct doc *, size_t);
+const char		*doc_type_str(enum doc_type);
+struct doc		*doc_discard(void);
+
 #define doc_alloc(a, b) \
 	__doc_alloc((a), (b), __func__, __LINE__)
 struct doc	*__doc_alloc(enum doc_type, struct doc *, const char *, int);
@@ -313,6 +370,16 @@ struct doc	*__doc_literal(const char *, struct doc *, const char *, int);
 struct doc	*__doc_token(const struct token *, struct doc *, enum doc_type,
     const char *, int);
 
+#define doc_verbatim(a, b, c, d) \
+	__doc_verbatim((a), (b), (c), (d), __func__, __LINE__)
+struct doc	*__doc_verbatim(const struct token *, const struct token *,
+    const struct buffer *, struct doc *, const char *, int);
+
+#define doc_verbatim_str(a, b, c) \
+	__doc_verbatim_str((a), (b), (c), __func__, __LINE__)
+struct doc	*__doc_verbatim_str(const char *, size_t, struct doc *,
+    const char *, int);
+
 /*
  * ruler -----------------------------------------------------------------------
  */
@@ -344,8 +411,106 @@ void	ruler_insert(struct ruler *, const struct token *, struct doc *,
     unsigned int, unsigned int, unsigned int);
 void	ruler_exec(struct ruler *);
 
+/*
+ * cache -----------------------------------------------------------------------
+ */
+
+struct cache	*cache_alloc(const char *, const struct config *);
+void		 cache_free(struct cache *);
+int		 cache_write(struct cache *);
+const char	*cache_get(struct cache *, const char *, size_t, size_t *);
+void		 cache_put(struct cache *, const char *, size_t, const char *,
+    size_t);
+
+/*
+ * macros ----------------------------------------------------------------------
+ */
+
+enum macro_type {
+	MACRO_DECL	= 1,	/* declaration lacking trailing semicolon */
+};
+
+struct macros	*macros_alloc(const char *, const struct config *);
+void		 macros_free(struct macros *);
+int		 macros_write(struct macros *);
+int		 macros_find(const struct macros *, const struct token *);
+void		 macros_learn(struct macros *, const struct token *,
+    enum macro_type);
+void		 macros_avoided(struct macros *);
+
+/*
+ * readahead -------------------------------------------------------------------
+ */
+
+struct readahead	*readahead_alloc(void);
+void			 readahead_free(struct readahead *);
+void			 readahead_add(struct readahead *, const char *);
+struct buffer		*readahead_read(struct readahead *, const char *);
+
+/*
+ * output ----------------------------------------------------------------------
+ */
+
+struct output	*output_alloc(int);
+void		 output_free(struct output *);
+int		 output_write(struct output *, const struct buffer *);
+int		 output_flush(struct output *);
+int		 output_fd(int, const struct buffer *);
+
+/*
+ * trace -----------------------------------------------------------------------
+ */
+
+enum trace_id {
+	TRACE_DOC_ENTER,
+	TRACE_DOC_LEAVE,
+	TRACE_DOC_FITS,
+	TRACE_DOC_REFIT,
+	TRACE_DOC_TRIM,
+	TRACE_LEXER_RECOVER,
+	TRACE_LEXER_BRANCH,
+	TRACE_LEXER_SEEK,
+	TRACE_LEXER_HALT,
+	TRACE_LEXER_EXHAUST,
+	TRACE_ERROR,
+};
+
+/* Value of TRACE_DOC_FITS events. */
+#define TRACE_FITS		0x00000001
+#define TRACE_FITS_CACHED	0x00000002
+
+struct trace	*trace_alloc(const char *);
+int		 trace_free(struct trace *);
+void		 trace_file(struct trace *, const char *);
+void		 trace_flush(void);
+void		 trace_leave(void);
+int		 trace_decode(const char *);
+void		 trace_doc(struct trace *, enum trace_id, unsigned int,
+    enum doc_type, unsigned char, unsigned int, unsigned int, int);
+void		 trace_token(struct trace *, enum trace_id,
+    const struct token *, int);
+
+/*
+ * server ----------------------------------------------------------------------
+ */
+
+int	server_exec(const char *,
+    int (*)(const char *, struct buffer *, struct error *,
+	const struct config *));
+int	server_request(const char *, const char *, const struct buffer *,
+    const struct config *, struct buffer **);
+
+/*
+ * watch -----------------------------------------------------------------------
+ */
+
+int	watch_exec(char *const *, int,
+    int (*)(const char *, struct error *, const struct config *),
+    struct error *, const struct config *);
+
 /*
  * util ------------------------------------------------------------------------
  */
 
 char	*strnice(const char *, size_t);
+int	 issource(const char *);
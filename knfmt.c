@@ -1,9 +1,12 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 
+#include <dirent.h>
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,42 +16,142 @@
 
 #define _PATH_DIFF	"/usr/bin/diff"
 
+/* Maximum number of files from a list scheduled to be read ahead. */
+#define FILELIST_AHEAD	32
+
 static __dead void	usage(void);
+static unsigned long	optnum(const char *);
+static void		optrange(const char *, struct config *);
+static void		optshard(const char *, struct config *);
 
-static int	fileformat(const char *, struct error *, const struct config *);
+static int	filelist(const char *, int, const char *, struct error *,
+    const struct config *);
+static int	filelist1(int, const char *, int, const char *, struct error *,
+    const struct config *);
+static int	filewalk(int, const char *, const char *, struct error *,
+    const struct config *);
+static int	filewalk1(int, const char *, int);
+static int	fileexec(const char *, const char *, struct error *,
+    const struct config *);
+static int	fileformat(const char *, struct buffer *, struct error *,
+    const struct config *);
+static int	filechanged(const char *, struct error *,
+    const struct config *);
+static int	fileclient(const char *, const char *, struct buffer *,
+    const struct config *);
 static int	filediff(const struct buffer *, const struct buffer *,
     const char *);
 static int	filewrite(const struct buffer *, const struct buffer *,
-    const char *);
-static int	fileattr(const char *, const char *);
+    const char *, const struct config *);
+static int	fileattr(int, const char *, const struct stat *);
+static int	filesyncdir(const char *);
+static int	filedir(const char *, char *, size_t);
+static int	fileready(int);
+
+static int	tmpfd(const struct buffer *, char *, size_t);
+static void	strpush(char ***, size_t *, const char *);
 
-static int	tmpfd(const char *, char *, size_t);
+/* Files formatted by this process, reported when sharding. */
+static struct {
+	unsigned long	s_nfiles;
+	size_t		s_nbytes;
+} stats;
 
 int
 main(int argc, char *argv[])
 {
 	struct config cf;
 	struct error er;
+	const char *cachepath = NULL;
+	const char *clientpath = NULL;
+	const char *decodepath = NULL;
+	const char *listpath = NULL;
+	const char *macropath = NULL;
+	const char *serverpath = NULL;
+	const char *tracepath = NULL;
+	int listdelim = '\n';
 	int error = 0;
+	int watch = 0;
 	int ch;
 
-	if (pledge("stdio rpath wpath cpath fattr chown proc exec", NULL) == -1)
+	if (pledge("stdio rpath wpath cpath fattr chown unix proc exec",
+		    NULL) == -1)
 		err(1, "pledge");
 
 	config_init(&cf);
 	error_init(&er, &cf);
 
-	while ((ch = getopt(argc, argv, "div")) != -1) {
+	while ((ch = getopt(argc, argv,
+			    "0B:b:C:c:D:dFf:g:ij:l:M:prS:s:T:t:vw")) != -1) {
 		switch (ch) {
+		case '0':
+			listdelim = '\0';
+			break;
+		case 'B':
+			cf.cf_budget_file = optnum(optarg);
+			break;
+		case 'b':
+			cf.cf_budget = optnum(optarg);
+			break;
+		case 'C':
+			cachepath = optarg;
+			break;
+		case 'c':
+			clientpath = optarg;
+			break;
+		case 'D':
+			decodepath = optarg;
+			break;
 		case 'd':
 			cf.cf_flags |= CONFIG_FLAG_DIFF;
 			break;
+		case 'F':
+			cf.cf_flags |= CONFIG_FLAG_FSYNC;
+			break;
+		case 'f':
+			listpath = optarg;
+			break;
+		case 'g':
+			if (optarg[0] == '\0')
+				usage();
+			cf.cf_generated = optarg;
+			break;
 		case 'i':
 			cf.cf_flags |= CONFIG_FLAG_INPLACE;
 			break;
+		case 'j':
+			cf.cf_jobs = optnum(optarg);
+			break;
+		case 'l':
+			optrange(optarg, &cf);
+			break;
+		case 'M':
+			macropath = optarg;
+			break;
+		case 'p':
+			cf.cf_flags |= CONFIG_FLAG_PIPELINE;
+			break;
+		case 'r':
+			cf.cf_flags |= CONFIG_FLAG_RECURSIVE;
+			break;
+		case 'S':
+			serverpath = optarg;
+			break;
+		case 's':
+			optshard(optarg, &cf);
+			break;
+		case 'T':
+			cf.cf_deadline = optnum(optarg);
+			break;
+		case 't':
+			tracepath = optarg;
+			break;
 		case 'v':
 			cf.cf_verbose++;
 			break;
+		case 'w':
+			watch = 1;
+			break;
 		default:
 			usage();
 		}
@@ -56,40 +159,152 @@ main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
-	if (cf.cf_flags & CONFIG_FLAG_DIFF) {
+	if (decodepath != NULL) {
+		if (cachepath != NULL || clientpath != NULL ||
+		    listpath != NULL || macropath != NULL ||
+		    serverpath != NULL || cf.cf_flags != 0 || cf.cf_jobs > 0 ||
+		    cf.cf_nlines > 0 || cf.cf_nshards > 0 || watch || argc > 0)
+			usage();
+		if (pledge("stdio rpath", NULL) == -1)
+			err(1, "pledge");
+
+		error = trace_decode(decodepath);
+		error_close(&er);
+		return error;
+	}
+
+	if (serverpath != NULL) {
+		if (cachepath != NULL || clientpath != NULL ||
+		    listpath != NULL || macropath != NULL || cf.cf_flags != 0 ||
+		    cf.cf_jobs > 0 || cf.cf_nlines > 0 || cf.cf_nshards > 0 ||
+		    watch || argc > 0)
+			usage();
+		if (pledge("stdio rpath wpath cpath unix proc exec", NULL) ==
+		    -1)
+			err(1, "pledge");
+
+		error = server_exec(serverpath, fileformat);
+		error_close(&er);
+		return error;
+	}
+
+	/* Standard input is not a file that can be assigned to a shard. */
+	if (cf.cf_nshards > 0 && argc == 0 && listpath == NULL)
+		usage();
+
+	/* Only directories to watch are accepted. */
+	if (watch &&
+	    (argc == 0 || clientpath != NULL || listpath != NULL ||
+	     cf.cf_nlines > 0 || cf.cf_nshards > 0))
+		usage();
+
+	/* Must be opened before dropping the privilege to create files. */
+	if (tracepath != NULL) {
+		cf.cf_trace = trace_alloc(tracepath);
+		if (cf.cf_trace == NULL)
+			err(1, "%s", tracepath);
+	}
+
+	if (clientpath != NULL) {
+		/*
+		 * Neither line ranges, the marker of generated files, the cache
+		 * nor known macros are part of the protocol.
+		 */
+		if (cf.cf_nlines > 0 || cf.cf_generated != NULL ||
+		    cachepath != NULL || macropath != NULL)
+			usage();
+		if (cf.cf_flags & CONFIG_FLAG_RECURSIVE) {
+			/* The walk is done by another process. */
+			if (pledge("stdio rpath wpath cpath fattr chown unix "
+				    "proc", NULL) == -1)
+				err(1, "pledge");
+		} else if (cf.cf_flags & CONFIG_FLAG_INPLACE) {
+			if (pledge("stdio rpath wpath cpath fattr chown unix",
+				    NULL) == -1)
+				err(1, "pledge");
+		} else {
+			if (pledge("stdio rpath unix", NULL) == -1)
+				err(1, "pledge");
+		}
+	} else if (cf.cf_flags & CONFIG_FLAG_DIFF) {
 		if (pledge("stdio rpath wpath cpath proc exec", NULL) == -1)
 			err(1, "pledge");
+	} else if (cf.cf_jobs > 1 || (cf.cf_flags & CONFIG_FLAG_RECURSIVE)) {
+		if (pledge("stdio rpath wpath cpath fattr chown proc", NULL) ==
+		    -1)
+			err(1, "pledge");
 	} else {
 		if (cf.cf_flags & CONFIG_FLAG_INPLACE) {
 			if (pledge("stdio rpath wpath cpath fattr chown",
 				    NULL) == -1)
 				err(1, "pledge");
+		} else if (cachepath != NULL || macropath != NULL) {
+			if (pledge("stdio rpath wpath cpath", NULL) == -1)
+				err(1, "pledge");
 		} else {
 			if (pledge("stdio rpath", NULL) == -1)
 				err(1, "pledge");
 		}
 	}
 
-	lexer_init();
+	if (cachepath != NULL)
+		cf.cf_cache = cache_alloc(cachepath, &cf);
+	if (macropath != NULL)
+		cf.cf_macros = macros_alloc(macropath, &cf);
+	cf.cf_output = output_alloc(STDOUT_FILENO);
 
-	if (argc > 0) {
-		int i;
-
-		for (i = 0; i < argc; i++) {
-			if (fileformat(argv[i], &er, &cf)) {
+	if (watch) {
+		error = watch_exec(argv, argc, filechanged, &er, &cf);
+	} else {
+		if (listpath != NULL || argc > 0)
+			cf.cf_readahead = readahead_alloc();
+		if (listpath != NULL) {
+			if (filelist(listpath, listdelim, clientpath, &er, &cf))
 				error = 1;
-				error_flush(&er);
+		}
+		if (argc > 0) {
+			int i;
+
+			for (i = 0; i < argc; i++) {
+				if (config_shard(&cf, argv[i]))
+					readahead_add(cf.cf_readahead, argv[i]);
 			}
-			error_reset(&er);
+			for (i = 0; i < argc; i++) {
+				if (fileexec(argv[i], clientpath, &er, &cf)) {
+					error = 1;
+					error_flush(&er);
+				}
+				error_reset(&er);
+			}
+		} else if (listpath == NULL) {
+			error = fileexec("/dev/stdin", clientpath, &er, &cf);
+			if (error)
+				error_flush(&er);
 		}
-	} else {
-		error = fileformat("/dev/stdin", &er, &cf);
-		if (error)
-			error_flush(&er);
 	}
 
+	if (cf.cf_cache != NULL) {
+		if (cache_write(cf.cf_cache))
+			error = 1;
+		cache_free(cf.cf_cache);
+	}
+	if (cf.cf_macros != NULL) {
+		if (macros_write(cf.cf_macros))
+			error = 1;
+		macros_free(cf.cf_macros);
+	}
+	readahead_free(cf.cf_readahead);
+	if (output_flush(cf.cf_output))
+		error = 1;
+	output_free(cf.cf_output);
+	if (cf.cf_nshards > 0 && cf.cf_verbose > 0) {
+		fprintf(stderr,
+		    "knfmt: shard %u/%u: %lu file(s), %zu byte(s)\n",
+		    cf.cf_shard, cf.cf_nshards, stats.s_nfiles, stats.s_nbytes);
+	}
+	if (trace_free(cf.cf_trace))
+		error = 1;
 	error_close(&er);
-	lexer_shutdown();
 
 	return error;
 }
@@ -97,18 +312,410 @@ main(int argc, char *argv[])
 static __dead void
 usage(void)
 {
-	fprintf(stderr, "usage: knfmt [-di] [file ...]\n");
+	fprintf(stderr,
+	    "usage: knfmt [-0dFiprw] [-B budget] [-b budget] [-C cache] "
+	    "[-c socket]\n"
+	    "             [-f file] [-g marker] [-j jobs] [-l range] "
+	    "[-M macros]\n");
+	fprintf(stderr,
+	    "             [-s shard] [-T deadline] [-t trace] [file ...]\n");
+	fprintf(stderr, "       knfmt -D trace\n");
+	fprintf(stderr, "       knfmt -S socket\n");
 	exit(1);
 }
 
+static unsigned long
+optnum(const char *arg)
+{
+	char *end;
+	unsigned long num;
+
+	errno = 0;
+	num = strtoul(arg, &end, 10);
+	if (arg[0] < '0' || arg[0] > '9' || *end != '\0' || errno == ERANGE)
+		errx(1, "%s: invalid number", arg);
+	return num;
+}
+
+/*
+ * Parse a line range on the form first:last and add it to the line ranges to
+ * format.
+ */
+static void
+optrange(const char *arg, struct config *cf)
+{
+	struct config_range *cr;
+	const char *str = arg;
+	char *end;
+	unsigned long beg, last;
+
+	errno = 0;
+	beg = strtoul(str, &end, 10);
+	if (str[0] < '0' || str[0] > '9' || *end != ':' || errno == ERANGE)
+		goto err;
+	str = end + 1;
+	last = strtoul(str, &end, 10);
+	if (str[0] < '0' || str[0] > '9' || *end != '\0' || errno == ERANGE)
+		goto err;
+	if (beg == 0 || beg > last || last > UINT_MAX)
+		goto err;
+
+	cf->cf_lines = reallocarray(cf->cf_lines, cf->cf_nlines + 1,
+	    sizeof(*cf->cf_lines));
+	if (cf->cf_lines == NULL)
+		err(1, NULL);
+	cr = &cf->cf_lines[cf->cf_nlines++];
+	cr->cr_beg = beg;
+	cr->cr_end = last;
+	return;
+
+err:
+	errx(1, "%s: invalid range", arg);
+}
+
+static void
+optshard(const char *arg, struct config *cf)
+{
+	const char *str = arg;
+	char *end;
+	unsigned long n, shard;
+
+	errno = 0;
+	shard = strtoul(str, &end, 10);
+	if (str[0] < '0' || str[0] > '9' || *end != '/' || errno == ERANGE)
+		goto err;
+	str = end + 1;
+	n = strtoul(str, &end, 10);
+	if (str[0] < '0' || str[0] > '9' || *end != '\0' || errno == ERANGE)
+		goto err;
+	if (shard == 0 || shard > n || n > UINT_MAX)
+		goto err;
+
+	cf->cf_shard = shard;
+	cf->cf_nshards = n;
+	return;
+
+err:
+	errx(1, "%s: invalid shard", arg);
+}
+
+/*
+ * Format all files read from the list located at path, delimited by delim. The
+ * list is read from standard input if path is "-". Each file is formatted as
+ * soon as it has been read, allowing the list to be produced concurrently by
+ * another process. Files already present in the list are scheduled to be read
+ * ahead, but reading the list never delays the formatting of a file.
+ */
+static int
+filelist(const char *path, int delim, const char *clientpath, struct error *er,
+    const struct config *cf)
+{
+	int error, fd;
+
+	if (strcmp(path, "-") == 0)
+		return filelist1(STDIN_FILENO, path, delim, clientpath, er, cf);
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		warn("open: %s", path);
+		return 1;
+	}
+	error = filelist1(fd, path, delim, clientpath, er, cf);
+	close(fd);
+	return error;
+}
+
+static int
+filelist1(int fd, const char *path, int delim, const char *clientpath,
+    struct error *er, const struct config *cf)
+{
+	char *paths[FILELIST_AHEAD];
+	struct buffer *bf;
+	size_t npaths = 0;
+	size_t off = 0;
+	int error = 0;
+	int eof = 0;
+
+	bf = buffer_alloc(1024);
+	for (;;) {
+		while (npaths < FILELIST_AHEAD) {
+			const char *end;
+			size_t len;
+			char *p;
+
+			end = memchr(&bf->bf_ptr[off], delim, bf->bf_len - off);
+			if (end == NULL)
+				break;
+			len = (size_t)(end - &bf->bf_ptr[off]);
+			if (len > 0) {
+				p = strndup(&bf->bf_ptr[off], len);
+				if (p == NULL)
+					err(1, NULL);
+				if (config_shard(cf, p))
+					readahead_add(cf->cf_readahead, p);
+				paths[npaths++] = p;
+			}
+			off += len + 1;
+		}
+
+		if (!eof && npaths < FILELIST_AHEAD &&
+		    (npaths == 0 || fileready(fd))) {
+			char buf[BUFSIZ];
+			ssize_t n;
+
+			n = read(fd, buf, sizeof(buf));
+			if (n == -1) {
+				if (errno == EINTR)
+					continue;
+				warn("read: %s", path);
+				error = 1;
+				eof = 1;
+			} else if (n == 0) {
+				eof = 1;
+				/* The last path is not necessarily delimited. */
+				if (bf->bf_len > off)
+					buffer_appendc(bf, delim);
+			} else {
+				memmove(bf->bf_ptr, &bf->bf_ptr[off],
+				    bf->bf_len - off);
+				bf->bf_len -= off;
+				off = 0;
+				buffer_append(bf, buf, n);
+			}
+			continue;
+		}
+		if (npaths == 0)
+			break;
+
+		if (fileexec(paths[0], clientpath, er, cf)) {
+			error = 1;
+			error_flush(er);
+		}
+		error_reset(er);
+		free(paths[0]);
+		npaths--;
+		memmove(&paths[0], &paths[1], npaths * sizeof(paths[0]));
+	}
+
+	buffer_free(bf);
+	return error;
+}
+
+/*
+ * Format all C source and header files found in the directory referred to by
+ * fd, whose path is given by path. The directory is walked by a separate
+ * process writing the path of each file found to a pipe, which is consumed as
+ * a list of files. The walk therefore overlaps the formatting and files are
+ * formatted as soon as they are found. The file descriptor is closed once done.
+ */
+static int
+filewalk(int fd, const char *path, const char *clientpath, struct error *er,
+    const struct config *cf)
+{
+	pid_t pid;
+	int fds[2];
+	int error, status;
+
+	if (pipe(fds) == -1) {
+		warn("pipe");
+		close(fd);
+		return 1;
+	}
+
+	pid = fork();
+	if (pid == -1) {
+		warn("fork");
+		close(fds[0]);
+		close(fds[1]);
+		close(fd);
+		return 1;
+	}
+	if (pid == 0) {
+		close(fds[0]);
+		_exit(filewalk1(fd, path, fds[1]));
+	}
+	close(fds[1]);
+	close(fd);
+
+	error = filelist1(fds[0], path, '\0', clientpath, er, cf);
+	close(fds[0]);
+	if (waitpid(pid, &status, 0) == -1) {
+		warn("waitpid");
+		error = 1;
+	} else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		error = 1;
+	}
+	return error;
+}
+
+/*
+ * Write the path of all C source and header files found in the directory
+ * referred to by fd to out, delimited by NUL. Symbolic links are not followed
+ * and hidden entries are skipped. The files of the directory are written before
+ * traversing the subdirectories.
+ */
 static int
-fileformat(const char *path, struct error *er, const struct config *cf)
+filewalk1(int fd, const char *path, int out)
+{
+	char buf[PATH_MAX];
+	char **dirs = NULL;
+	DIR *dir;
+	struct dirent *de;
+	size_t i;
+	size_t ndirs = 0;
+	ssize_t siz = sizeof(buf);
+	int error = 0;
+
+	dir = fdopendir(fd);
+	if (dir == NULL) {
+		warn("fdopendir: %s", path);
+		close(fd);
+		return 1;
+	}
+
+	while ((de = readdir(dir)) != NULL) {
+		const char *name = de->d_name;
+		size_t len;
+		int type = de->d_type;
+		int n;
+
+		/* Hidden files and directories, such as .git, are skipped. */
+		if (name[0] == '.')
+			continue;
+
+		if (type == DT_UNKNOWN) {
+			struct stat st;
+
+			if (fstatat(dirfd(dir), name, &st,
+				    AT_SYMLINK_NOFOLLOW) == -1) {
+				warn("stat: %s/%s", path, name);
+				error = 1;
+				continue;
+			}
+			if (S_ISDIR(st.st_mode))
+				type = DT_DIR;
+			else if (S_ISREG(st.st_mode))
+				type = DT_REG;
+		}
+
+		if (type == DT_DIR) {
+			strpush(&dirs, &ndirs, name);
+			continue;
+		}
+		if (type != DT_REG || !issource(name))
+			continue;
+
+		n = snprintf(buf, siz, "%s/%s", path, name);
+		if (n < 0 || n >= siz) {
+			warnc(ENAMETOOLONG, "%s/%s", path, name);
+			error = 1;
+			continue;
+		}
+		/* Include the NUL delimiter. */
+		len = (size_t)n + 1;
+		for (i = 0; i < len;) {
+			ssize_t nw;
+
+			nw = write(out, &buf[i], len - i);
+			if (nw == -1) {
+				if (errno == EINTR)
+					continue;
+				warn("write");
+				error = 1;
+				goto out;
+			}
+			i += (size_t)nw;
+		}
+	}
+
+	for (i = 0; i < ndirs; i++) {
+		int dfd;
+		int n;
+
+		n = snprintf(buf, siz, "%s/%s", path, dirs[i]);
+		if (n < 0 || n >= siz) {
+			warnc(ENAMETOOLONG, "%s/%s", path, dirs[i]);
+			error = 1;
+			continue;
+		}
+		dfd = openat(dirfd(dir), dirs[i],
+		    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (dfd == -1) {
+			warn("open: %s", buf);
+			error = 1;
+		} else if (filewalk1(dfd, buf, out)) {
+			error = 1;
+		}
+	}
+
+out:
+	for (i = 0; i < ndirs; i++)
+		free(dirs[i]);
+	free(dirs);
+	closedir(dir);
+	return error;
+}
+
+/*
+ * Format the given file, either by the current process or by sending a request
+ * to the server listening on clientpath. Directories are traversed if
+ * requested.
+ */
+static int
+fileexec(const char *path, const char *clientpath, struct error *er,
+    const struct config *cf)
+{
+	struct buffer *bf;
+
+	if (cf->cf_flags & CONFIG_FLAG_RECURSIVE) {
+		int fd;
+
+		fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd != -1)
+			return filewalk(fd, path, clientpath, er, cf);
+		if (errno != ENOTDIR) {
+			warn("open: %s", path);
+			return 1;
+		}
+	}
+
+	/* Only directories are traversed regardless of the shard. */
+	if (!config_shard(cf, path))
+		return 0;
+
+	bf = readahead_read(cf->cf_readahead, path);
+	if (bf == NULL)
+		return 1;
+	stats.s_nfiles++;
+	stats.s_nbytes += bf->bf_len;
+	if (clientpath != NULL)
+		return fileclient(clientpath, path, bf, cf);
+	return fileformat(path, bf, er, cf);
+}
+
+/*
+ * Format the given file, invoked by watch_exec() each time the file is written.
+ */
+static int
+filechanged(const char *path, struct error *er, const struct config *cf)
+{
+	return fileexec(path, NULL, er, cf);
+}
+
+/*
+ * Format the source code in the given buffer, ownership of the buffer is
+ * transferred to the parser.
+ */
+static int
+fileformat(const char *path, struct buffer *bf, struct error *er,
+    const struct config *cf)
 {
 	const struct buffer *dst, *src;
 	struct parser *pr;
 	int error = 0;
 
-	pr = parser_alloc(path, er, cf);
+	trace_file(cf->cf_trace, path);
+	pr = parser_alloc(path, bf, er, cf);
 	if (pr == NULL) {
 		error = 1;
 		goto out;
@@ -120,18 +727,52 @@ fileformat(const char *path, struct error *er, const struct config *cf)
 	}
 
 	src = lexer_get_buffer(parser_get_lexer(pr));
-	if (cf->cf_flags & CONFIG_FLAG_DIFF)
-		error = filediff(src, dst, path);
-	else if (cf->cf_flags & CONFIG_FLAG_INPLACE)
-		error = filewrite(src, dst, path);
-	else
-		printf("%s", dst->bf_ptr);
+	if (cf->cf_flags & CONFIG_FLAG_DIFF) {
+		/* The diff is written directly to standard output. */
+		if (output_flush(cf->cf_output))
+			error = 1;
+		else
+			error = filediff(src, dst, path);
+	} else if (cf->cf_flags & CONFIG_FLAG_INPLACE) {
+		error = filewrite(src, dst, path, cf);
+	} else {
+		error = output_write(cf->cf_output, dst);
+	}
 
 out:
 	parser_free(pr);
 	return error;
 }
 
+static int
+fileclient(const char *clientpath, const char *path, struct buffer *src,
+    const struct config *cf)
+{
+	struct buffer *dst = NULL;
+	int error;
+
+	error = server_request(clientpath, path, src, cf, &dst);
+	if (dst == NULL)
+		goto out;
+
+	/*
+	 * The server already produced the diff, if requested, which takes
+	 * precedence over writing the file in place as in fileformat().
+	 */
+	if (error == 0 && (cf->cf_flags & CONFIG_FLAG_DIFF) == 0 &&
+	    (cf->cf_flags & CONFIG_FLAG_INPLACE)) {
+		buffer_appendc(src, '\0');
+		error = filewrite(src, dst, path, cf);
+	} else if (output_write(cf->cf_output, dst)) {
+		error = 1;
+	}
+
+out:
+	buffer_free(dst);
+	buffer_free(src);
+	return error;
+}
+
 static int
 filediff(const struct buffer *src, const struct buffer *dst, const char *path)
 {
@@ -142,10 +783,10 @@ filediff(const struct buffer *src, const struct buffer *dst, const char *path)
 	int error = 1;
 	int srcfd = -1;
 
-	srcfd = tmpfd(src->bf_ptr, srcpath, sizeof(srcpath));
+	srcfd = tmpfd(src, srcpath, sizeof(srcpath));
 	if (srcfd == -1)
 		goto out;
-	dstfd = tmpfd(dst->bf_ptr, dstpath, sizeof(dstpath));
+	dstfd = tmpfd(dst, dstpath, sizeof(dstpath));
 	if (dstfd == -1)
 		goto out;
 
@@ -186,17 +827,22 @@ out:
 }
 
 static int
-filewrite(const struct buffer *src, const struct buffer *dst, const char *path)
+filewrite(const struct buffer *src, const struct buffer *dst, const char *path,
+    const struct config *cf)
 {
 	char tmppath[PATH_MAX];
-	const char *buf;
+	struct stat st;
 	ssize_t siz = sizeof(tmppath);
-	size_t len;
 	int fd, n;
 
 	if (buffer_cmp(src, dst) == 0)
 		return 0;
 
+	if (stat(path, &st) == -1) {
+		warn("stat: %s", path);
+		return 1;
+	}
+
 	n = snprintf(tmppath, siz, "%s.XXXXXXXX", path);
 	if (n < 0 || n >= siz) {
 		warnc(ENAMETOOLONG, "%s", __func__);
@@ -208,25 +854,19 @@ filewrite(const struct buffer *src, const struct buffer *dst, const char *path)
 		return 1;
 	}
 
-	buf = dst->bf_ptr;
-	len = strlen(buf);
-	while (len > 0) {
-		ssize_t nw;
-
-		nw = write(fd, buf, len);
-		if (nw == -1) {
-			warn("write: %s", tmppath);
-			goto err;
-		}
-		buf += nw;
-		len -= nw;
+	if (output_fd(fd, dst)) {
+		warn("write: %s", tmppath);
+		goto err;
+	}
+	if (fileattr(fd, tmppath, &st))
+		goto err;
+	if ((cf->cf_flags & CONFIG_FLAG_FSYNC) && fsync(fd) == -1) {
+		warn("fsync: %s", tmppath);
+		goto err;
 	}
 	close(fd);
 	fd = -1;
 
-	if (fileattr(tmppath, path))
-		goto err;
-
 	/*
 	 * Atomically replace the file using rename(2), matches what
 	 * clang-format does.
@@ -235,6 +875,8 @@ filewrite(const struct buffer *src, const struct buffer *dst, const char *path)
 		warn("rename: %s", tmppath);
 		goto err;
 	}
+	if ((cf->cf_flags & CONFIG_FLAG_FSYNC) && filesyncdir(path))
+		return 1;
 
 	return 0;
 
@@ -245,45 +887,106 @@ err:
 	return 1;
 }
 
+/*
+ * Apply the mode and ownership of the file described by st to the file
+ * referred to by fd.
+ */
 static int
-fileattr(const char *srcpath, const char *dstpath)
+fileattr(int fd, const char *path, const struct stat *st)
 {
-	struct stat dstst, srcst;
+	struct stat tmpst;
 
-	if (stat(srcpath, &srcst) == -1) {
-		warn("stat: %s", srcpath);
+	if (fstat(fd, &tmpst) == -1) {
+		warn("fstat: %s", path);
 		return 1;
 	}
-	if (stat(dstpath, &dstst) == -1) {
-		warn("stat: %s", dstpath);
+
+	if (tmpst.st_mode != st->st_mode && fchmod(fd, st->st_mode) == -1) {
+		warn("fchmod: %s", path);
 		return 1;
 	}
-
-	if (srcst.st_mode != dstst.st_mode &&
-	    chmod(srcpath, dstst.st_mode) == -1) {
-		warn("chmod: %s", srcpath);
+	if ((tmpst.st_uid != st->st_uid || tmpst.st_gid != st->st_gid) &&
+	    fchown(fd, st->st_uid, st->st_gid) == -1) {
+		warn("fchown: %s", path);
 		return 1;
 	}
-	if ((srcst.st_uid != dstst.st_uid || srcst.st_gid != dstst.st_gid) &&
-	    chown(srcpath, dstst.st_uid, dstst.st_gid) == -1) {
-		warn("chown: %s", srcpath);
+
+	return 0;
+}
+
+/*
+ * Flush the directory entry of the given path to disk.
+ */
+static int
+filesyncdir(const char *path)
+{
+	char dir[PATH_MAX];
+	int error = 0;
+	int fd;
+
+	if (filedir(path, dir, sizeof(dir)))
+		return 1;
+	fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1) {
+		warn("open: %s", dir);
 		return 1;
 	}
+	if (fsync(fd) == -1) {
+		warn("fsync: %s", dir);
+		error = 1;
+	}
+	close(fd);
+	return error;
+}
+
+/*
+ * Get the directory of the given path.
+ */
+static int
+filedir(const char *path, char *buf, size_t bufsiz)
+{
+	const char *slash;
+	size_t len;
 
+	slash = strrchr(path, '/');
+	if (slash == NULL) {
+		path = ".";
+		len = 1;
+	} else {
+		len = slash == path ? 1 : (size_t)(slash - path);
+	}
+	if (len >= bufsiz) {
+		warnc(ENAMETOOLONG, "%s", __func__);
+		return 1;
+	}
+	memcpy(buf, path, len);
+	buf[len] = '\0';
 	return 0;
 }
 
+/*
+ * Returns non-zero if reading from the given file descriptor would not block.
+ */
+static int
+fileready(int fd)
+{
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	return poll(&pfd, 1, 0) == 1;
+}
+
 /*
  * Get a read/write file descriptor by creating a temporary file and write out
  * the given buffer. The file is immediately removed in the hopes of returning
  * the last reference to the file.
  */
 static int
-tmpfd(const char *buf, char *path, size_t pathsiz)
+tmpfd(const struct buffer *bf, char *path, size_t pathsiz)
 {
 	char tmppath[PATH_MAX];
 	ssize_t siz = sizeof(tmppath);
-	size_t len;
 	int n;
 	int fd = -1;
 
@@ -302,17 +1005,9 @@ tmpfd(const char *buf, char *path, size_t pathsiz)
 		goto err;
 	}
 
-	len = strlen(buf);
-	while (len > 0) {
-		ssize_t nw;
-
-		nw = write(fd, buf, len);
-		if (nw == -1) {
-			warn("write");
-			goto err;
-		}
-		buf += nw;
-		len -= nw;
+	if (output_fd(fd, bf)) {
+		warn("write");
+		goto err;
 	}
 	if (lseek(fd, 0, SEEK_SET) == -1) {
 		warn("lseek");
@@ -332,3 +1027,21 @@ err:
 	close(fd);
 	return -1;
 }
+
+/*
+ * Append a copy of the given string to the array.
+ */
+static void
+strpush(char ***arr, size_t *len, const char *str)
+{
+	char **tmp;
+
+	tmp = reallocarray(*arr, *len + 1, sizeof(*tmp));
+	if (tmp == NULL)
+		err(1, NULL);
+	tmp[*len] = strdup(str);
+	if (tmp[*len] == NULL)
+		err(1, NULL);
+	*arr = tmp;
+	(*len)++;
+}
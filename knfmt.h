@@ -0,0 +1,34 @@
+#ifndef KNFMT_H
+#define KNFMT_H
+
+#include <stddef.h>
+
+/*
+ * Public interface of libknfmt, allowing source code residing in memory to be
+ * formatted by other programs.
+ */
+
+struct knfmt;
+
+/*
+ * Configuration of a handle, members left as zero denote the defaults.
+ */
+struct knfmt_config {
+	unsigned int	kc_flags;
+#define KNFMT_FLAG_PIPELINE	0x00000001u	/* lay out while parsing */
+
+	unsigned int	kc_mw;		/* max width per line, defaults to 80 */
+	unsigned int	kc_tw;		/* tab width, defaults to 8 */
+	unsigned int	kc_sw;		/* soft width, defaults to 4 */
+
+	unsigned long	kc_budget;	/* work budget per declaration */
+	unsigned long	kc_deadline;	/* deadline per buffer in milliseconds */
+};
+
+struct knfmt	*knfmt_alloc(const struct knfmt_config *);
+void		 knfmt_free(struct knfmt *);
+int		 knfmt_format(struct knfmt *, const char *, size_t,
+    const char **, size_t *);
+const char	*knfmt_diagnostics(const struct knfmt *, size_t *);
+
+#endif
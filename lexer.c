@@ -6,6 +6,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "extern.h"
 
@@ -15,6 +16,12 @@
 #  include "compat-uthash.h"
 #endif
 
+/*
+ * Maximum nesting of brackets. Declarations nested any deeper are emitted
+ * verbatim as the parser would otherwise exhaust the stack.
+ */
+#define LEXER_NEST_MAX	256
+
 struct branch {
 	struct token		*br_cpp;
 	TAILQ_ENTRY(branch)	 br_entry;
@@ -32,10 +39,37 @@ struct lexer {
 	int		lx_eof;
 	int		lx_peek;
 	int		lx_trim;
+	unsigned int	lx_nest;	/* nesting of brackets while tokenizing */
 	enum token_type	lx_expect;
 
+	/*
+	 * Tokens about to be traversed again while muted, spanning [beg, end).
+	 * See lexer_branch().
+	 */
+	struct {
+		struct token	*m_beg;
+		struct token	*m_end;
+		unsigned int	 m_ntokens;
+	} lx_mute;
+
+	/*
+	 * Work spent, counted in tokens handed out to the parser, including
+	 * while peeking, and recover attempts. See lexer_budget_enter().
+	 */
+	struct {
+		struct timespec	 b_start;
+		struct token	*b_tok;		/* first token of declaration */
+		unsigned long	 b_decl;
+		unsigned long	 b_file;
+		int		 b_exhausted;
+		int		 b_expired;	/* deadline passed, never reset */
+	} lx_budget;
+
 	struct token_list	lx_tokens;
 	struct branch_list	lx_branches;
+
+	struct token_hash	*lx_keywords;	/* hash map of keywords */
+	struct token_hash	*lx_entries;	/* storage of hash map entries */
 };
 
 struct token_hash {
@@ -51,11 +85,15 @@ static int		 lexer_eat_spaces(struct lexer *, int);
 static struct token	*lexer_keyword(struct lexer *);
 static struct token	*lexer_keyword1(struct lexer *);
 static struct token	*lexer_comment(struct lexer *, int);
+static int		 lexer_comment_off(const struct lexer *, size_t, int,
+    const char **);
+static void		 lexer_passthrough(struct lexer *, const char *);
 static struct token	*lexer_cpp(struct lexer *);
 static struct token	*lexer_ellipsis(struct lexer *,
     const struct lexer_state *);
 static int		 lexer_eof(const struct lexer *);
 
+static void	lexer_keywords(struct lexer *);
 static int	lexer_find_token(const struct lexer *,
     const struct lexer_state *, struct token **);
 static int	lexer_buffer_strcmp(const struct lexer *,
@@ -67,6 +105,7 @@ static struct token	*lexer_emit_fake(struct lexer *, enum token_type,
     struct token *);
 static void		 lexer_emit_error(struct lexer *, enum token_type,
     const struct token *, const char *, int);
+static void		 lexer_nest(struct lexer *, struct token *);
 
 static int	lexer_peek_if_func_ptr(struct lexer *, struct token **);
 
@@ -75,6 +114,8 @@ static struct token	*lexer_recover_fold(struct lexer *, struct token *,
 static int		 lexer_recover_hard(struct lexer *,
     struct lexer_recover_markers *);
 static void		 lexer_recover_reset(struct lexer *, struct token *);
+static int		 lexer_peek_if_macro_decl(struct lexer *,
+    struct token **, struct token **);
 
 static struct token	*lexer_branch_find(struct token *, int);
 static struct token	*lexer_branch_next(const struct lexer *);
@@ -85,6 +126,21 @@ static void		 lexer_branch_leave(struct lexer *, struct token *,
 static void		 lexer_branch_link(struct lexer *, struct token *,
     struct token *);
 
+static void	lexer_mute_enter(struct lexer *, struct token *,
+    struct token *);
+static void	lexer_mute_leave(struct lexer *);
+
+static int	lexer_budget_spend(struct lexer *);
+static int	lexer_budget_expired(struct lexer *);
+static int	lexer_range_span(struct lexer *, struct token **,
+    struct token **);
+static void	lexer_budget_leave(struct lexer *);
+
+static int	lexer_verbatim_span(struct token *, struct token **,
+    struct token **);
+static void	lexer_verbatim_skip(struct lexer *, struct token *,
+    struct token *);
+
 #define lexer_trace(lx, fmt, ...) do {					\
 	if (UNLIKELY((lx)->lx_cf->cf_verbose >= 2))			\
 		__lexer_trace((lx), __func__, (fmt),			\
@@ -94,6 +150,11 @@ static void	__lexer_trace(const struct lexer *, const char *, const char *,
     ...)
 	__attribute__((__format__(printf, 3, 4)));
 
+#define lexer_event(lx, id, tk, val) do {				\
+	if (UNLIKELY((lx)->lx_cf->cf_trace != NULL))			\
+		trace_token((lx)->lx_cf->cf_trace, (id), (tk), (val));	\
+} while (0)
+
 static int	isnum(unsigned char, int);
 
 static int		 token_branch_cover(const struct token *,
@@ -107,7 +168,21 @@ static void		 token_free(struct token *);
 static void		 token_list_free(struct token_list *);
 static const char	*strtoken(enum token_type);
 
-static struct token_hash	*tokens = NULL;
+static const struct token	keywords[] = {
+#define T(t, s, f) {							\
+	.tk_type	= (t),						\
+	.tk_lno		= 0,						\
+	.tk_cno		= 0,						\
+	.tk_flags	= (f),						\
+	.tk_str		= (s),						\
+	.tk_len		= sizeof((s)) - 1,				\
+	.tk_prefixes	= { NULL, NULL },				\
+	.tk_suffixes	= { NULL, NULL },				\
+	.tk_entry	= { NULL, NULL }				\
+},
+#define A(t, s, f)	T(t, s, f)
+#include "token.h"
+};
 
 static const struct token	tkcomment = {
 	.tk_type	= TOKEN_COMMENT,
@@ -188,6 +263,25 @@ token_is_branch(const struct token *tk)
 	return token_get_branch((struct token *)tk) != NULL;
 }
 
+/*
+ * Returns non-zero if the given token is emitted as is, without any prefixes,
+ * suffixes nor hard lines.
+ */
+int
+token_is_plain(const struct token *tk)
+{
+	const struct token *nx;
+
+	if (!TAILQ_EMPTY(&tk->tk_prefixes) || !TAILQ_EMPTY(&tk->tk_suffixes))
+		return 0;
+	if (tk->tk_flags &
+	    (TOKEN_FLAG_FAKE | TOKEN_FLAG_MUTE | TOKEN_FLAG_UNMUTE |
+	     TOKEN_FLAG_NEWLINE))
+		return 0;
+	nx = TAILQ_NEXT(tk, tk_entry);
+	return nx == NULL || !token_is_branch(nx);
+}
+
 /*
  * Returns non-zero if the given token represents a declaration of the given
  * type.
@@ -208,6 +302,47 @@ token_is_decl(const struct token *tk, enum token_type type)
 	return tk->tk_type == type;
 }
 
+/*
+ * Returns non-zero if the given right parenthesis could end a preprocessor
+ * declaration lacking a trailing semicolon, i.e. it is followed by something on
+ * another line. A left brace could instead denote a function implementation.
+ */
+int
+token_is_macro_decl(const struct token *rparen)
+{
+	const struct token *nx;
+
+	nx = TAILQ_NEXT(rparen, tk_entry);
+	return nx != NULL && nx->tk_type != TOKEN_LBRACE &&
+	    token_cmp(rparen, nx) != 0;
+}
+
+/*
+ * Returns the offset of the end of the source code covered by the given token,
+ * including trailing comments and hard line(s) except for the last hard line.
+ */
+size_t
+token_end(const struct token *tk, const struct buffer *bf)
+{
+	const struct token *suffix;
+	size_t end, i;
+
+	end = tk->tk_off + tk->tk_len;
+	TAILQ_FOREACH(suffix, &tk->tk_suffixes, tk_entry) {
+		if (suffix->tk_type != TOKEN_SPACE)
+			end = suffix->tk_off + suffix->tk_len;
+	}
+	for (i = end; i < bf->bf_len; i++) {
+		char c = bf->bf_ptr[i];
+
+		if (c == '\n')
+			end = i;
+		else if (c != ' ' && c != '\t')
+			break;
+	}
+	return end;
+}
+
 /*
  * Remove any space suffixes from the given token.
  */
@@ -254,55 +389,17 @@ token_sprintf(const struct token *tk)
 }
 
 /*
- * Populate the token hash map.
+ * Tokenize the source code in the given buffer, the lexer takes ownership of
+ * the buffer. The path is only used in diagnostics.
  */
-void
-lexer_init(void)
-{
-	static struct token_hash keywords[] = {
-#define T(t, s, f) { .th_tk = {						\
-	.tk_type	= (t),						\
-	.tk_lno		= 0,						\
-	.tk_cno		= 0,						\
-	.tk_flags	= (f),						\
-	.tk_str		= (s),						\
-	.tk_len		= sizeof((s)) - 1,				\
-	.tk_prefixes	= { NULL, NULL },				\
-	.tk_suffixes	= { NULL, NULL },				\
-	.tk_entry	= { NULL, NULL }				\
-}},
-#define A(t, s, f)	T(t, s, f)
-#include "token.h"
-	};
-	unsigned int i;
-
-	for (i = 0; keywords[i].th_tk.tk_type != TOKEN_NONE; i++) {
-		struct token_hash *th = &keywords[i];
-
-		if (th->th_tk.tk_len > 0)
-			HASH_ADD_KEYPTR(th_hh, tokens, th->th_tk.tk_str,
-			    th->th_tk.tk_len, th);
-	}
-}
-
-void
-lexer_shutdown(void)
-{
-	HASH_CLEAR(th_hh, tokens);
-}
-
 struct lexer *
-lexer_alloc(const char *path, struct error *er, const struct config *cf)
+lexer_alloc(const char *path, struct buffer *bf, struct error *er,
+    const struct config *cf)
 {
 	struct branch *br;
-	struct buffer *bf;
 	struct lexer *lx;
 	int error = 0;
 
-	bf = buffer_read(path);
-	if (bf == NULL)
-		return NULL;
-
 	lx = calloc(1, sizeof(*lx));
 	if (lx == NULL)
 		err(1, NULL);
@@ -315,6 +412,9 @@ lexer_alloc(const char *path, struct error *er, const struct config *cf)
 	lx->lx_st.st_cno = 1;
 	TAILQ_INIT(&lx->lx_tokens);
 	TAILQ_INIT(&lx->lx_branches);
+	lexer_keywords(lx);
+	if (cf->cf_deadline > 0)
+		clock_gettime(CLOCK_MONOTONIC, &lx->lx_budget.b_start);
 
 	for (;;) {
 		struct token *tk;
@@ -351,10 +451,19 @@ lexer_free(struct lexer *lx)
 	if (lx == NULL)
 		return;
 
+	lexer_trace(lx, "spent %lu unit(s) of work", lx->lx_budget.b_file);
+	if (lx->lx_mute.m_ntokens > 0 && lx->lx_cf->cf_verbose >= 2) {
+		fprintf(stderr, "%s: %u token(s) traversed again\n",
+		    lx->lx_path, lx->lx_mute.m_ntokens);
+	}
+	lexer_budget_leave(lx);
+
 	while ((tk = TAILQ_FIRST(&lx->lx_tokens)) != NULL) {
 		TAILQ_REMOVE(&lx->lx_tokens, tk, tk_entry);
 		token_free(tk);
 	}
+	HASH_CLEAR(th_hh, lx->lx_keywords);
+	free(lx->lx_entries);
 	buffer_free(lx->lx_bf);
 	free(lx);
 }
@@ -365,6 +474,19 @@ lexer_get_buffer(const struct lexer *lx)
 	return lx->lx_bf;
 }
 
+/*
+ * Give back ownership of the source code buffer to the caller, allowing it to
+ * be reused once the lexer is freed.
+ */
+struct buffer *
+lexer_release_buffer(struct lexer *lx)
+{
+	struct buffer *bf = lx->lx_bf;
+
+	lx->lx_bf = NULL;
+	return bf;
+}
+
 int
 lexer_get_error(const struct lexer *lx)
 {
@@ -446,6 +568,262 @@ lexer_recover_purge(struct lexer_recover_markers *lm)
 	}
 }
 
+/*
+ * Start accounting work spent on a new top-level declaration. Once the budget
+ * is exhausted, the lexer refuses to hand out more tokens causing the parser to
+ * fail and the declaration must instead be skipped using
+ * lexer_budget_recover().
+ */
+void
+lexer_budget_enter(struct lexer *lx)
+{
+	struct token *tk;
+
+	lexer_budget_leave(lx);
+
+	if (lx->lx_st.st_tok == NULL)
+		tk = TAILQ_FIRST(&lx->lx_tokens);
+	else
+		tk = TAILQ_NEXT(lx->lx_st.st_tok, tk_entry);
+	/* Prevent the token from being freed, see token_free(). */
+	if (tk != NULL)
+		tk->tk_markers++;
+	lx->lx_budget.b_tok = tk;
+	lx->lx_budget.b_decl = 0;
+
+	/*
+	 * Check the deadline before each declaration, causing the first token
+	 * to exhaust the budget once passed.
+	 */
+	if (lx->lx_cf->cf_deadline > 0)
+		(void)lexer_budget_expired(lx);
+}
+
+int
+lexer_budget_exhausted(const struct lexer *lx)
+{
+	return lx->lx_budget.b_exhausted;
+}
+
+/*
+ * Exhaust the budget of the current top-level declaration regardless of the
+ * work spent, used when the declaration is nested too deep to be formatted.
+ */
+void
+lexer_budget_exhaust(struct lexer *lx)
+{
+	if (lx->lx_budget.b_exhausted)
+		return;
+	lexer_trace(lx, "exhausted by nesting after %lu unit(s) of work",
+	    lx->lx_budget.b_decl);
+	lexer_event(lx, TRACE_LEXER_EXHAUST, lx->lx_st.st_tok,
+	    (int)lx->lx_budget.b_decl);
+	lx->lx_budget.b_exhausted = 1;
+}
+
+/*
+ * Skip the current top-level declaration, expected to be emitted verbatim by
+ * the parser as the budget is exhausted, which is reported if verbose. The
+ * first and last token of the declaration are returned in beg and end. Returns
+ * non-zero on success.
+ */
+int
+lexer_budget_recover(struct lexer *lx, struct token **beg, struct token **end)
+{
+	if (!lexer_verbatim_span(lx->lx_budget.b_tok, beg, end))
+		return 0;
+	lexer_verbatim_skip(lx, *beg, *end);
+	if (lx->lx_cf->cf_verbose >= 1) {
+		fprintf(stderr, "%s:%u: declaration emitted verbatim\n",
+		    lx->lx_path, (*beg)->tk_lno);
+	}
+	return 1;
+}
+
+/*
+ * Skip the next top-level declaration if it does not overlap any of the line
+ * ranges to format, expected to be emitted verbatim by the parser. The first
+ * and last token of the declaration are returned in beg and end. Returns
+ * non-zero if the declaration was skipped.
+ */
+int
+lexer_range_skip(struct lexer *lx, struct token **beg, struct token **end)
+{
+	if (!lexer_range_span(lx, beg, end))
+		return 0;
+	lexer_verbatim_skip(lx, *beg, *end);
+	return 1;
+}
+
+/*
+ * Returns non-zero if the next top-level declaration does not overlap any of
+ * the line ranges to format.
+ */
+int
+lexer_is_range_end(struct lexer *lx)
+{
+	struct token *beg, *end;
+
+	return lexer_range_span(lx, &beg, &end);
+}
+
+/*
+ * Get the source code of the next block of top-level declarations, used as the
+ * key while caching its formatted output. Declarations involving branches are
+ * not eligible as their output depends on the surrounding branches. Returns
+ * non-zero on success.
+ */
+int
+lexer_cache_span(struct lexer *lx, struct token **beg, struct token **end,
+    const char **str, size_t *len)
+{
+	struct token *prefix, *tk;
+	size_t off;
+
+	/* A block of declarations could extend past the line ranges. */
+	if (lx->lx_cf->cf_nlines > 0)
+		return 0;
+
+	if (lx->lx_st.st_tok == NULL)
+		tk = TAILQ_FIRST(&lx->lx_tokens);
+	else
+		tk = TAILQ_NEXT(lx->lx_st.st_tok, tk_entry);
+	if (!lexer_verbatim_span(tk, beg, end))
+		return 0;
+
+	/*
+	 * Declarations in the same block, i.e. not separated by an empty line,
+	 * are aligned as a unit and must therefore share the same entry. The
+	 * last block is not eligible as any trailing empty line is removed,
+	 * causing the same source code to be formatted differently.
+	 */
+	for (;;) {
+		struct token *nxbeg;
+
+		tk = TAILQ_NEXT(*end, tk_entry);
+		if (tk == NULL || tk->tk_type == TOKEN_EOF)
+			return 0;
+		if (token_has_line(*end))
+			break;
+		if (!lexer_verbatim_span(tk, &nxbeg, end))
+			return 0;
+	}
+
+	for (tk = *beg;; tk = TAILQ_NEXT(tk, tk_entry)) {
+		if (tk->tk_flags & (TOKEN_FLAG_MUTE | TOKEN_FLAG_UNMUTE))
+			return 0;
+		TAILQ_FOREACH(prefix, &tk->tk_prefixes, tk_entry) {
+			if (prefix->tk_type == TOKEN_CPP_IF ||
+			    prefix->tk_type == TOKEN_CPP_ELSE ||
+			    prefix->tk_type == TOKEN_CPP_ENDIF)
+				return 0;
+		}
+		if (tk == *end)
+			break;
+	}
+	tk = TAILQ_NEXT(*end, tk_entry);
+	if (tk != NULL && token_is_branch(tk))
+		return 0;
+
+	prefix = TAILQ_FIRST(&(*beg)->tk_prefixes);
+	off = prefix != NULL ? prefix->tk_off : (*beg)->tk_off;
+	*str = &lx->lx_bf->bf_ptr[off];
+	*len = token_end(*end, lx->lx_bf) - off;
+	return 1;
+}
+
+/*
+ * Skip the tokens in the given span, see lexer_cache_span().
+ */
+void
+lexer_cache_skip(struct lexer *lx, struct token *beg, struct token *end)
+{
+	lexer_verbatim_skip(lx, beg, end);
+}
+
+/*
+ * Partition the tokens into at most n chunks of roughly equal size, formatted
+ * independently. A chunk must end with a right brace at nesting zero, outside
+ * of any branch, followed by a token positioned at the first column. The last
+ * token of each chunk is stored in ends, except for the last chunk which always
+ * ends with EOF. Returns the number of chunks.
+ */
+int
+lexer_chunks(struct lexer *lx, struct token **ends, int n)
+{
+	struct token *nx, *prefix, *tk;
+	size_t ntokens = 0;
+	size_t i = 0;
+	int depth = 0;
+	int nbranches = 0;
+	int nchunks = 1;
+
+	TAILQ_FOREACH(tk, &lx->lx_tokens, tk_entry) {
+		ntokens++;
+	}
+
+	TAILQ_FOREACH(tk, &lx->lx_tokens, tk_entry) {
+		if (nchunks == n)
+			break;
+
+		TAILQ_FOREACH(prefix, &tk->tk_prefixes, tk_entry) {
+			if (prefix->tk_type == TOKEN_CPP_IF)
+				nbranches++;
+			else if (prefix->tk_type == TOKEN_CPP_ENDIF)
+				nbranches--;
+		}
+		i++;
+
+		switch (tk->tk_type) {
+		case TOKEN_LPAREN:
+		case TOKEN_LSQUARE:
+		case TOKEN_LBRACE:
+			depth++;
+			continue;
+		case TOKEN_RPAREN:
+		case TOKEN_RSQUARE:
+			depth--;
+			continue;
+		case TOKEN_RBRACE:
+			depth--;
+			break;
+		default:
+			continue;
+		}
+
+		if (depth != 0 || nbranches != 0 || i < (ntokens * nchunks) / n)
+			continue;
+		nx = TAILQ_NEXT(tk, tk_entry);
+		if (nx == NULL || nx->tk_type == TOKEN_EOF || nx->tk_cno != 1 ||
+		    token_is_branch(nx))
+			continue;
+		TAILQ_FOREACH(prefix, &nx->tk_prefixes, tk_entry) {
+			if (prefix->tk_type == TOKEN_CPP_ELSE ||
+			    prefix->tk_type == TOKEN_CPP_ENDIF)
+				break;
+		}
+		if (prefix != NULL)
+			continue;
+
+		lexer_trace(lx, "chunk %d ends with %s", nchunks,
+		    token_sprintf(tk));
+		ends[nchunks - 1] = tk;
+		nchunks++;
+	}
+	ends[nchunks - 1] = NULL;
+	return nchunks;
+}
+
+/*
+ * Position the lexer at the beginning of the chunk following the given end
+ * token, see lexer_chunks(). A NULL token denotes the first chunk.
+ */
+void
+lexer_chunk_enter(struct lexer *lx, struct token *end)
+{
+	lx->lx_st.st_tok = end;
+}
+
 /*
  * Try to recover after encountering invalid code.
  */
@@ -459,6 +837,15 @@ __lexer_recover(struct lexer *lx, struct lexer_recover_markers *lm,
 
 	lexer_trace(lx, "from %s:%d", fun, lno);
 
+	if (lexer_budget_spend(lx))
+		return 0;
+
+	/*
+	 * Any document emitted after seeking backwards will replace the
+	 * removed ones, therefore nothing must be muted.
+	 */
+	lexer_mute_leave(lx);
+
 	lexer_recover_purge(lm);
 
 	if (lm->lm_markers[0] == NULL) {
@@ -477,6 +864,7 @@ __lexer_recover(struct lexer *lx, struct lexer_recover_markers *lm,
 	 * token. Note, we could be inside a branch.
 	 */
 	lexer_trace(lx, "back %s", token_sprintf(back));
+	lexer_event(lx, TRACE_LEXER_RECOVER, back, lno);
 	br = lexer_branch_find(back, 1);
 	if (br == NULL)
 		br = lexer_branch_find(back, 0);
@@ -530,18 +918,23 @@ __lexer_branch(struct lexer *lx, struct token **tk, const struct token *stop,
 {
 	struct token *br, *dst, *rm, *seek;
 
+	/* Not worth taking as the parser is about to give up. */
+	if (lx->lx_budget.b_exhausted)
+		return 0;
+
 	br = lexer_branch_next(lx);
 	if (br == NULL || (stop != NULL && token_branch_cover(br, stop)))
 		return 0;
 
 	dst = br->tk_branch.br_nx->tk_token;
-	seek = tk != NULL ? *tk : dst;
+	seek = tk != NULL && *tk != NULL ? *tk : dst;
 
 	lexer_trace(lx, "from %s:%d", fun, lno);
 	lexer_trace(lx, "branch from %s to %s, covering [%s, %s)",
 	    token_sprintf(br), token_sprintf(br->tk_branch.br_nx),
 	    token_sprintf(br->tk_token),
 	    token_sprintf(br->tk_branch.br_nx->tk_token));
+	lexer_event(lx, TRACE_LEXER_BRANCH, br, lno);
 
 	rm = br->tk_token;
 
@@ -571,8 +964,15 @@ __lexer_branch(struct lexer *lx, struct token **tk, const struct token *stop,
 	 */
 	dst->tk_flags |= TOKEN_FLAG_UNMUTE;
 
+	/*
+	 * Everything between the seek and destination token has already been
+	 * emitted and will be muted while being traversed again.
+	 */
+	lexer_mute_enter(lx, seek, dst);
+
 	/* Rewind causing the seek token to be next one to emit. */
 	lexer_trace(lx, "seek to %s", token_sprintf(seek));
+	lexer_event(lx, TRACE_LEXER_SEEK, seek, 0);
 	lx->lx_st.st_tok = TAILQ_PREV(seek, token_list, tk_entry);
 	lx->lx_st.st_err = 0;
 	if (tk != NULL)
@@ -631,6 +1031,7 @@ lexer_pop(struct lexer *lx, struct token **tk)
 			 */
 			lexer_trace(lx, "halt at %s",
 			    token_sprintf(st->st_tok));
+			lexer_event(lx, TRACE_LEXER_HALT, st->st_tok, 0);
 			return 0;
 		} else {
 			struct token *br = st->st_tok;
@@ -645,8 +1046,15 @@ lexer_pop(struct lexer *lx, struct token **tk)
 out:
 	if (st->st_tok == NULL)
 		return 0;
+	if (st->st_tok->tk_nest > LEXER_NEST_MAX)
+		lexer_budget_exhaust(lx);
+	/* Let the EOF token through as the parser must be able to finish. */
+	if (lexer_budget_spend(lx) && st->st_tok->tk_type != TOKEN_EOF)
+		return 0;
 	if (lx->lx_peek == 0 && lx->lx_trim)
 		token_trim(st->st_tok);
+	if (lx->lx_peek == 0 && st->st_tok == lx->lx_mute.m_end)
+		lexer_mute_leave(lx);
 	*tk = st->st_tok;
 	return 1;
 }
@@ -1432,7 +1840,9 @@ lexer_comment(struct lexer *lx, int block)
 	st = lx->lx_st;
 
 	for (;;) {
-		int cstyle;
+		const char *end;
+		size_t beg;
+		int cstyle, first;
 		unsigned char ch;
 
 		/*
@@ -1442,6 +1852,7 @@ lexer_comment(struct lexer *lx, int block)
 		oldst = lx->lx_st;
 
 		lexer_eat_spaces(lx, block);
+		beg = lx->lx_st.st_off;
 
 		if (lexer_getc(lx, &ch) || ch != '/') {
 			lx->lx_st = oldst;
@@ -1474,6 +1885,19 @@ lexer_comment(struct lexer *lx, int block)
 		ncomments++;
 		if (!block)
 			break;
+
+		/*
+		 * Everything covered by a knfmt off comment, or a generated file,
+		 * ends up in this comment and is therefore emitted verbatim.
+		 */
+		first = st.st_off == 0 && ncomments == 1;
+		if (cstyle && lexer_comment_off(lx, beg, first, &end)) {
+			if (end == NULL && lx->lx_cf->cf_verbose >= 1) {
+				fprintf(stderr, "%s: generated file\n",
+				    lx->lx_path);
+			}
+			lexer_passthrough(lx, end);
+		}
 	}
 	if (ncomments == 0)
 		return NULL;
@@ -1500,6 +1924,66 @@ lexer_comment(struct lexer *lx, int block)
 	return tk;
 }
 
+/*
+ * Returns non-zero if the comment starting at the given offset disables
+ * formatting, end is set to the comment enabling formatting again. If first is
+ * set, the comment is the first thing in the file and also recognized as a
+ * header marking the file as generated, if the marker of generated files is
+ * configured, in which case end is NULL.
+ */
+static int
+lexer_comment_off(const struct lexer *lx, size_t beg, int first,
+    const char **end)
+{
+	static const char off[] = "/* knfmt off */";
+	const char *marker = lx->lx_cf->cf_generated;
+	const char *str = &lx->lx_bf->bf_ptr[beg];
+	size_t i, len, mlen;
+
+	len = lx->lx_st.st_off - beg;
+	if (len == sizeof(off) - 1 && strncmp(str, off, len) == 0) {
+		*end = "/* knfmt on */";
+		return 1;
+	}
+	if (!first || marker == NULL)
+		return 0;
+
+	*end = NULL;
+	mlen = strlen(marker);
+	for (i = 0; i + mlen <= len; i++) {
+		if (strncmp(&str[i], marker, mlen) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Consume everything up to and including the given terminator, or until EOF if
+ * the terminator is NULL or absent.
+ */
+static void
+lexer_passthrough(struct lexer *lx, const char *end)
+{
+	const struct buffer *bf = lx->lx_bf;
+	size_t endlen = end != NULL ? strlen(end) : 0;
+	size_t off;
+
+	for (off = lx->lx_st.st_off; off < bf->bf_len; off++) {
+		if (end != NULL && bf->bf_len - off >= endlen &&
+		    strncmp(&bf->bf_ptr[off], end, endlen) == 0) {
+			off += endlen;
+			break;
+		}
+	}
+	lexer_trace(lx, "passthrough %zu byte(s)", off - lx->lx_st.st_off);
+	while (lx->lx_st.st_off < off) {
+		unsigned char ch;
+
+		if (lexer_getc(lx, &ch))
+			break;
+	}
+}
+
 static struct token *
 lexer_cpp(struct lexer *lx)
 {
@@ -1585,6 +2069,30 @@ lexer_eof(const struct lexer *lx)
 	return lx->lx_st.st_off == lx->lx_bf->bf_len;
 }
 
+/*
+ * Populate the hash map of keywords. Each lexer has its own map, allowing
+ * lexers to be used concurrently without any shared state.
+ */
+static void
+lexer_keywords(struct lexer *lx)
+{
+	size_t i, n;
+
+	n = sizeof(keywords) / sizeof(keywords[0]);
+	lx->lx_entries = reallocarray(NULL, n, sizeof(*lx->lx_entries));
+	if (lx->lx_entries == NULL)
+		err(1, NULL);
+	for (i = 0; i < n; i++) {
+		struct token_hash *th = &lx->lx_entries[i];
+
+		if (keywords[i].tk_len == 0)
+			continue;
+		th->th_tk = keywords[i];
+		HASH_ADD_KEYPTR(th_hh, lx->lx_keywords, th->th_tk.tk_str,
+		    th->th_tk.tk_len, th);
+	}
+}
+
 static int
 lexer_find_token(const struct lexer *lx, const struct lexer_state *st,
     struct token **tk)
@@ -1595,7 +2103,7 @@ lexer_find_token(const struct lexer *lx, const struct lexer_state *st,
 
 	len = lx->lx_st.st_off - st->st_off;
 	key = &lx->lx_bf->bf_ptr[st->st_off];
-	HASH_FIND(th_hh, tokens, key, len, th);
+	HASH_FIND(th_hh, lx->lx_keywords, key, len, th);
 	if (th == NULL)
 		return 0;
 	*tk = &th->th_tk;
@@ -1634,32 +2142,61 @@ lexer_emit(struct lexer *lx, const struct lexer_state *st,
 		t->tk_str = &lx->lx_bf->bf_ptr[st->st_off];
 		t->tk_len = lx->lx_st.st_off - st->st_off;
 	}
-	if ((t->tk_flags & TOKEN_FLAG_DANGLING) == 0)
+	if ((t->tk_flags & TOKEN_FLAG_DANGLING) == 0) {
 		TAILQ_INSERT_TAIL(&lx->lx_tokens, t, tk_entry);
+		lexer_nest(lx, t);
+	}
 	TAILQ_INIT(&t->tk_prefixes);
 	TAILQ_INIT(&t->tk_suffixes);
 	return t;
 }
 
+/*
+ * Take note of the nesting of brackets at the given token. The nesting is reset
+ * at the first column as a best effort to not let unbalanced brackets, such as
+ * the ones spread across preprocessor branches, accumulate.
+ */
+static void
+lexer_nest(struct lexer *lx, struct token *tk)
+{
+	if (tk->tk_cno == 1)
+		lx->lx_nest = 0;
+
+	switch (tk->tk_type) {
+	case TOKEN_LPAREN:
+	case TOKEN_LSQUARE:
+	case TOKEN_LBRACE:
+		tk->tk_nest = ++lx->lx_nest;
+		break;
+	case TOKEN_RPAREN:
+	case TOKEN_RSQUARE:
+	case TOKEN_RBRACE:
+		tk->tk_nest = lx->lx_nest;
+		if (lx->lx_nest > 0)
+			lx->lx_nest--;
+		break;
+	default:
+		tk->tk_nest = lx->lx_nest;
+		break;
+	}
+}
+
 static struct token *
 lexer_emit_fake(struct lexer *lx, enum token_type type, struct token *after)
 {
+	const struct token *kw;
 	struct token *t;
-	struct token_hash *th, *tmp;
 
-	HASH_ITER(th_hh, tokens, th, tmp) {
-		if (th->th_tk.tk_type == type)
-			break;
-	}
-	assert(th != NULL);
+	for (kw = keywords; kw->tk_type != type; kw++)
+		assert(kw->tk_type != TOKEN_NONE);
 
 	t = calloc(1, sizeof(*t));
 	if (t == NULL)
 		err(1, NULL);
 	t->tk_type = type;
 	t->tk_flags = TOKEN_FLAG_FAKE;
-	t->tk_str = th->th_tk.tk_str;
-	t->tk_len = th->th_tk.tk_len;
+	t->tk_str = kw->tk_str;
+	t->tk_len = kw->tk_len;
 	TAILQ_INIT(&t->tk_prefixes);
 	TAILQ_INIT(&t->tk_suffixes);
 	TAILQ_INSERT_AFTER(&lx->lx_tokens, after, t, tk_entry);
@@ -1688,6 +2225,7 @@ lexer_emit_error(struct lexer *lx, enum token_type type,
 	if (lx->lx_peek > 0)
 		return;
 
+	lexer_event(lx, TRACE_ERROR, tk, lno);
 	error_write(lx->lx_er, "%s: ", lx->lx_path);
 	if (lx->lx_cf->cf_verbose > 0)
 		error_write(lx->lx_er, "%s:%d: ", fun, lno);
@@ -1893,22 +2431,17 @@ lexer_recover_hard(struct lexer *lx, struct lexer_recover_markers *lm)
 
 		lx->lx_expect = TOKEN_NONE;
 	} else {
-		struct lexer_state s;
-		struct token *rparen, *semi;
-		int peek = 0;
+		struct macros *ma = lx->lx_cf->cf_macros;
+		struct token *ident, *rparen, *semi;
 
 		/*
 		 * Recover from preprocessor declaration lacking a trailing
 		 * semicolon by injecting a fake semicolon.
 		 */
-		lexer_peek_enter(lx, &s);
-		if (lexer_if(lx, TOKEN_IDENT, NULL) &&
-		    lexer_if_pair(lx, TOKEN_LPAREN, TOKEN_RPAREN, &rparen) &&
-		    !lexer_if(lx, TOKEN_SEMI, NULL))
-			peek = 1;
-		lexer_peek_leave(lx, &s);
-		if (!peek)
+		if (!lexer_peek_if_macro_decl(lx, &ident, &rparen))
 			return 0;
+		if (ma != NULL && token_is_macro_decl(rparen))
+			macros_learn(ma, ident, MACRO_DECL);
 
 		semi = lexer_emit_fake(lx, TOKEN_SEMI, rparen);
 		lexer_trace(lx, "added %s after %s", token_sprintf(semi),
@@ -1919,14 +2452,55 @@ lexer_recover_hard(struct lexer *lx, struct lexer_recover_markers *lm)
 	return 1;
 }
 
+/*
+ * Inject a fake semicolon after a preprocessor declaration known to lack a
+ * trailing semicolon, avoiding the need to recover once the parser fails.
+ */
+void
+lexer_recover_macro(struct lexer *lx)
+{
+	struct macros *ma = lx->lx_cf->cf_macros;
+	struct token *ident, *rparen, *semi;
+
+	if (ma == NULL || !lexer_peek_if_macro_decl(lx, &ident, &rparen) ||
+	    macros_find(ma, ident) != MACRO_DECL ||
+	    !token_is_macro_decl(rparen))
+		return;
+
+	semi = lexer_emit_fake(lx, TOKEN_SEMI, rparen);
+	lexer_trace(lx, "added %s after known macro %s", token_sprintf(semi),
+	    token_sprintf(ident));
+	macros_avoided(ma);
+}
+
 static void
 lexer_recover_reset(struct lexer *lx, struct token *seek)
 {
 	lexer_trace(lx, "seek to %s", token_sprintf(seek));
+	lexer_event(lx, TRACE_LEXER_SEEK, seek, 0);
 	lx->lx_st.st_tok = TAILQ_PREV(seek, token_list, tk_entry);
 	lx->lx_st.st_err = 0;
 }
 
+/*
+ * Peek for a preprocessor declaration lacking a trailing semicolon.
+ */
+static int
+lexer_peek_if_macro_decl(struct lexer *lx, struct token **ident,
+    struct token **rparen)
+{
+	struct lexer_state s;
+	int peek = 0;
+
+	lexer_peek_enter(lx, &s);
+	if (lexer_if(lx, TOKEN_IDENT, ident) &&
+	    lexer_if_pair(lx, TOKEN_LPAREN, TOKEN_RPAREN, rparen) &&
+	    !lexer_if(lx, TOKEN_SEMI, NULL))
+		peek = 1;
+	lexer_peek_leave(lx, &s);
+	return peek;
+}
+
 static struct token *
 lexer_branch_find(struct token *tk, int next)
 {
@@ -2063,6 +2637,247 @@ lexer_branch_link(struct lexer *lx, struct token *cpp, struct token *tk)
 	br->br_cpp = cpp;
 }
 
+/*
+ * Flag all tokens in the range [beg, end) as muted, instructing doc_token() to
+ * not emit any dangling tokens as the corresponding documents will not be
+ * emitted anyway.
+ */
+static void
+lexer_mute_enter(struct lexer *lx, struct token *beg, struct token *end)
+{
+	struct token *tk;
+
+	lexer_mute_leave(lx);
+
+	for (tk = beg; tk != end; tk = TAILQ_NEXT(tk, tk_entry)) {
+		tk->tk_flags |= TOKEN_FLAG_MUTE;
+		lx->lx_mute.m_ntokens++;
+	}
+	lx->lx_mute.m_beg = beg;
+	lx->lx_mute.m_end = end;
+}
+
+static void
+lexer_mute_leave(struct lexer *lx)
+{
+	struct token *tk;
+
+	if (lx->lx_mute.m_beg == NULL)
+		return;
+
+	for (tk = lx->lx_mute.m_beg; tk != lx->lx_mute.m_end;
+	    tk = TAILQ_NEXT(tk, tk_entry))
+		tk->tk_flags &= ~TOKEN_FLAG_MUTE;
+	lx->lx_mute.m_beg = NULL;
+	lx->lx_mute.m_end = NULL;
+}
+
+/*
+ * Account one unit of work. Returns non-zero if the budget is exhausted, the
+ * deadline is only checked every now and then as it requires a system call.
+ */
+static int
+lexer_budget_spend(struct lexer *lx)
+{
+	const struct config *cf = lx->lx_cf;
+
+	lx->lx_budget.b_decl++;
+	lx->lx_budget.b_file++;
+	if (lx->lx_budget.b_exhausted)
+		return 1;
+
+	if (lx->lx_budget.b_expired) {
+		lx->lx_budget.b_exhausted = 1;
+	} else if (cf->cf_budget > 0 && lx->lx_budget.b_decl > cf->cf_budget) {
+		lx->lx_budget.b_exhausted = 1;
+	} else if (cf->cf_budget_file > 0 &&
+	    lx->lx_budget.b_file > cf->cf_budget_file) {
+		lx->lx_budget.b_exhausted = 1;
+	} else if (cf->cf_deadline > 0 && (lx->lx_budget.b_file & 0x3ff) == 0) {
+		lx->lx_budget.b_exhausted = lexer_budget_expired(lx);
+	}
+	if (lx->lx_budget.b_exhausted) {
+		lexer_trace(lx, "exhausted after %lu unit(s) of work",
+		    lx->lx_budget.b_decl);
+		lexer_event(lx, TRACE_LEXER_EXHAUST, lx->lx_st.st_tok,
+		    (int)lx->lx_budget.b_decl);
+	}
+	return lx->lx_budget.b_exhausted;
+}
+
+/*
+ * Returns non-zero if the deadline has passed. Unlike the budget, which is
+ * restored once a declaration has been emitted verbatim, a passed deadline
+ * applies to all remaining declarations.
+ */
+static int
+lexer_budget_expired(struct lexer *lx)
+{
+	struct timespec now;
+	unsigned long ms;
+
+	if (lx->lx_budget.b_expired)
+		return 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (now.tv_sec - lx->lx_budget.b_start.tv_sec) * 1000 +
+	    (now.tv_nsec - lx->lx_budget.b_start.tv_nsec) / 1000000;
+	if (ms >= lx->lx_cf->cf_deadline)
+		lx->lx_budget.b_expired = 1;
+	return lx->lx_budget.b_expired;
+}
+
+/*
+ * Find the first and last token of the next top-level declaration. Returns
+ * non-zero if the declaration does not overlap any of the line ranges to
+ * format.
+ */
+static int
+lexer_range_span(struct lexer *lx, struct token **beg, struct token **end)
+{
+	const struct config *cf = lx->lx_cf;
+	struct token *tk;
+	size_t i;
+
+	if (cf->cf_nlines == 0)
+		return 0;
+
+	if (lx->lx_st.st_tok == NULL)
+		tk = TAILQ_FIRST(&lx->lx_tokens);
+	else
+		tk = TAILQ_NEXT(lx->lx_st.st_tok, tk_entry);
+	if (!lexer_verbatim_span(tk, beg, end))
+		return 0;
+
+	/*
+	 * Leading comments and preprocessor directives are not considered as
+	 * they are emitted as is regardless.
+	 */
+	for (i = 0; i < cf->cf_nlines; i++) {
+		if (cf->cf_lines[i].cr_beg <= (*end)->tk_lno &&
+		    cf->cf_lines[i].cr_end >= (*beg)->tk_lno)
+			return 0;
+	}
+	return 1;
+}
+
+static void
+lexer_budget_leave(struct lexer *lx)
+{
+	struct token *tk = lx->lx_budget.b_tok;
+
+	if (tk == NULL)
+		return;
+	if (--tk->tk_markers == 0 && (tk->tk_flags & TOKEN_FLAG_FREE))
+		token_free(tk);
+	lx->lx_budget.b_tok = NULL;
+}
+
+/*
+ * Find the first and last token of the top-level declaration starting at the
+ * given token. Tokens already emitted, i.e. muted while traversing a branch
+ * again, are excluded. Returns non-zero on success.
+ */
+static int
+lexer_verbatim_span(struct token *tk, struct token **beg, struct token **end)
+{
+	struct token *last = NULL;
+	int depth = 0;
+
+	/* The token could have been removed while taking a branch. */
+	if (tk == NULL || (tk->tk_flags & TOKEN_FLAG_FREE))
+		return 0;
+
+	while (tk != NULL && (tk->tk_flags & TOKEN_FLAG_MUTE))
+		tk = TAILQ_NEXT(tk, tk_entry);
+	if (tk == NULL || tk->tk_type == TOKEN_EOF ||
+	    (tk->tk_flags & TOKEN_FLAG_FAKE))
+		return 0;
+	*beg = tk;
+
+	/*
+	 * Find the end of the declaration, either a semicolon or a right brace
+	 * not followed by anything else on the same line.
+	 */
+	for (; tk->tk_type != TOKEN_EOF; tk = TAILQ_NEXT(tk, tk_entry)) {
+		struct token *nx;
+
+		/* A branch already taken cannot be emitted again. */
+		if (tk != *beg && (tk->tk_flags & TOKEN_FLAG_UNMUTE))
+			return 0;
+		if ((tk->tk_flags & TOKEN_FLAG_FAKE) == 0)
+			last = tk;
+
+		switch (tk->tk_type) {
+		case TOKEN_LPAREN:
+		case TOKEN_LSQUARE:
+		case TOKEN_LBRACE:
+			depth++;
+			continue;
+		case TOKEN_RPAREN:
+		case TOKEN_RSQUARE:
+			if (depth > 0)
+				depth--;
+			continue;
+		case TOKEN_RBRACE:
+			if (depth > 0)
+				depth--;
+			nx = TAILQ_NEXT(tk, tk_entry);
+			if (depth == 0 &&
+			    (nx == NULL || nx->tk_type == TOKEN_EOF ||
+			     nx->tk_lno != tk->tk_lno))
+				break;
+			continue;
+		case TOKEN_SEMI:
+			if (depth == 0)
+				break;
+			continue;
+		default:
+			continue;
+		}
+		break;
+	}
+	if (last == NULL)
+		return 0;
+	*end = last;
+	return 1;
+}
+
+/*
+ * Skip the tokens in the given span, making the next token the one following
+ * end.
+ */
+static void
+lexer_verbatim_skip(struct lexer *lx, struct token *beg, struct token *end)
+{
+	struct token *tk;
+
+	/*
+	 * Branches within the declaration are already part of the verbatim
+	 * source code and must never be taken.
+	 */
+	for (tk = beg; tk != end;) {
+		struct token *prefix;
+
+		tk = TAILQ_NEXT(tk, tk_entry);
+		TAILQ_FOREACH(prefix, &tk->tk_prefixes, tk_entry) {
+			if (prefix->tk_type == TOKEN_CPP_IF ||
+			    prefix->tk_type == TOKEN_CPP_ELSE ||
+			    prefix->tk_type == TOKEN_CPP_ENDIF)
+				token_branch_unlink(prefix);
+		}
+	}
+
+	lexer_trace(lx, "verbatim [%s, %s]", token_sprintf(beg),
+	    token_sprintf(end));
+	lexer_mute_leave(lx);
+	lx->lx_st.st_tok = end;
+	lx->lx_st.st_err = 0;
+	lx->lx_expect = TOKEN_NONE;
+	lx->lx_budget.b_decl = 0;
+	lx->lx_budget.b_exhausted = 0;
+}
+
 static void
 __lexer_trace(const struct lexer *UNUSED(lx), const char *fun, const char *fmt,
     ...)
@@ -0,0 +1,124 @@
+#include <err.h>
+#include <stdlib.h>
+
+#include "extern.h"
+#include "knfmt.h"
+
+/*
+ * Handle used to format source code residing in memory, intended to be
+ * embedded in other programs. The same handle can be used to format any number
+ * of buffers, allowing allocations to be recycled between calls.
+ */
+struct knfmt {
+	struct config	 kn_cf;
+	struct error	 kn_er;
+	struct buffer	*kn_src;	/* recycled source code buffer */
+	struct buffer	*kn_out;	/* formatted source code */
+};
+
+/*
+ * Allocate a handle using the given configuration, or the defaults if NULL.
+ * Handles share no state and can therefore be used concurrently, as long as
+ * each handle is only used by one thread at a time.
+ */
+struct knfmt *
+knfmt_alloc(const struct knfmt_config *kc)
+{
+	struct knfmt *kn;
+
+	kn = calloc(1, sizeof(*kn));
+	if (kn == NULL)
+		err(1, NULL);
+	config_init(&kn->kn_cf);
+	if (kc != NULL) {
+		if (kc->kc_flags & KNFMT_FLAG_PIPELINE)
+			kn->kn_cf.cf_flags |= CONFIG_FLAG_PIPELINE;
+		if (kc->kc_mw > 0)
+			kn->kn_cf.cf_mw = kc->kc_mw;
+		if (kc->kc_tw > 0)
+			kn->kn_cf.cf_tw = kc->kc_tw;
+		if (kc->kc_sw > 0)
+			kn->kn_cf.cf_sw = kc->kc_sw;
+		kn->kn_cf.cf_budget = kc->kc_budget;
+		kn->kn_cf.cf_deadline = kc->kc_deadline;
+	}
+	error_init(&kn->kn_er, &kn->kn_cf);
+	return kn;
+}
+
+void
+knfmt_free(struct knfmt *kn)
+{
+	if (kn == NULL)
+		return;
+
+	buffer_free(kn->kn_src);
+	buffer_free(kn->kn_out);
+	error_close(&kn->kn_er);
+	free(kn);
+}
+
+/*
+ * Format the given source code. On success, out points to the NUL-terminated
+ * formatted source code of length outlen, owned by the handle and valid until
+ * the next call. Returns non-zero if the source code could not be formatted.
+ */
+int
+knfmt_format(struct knfmt *kn, const char *src, size_t len, const char **out,
+    size_t *outlen)
+{
+	const struct buffer *dst;
+	struct buffer *bf;
+	struct parser *pr;
+	int error = 1;
+
+	if (kn->kn_src != NULL) {
+		bf = kn->kn_src;
+		kn->kn_src = NULL;
+		buffer_reset(bf);
+	} else {
+		bf = buffer_alloc(len + 1);
+	}
+	buffer_append(bf, src, len);
+
+	/* Discard the diagnostics from the last call. */
+	error_reset(&kn->kn_er);
+	pr = parser_alloc("<buffer>", bf, &kn->kn_er, &kn->kn_cf);
+	if (pr == NULL)
+		goto out;
+	dst = parser_exec(pr);
+	if (dst != NULL) {
+		if (kn->kn_out == NULL)
+			kn->kn_out = buffer_alloc(dst->bf_len);
+		buffer_reset(kn->kn_out);
+		buffer_append(kn->kn_out, dst->bf_ptr, dst->bf_len);
+		*out = kn->kn_out->bf_ptr;
+		*outlen = kn->kn_out->bf_len - 1;
+		error = 0;
+	}
+	kn->kn_src = lexer_release_buffer(parser_get_lexer(pr));
+	parser_free(pr);
+
+out:
+	/* NUL-terminate the diagnostics, see knfmt_diagnostics(). */
+	buffer_appendc(error_get_buffer(&kn->kn_er), '\0');
+	return error;
+}
+
+/*
+ * Returns the NUL-terminated diagnostics emitted by the last call to
+ * knfmt_format() and sets len to its length. The diagnostics are owned by the
+ * handle and valid until the next call.
+ */
+const char *
+knfmt_diagnostics(const struct knfmt *kn, size_t *len)
+{
+	const struct buffer *bf = kn->kn_er.er_bf;
+
+	if (bf == NULL || bf->bf_len == 0) {
+		*len = 0;
+		return "";
+	}
+	*len = bf->bf_len - 1;
+	return bf->bf_ptr;
+}
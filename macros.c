@@ -0,0 +1,286 @@
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "extern.h"
+
+#ifdef HAVE_UTHASH
+#  include <uthash.h>
+#else
+#  include "compat-uthash.h"
+#endif
+
+/*
+ * Database of identifiers known to denote macros which cannot be parsed as C,
+ * allowing the parser to classify them up front instead of recovering once
+ * the parsing fails. Identifiers are either learned from successful
+ * recoveries or loaded from a file on the following format:
+ *
+ * 	knfmt-macros <version>\n
+ * 	<type> <identifier>\n
+ * 	...
+ *
+ * The only type is decl, denoting a macro used as a declaration lacking a
+ * trailing semicolon.
+ */
+
+#define MACROS_VERSION	1
+
+struct macros_entry {
+	char		*me_str;
+	size_t		 me_len;
+	enum macro_type	 me_type;
+	UT_hash_handle	 me_hh;
+};
+
+struct macros {
+	const char		*ma_path;
+	const struct config	*ma_cf;
+	struct macros_entry	*ma_entries;
+	int			 ma_dirty;
+
+	struct {
+		unsigned long	s_nloaded;
+		unsigned long	s_nlearned;
+		unsigned long	s_navoided;
+	} ma_stats;
+};
+
+static int	macros_read(struct macros *);
+static int	macros_add(struct macros *, const char *, size_t,
+    enum macro_type);
+static void	macros_clear(struct macros *);
+
+static const char	*strmacro(enum macro_type);
+
+struct macros *
+macros_alloc(const char *path, const struct config *cf)
+{
+	struct macros *ma;
+
+	ma = calloc(1, sizeof(*ma));
+	if (ma == NULL)
+		err(1, NULL);
+	ma->ma_path = path;
+	ma->ma_cf = cf;
+
+	if (access(path, F_OK) == -1 && errno == ENOENT)
+		return ma;
+	if (macros_read(ma)) {
+		/* Start over, the invalid database is replaced once written. */
+		macros_clear(ma);
+		ma->ma_dirty = 1;
+	}
+	return ma;
+}
+
+void
+macros_free(struct macros *ma)
+{
+	if (ma == NULL)
+		return;
+
+	if (ma->ma_cf->cf_verbose > 0) {
+		fprintf(stderr,
+		    "knfmt: macros: %lu loaded, %lu learned, "
+		    "%lu recover(ies) avoided\n", ma->ma_stats.s_nloaded,
+		    ma->ma_stats.s_nlearned, ma->ma_stats.s_navoided);
+	}
+	macros_clear(ma);
+	free(ma);
+}
+
+/*
+ * Persist the database if modified. The file is replaced atomically as it
+ * could be used concurrently by another process.
+ */
+int
+macros_write(struct macros *ma)
+{
+	char path[PATH_MAX];
+	struct macros_entry *me, *tmp;
+	FILE *fp;
+	int fd, n;
+
+	if (!ma->ma_dirty)
+		return 0;
+
+	n = snprintf(path, sizeof(path), "%s.XXXXXXXX", ma->ma_path);
+	if (n < 0 || n >= (int)sizeof(path)) {
+		warnc(ENAMETOOLONG, "%s", ma->ma_path);
+		return 1;
+	}
+	fd = mkstemp(path);
+	if (fd == -1) {
+		warn("mkstemp: %s", path);
+		return 1;
+	}
+	fp = fdopen(fd, "w");
+	if (fp == NULL) {
+		warn("fdopen: %s", path);
+		close(fd);
+		goto err;
+	}
+
+	fprintf(fp, "knfmt-macros %d\n", MACROS_VERSION);
+	HASH_ITER(me_hh, ma->ma_entries, me, tmp) {
+		fprintf(fp, "%s %s\n", strmacro(me->me_type), me->me_str);
+	}
+	if (ferror(fp) | (fclose(fp) == EOF)) {
+		warn("write: %s", path);
+		goto err;
+	}
+	if (rename(path, ma->ma_path) == -1) {
+		warn("rename: %s", ma->ma_path);
+		goto err;
+	}
+	ma->ma_dirty = 0;
+	return 0;
+
+err:
+	(void)unlink(path);
+	return 1;
+}
+
+/*
+ * Returns the type of the macro denoted by the given identifier or zero if
+ * unknown.
+ */
+int
+macros_find(const struct macros *ma, const struct token *tk)
+{
+	struct macros_entry *me;
+
+	HASH_FIND(me_hh, ma->ma_entries, tk->tk_str, tk->tk_len, me);
+	return me != NULL ? (int)me->me_type : 0;
+}
+
+/*
+ * Learn that the given identifier denotes a macro of the given type.
+ */
+void
+macros_learn(struct macros *ma, const struct token *tk, enum macro_type type)
+{
+	if (macros_add(ma, tk->tk_str, tk->tk_len, type))
+		return;
+	ma->ma_stats.s_nlearned++;
+	ma->ma_dirty = 1;
+}
+
+/*
+ * Signal that a recovery was avoided thanks to the database.
+ */
+void
+macros_avoided(struct macros *ma)
+{
+	ma->ma_stats.s_navoided++;
+}
+
+static int
+macros_read(struct macros *ma)
+{
+	struct buffer *bf;
+	size_t off = 0;
+	int version;
+	int error = 0;
+	int lno = 0;
+
+	bf = buffer_read(ma->ma_path);
+	if (bf == NULL)
+		return 1;
+
+	while (off < bf->bf_len) {
+		char line[256], type[16], str[sizeof(line)];
+		const char *nl;
+		size_t len;
+		int n;
+
+		nl = memchr(&bf->bf_ptr[off], '\n', bf->bf_len - off);
+		len = (nl != NULL ? (size_t)(nl - bf->bf_ptr) : bf->bf_len) -
+		    off;
+		if (len >= sizeof(line)) {
+			error = 1;
+			break;
+		}
+		memcpy(line, &bf->bf_ptr[off], len);
+		line[len] = '\0';
+		off += len + 1;
+
+		if (lno++ == 0) {
+			if (sscanf(line, "knfmt-macros %d", &version) != 1 ||
+			    version != MACROS_VERSION) {
+				error = 1;
+				break;
+			}
+			continue;
+		}
+
+		n = sscanf(line, "%15s %255s", type, str);
+		if (n == EOF)
+			continue;
+		if (n != 2 || strcmp(type, strmacro(MACRO_DECL)) != 0 ||
+		    (!isalpha((unsigned char)str[0]) && str[0] != '_')) {
+			error = 1;
+			break;
+		}
+		if (macros_add(ma, str, strlen(str), MACRO_DECL) == 0)
+			ma->ma_stats.s_nloaded++;
+	}
+	if (error)
+		warnx("%s: invalid macros", ma->ma_path);
+
+	buffer_free(bf);
+	return error;
+}
+
+/*
+ * Returns non-zero if the identifier is already present.
+ */
+static int
+macros_add(struct macros *ma, const char *str, size_t len, enum macro_type type)
+{
+	struct macros_entry *me;
+
+	HASH_FIND(me_hh, ma->ma_entries, str, len, me);
+	if (me != NULL)
+		return 1;
+
+	me = calloc(1, sizeof(*me));
+	if (me == NULL)
+		err(1, NULL);
+	me->me_str = strndup(str, len);
+	if (me->me_str == NULL)
+		err(1, NULL);
+	me->me_len = len;
+	me->me_type = type;
+	HASH_ADD_KEYPTR(me_hh, ma->ma_entries, me->me_str, me->me_len, me);
+	return 0;
+}
+
+static void
+macros_clear(struct macros *ma)
+{
+	struct macros_entry *me, *tmp;
+
+	HASH_ITER(me_hh, ma->ma_entries, me, tmp) {
+		HASH_DELETE(me_hh, ma->ma_entries, me);
+		free(me->me_str);
+		free(me);
+	}
+	ma->ma_stats.s_nloaded = 0;
+}
+
+static const char *
+strmacro(enum macro_type type)
+{
+	switch (type) {
+	case MACRO_DECL:
+		return "decl";
+	}
+	return NULL;
+}
@@ -0,0 +1,173 @@
+#include <sys/uio.h>
+
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "extern.h"
+
+/*
+ * Output of formatted source code. Exactly the length of each buffer is
+ * written, excluding the NUL-terminator added by doc_exec(), without any
+ * intermediate copy made by stdio. Output of small files is batched and
+ * written together with the next output, at most one writev(2) per batch. No
+ * batching is done while writing to a terminal as the output would otherwise
+ * end up interleaved with diagnostics.
+ */
+
+/* Number of bytes to accumulate before writing. */
+#define OUTPUT_BATCH	(64 * 1024)
+
+struct output {
+	int		 ou_fd;
+	size_t		 ou_batch;
+	struct buffer	*ou_bf;		/* pending output */
+};
+
+static size_t	output_len(const struct buffer *);
+static int	output_writev(int, struct iovec *, int);
+
+struct output *
+output_alloc(int fd)
+{
+	struct output *ou;
+
+	ou = calloc(1, sizeof(*ou));
+	if (ou == NULL)
+		err(1, NULL);
+	ou->ou_fd = fd;
+	ou->ou_batch = isatty(fd) ? 0 : OUTPUT_BATCH;
+	ou->ou_bf = buffer_alloc(ou->ou_batch > 0 ? ou->ou_batch : 1);
+	return ou;
+}
+
+void
+output_free(struct output *ou)
+{
+	if (ou == NULL)
+		return;
+
+	buffer_free(ou->ou_bf);
+	free(ou);
+}
+
+/*
+ * Write the given buffer, excluding the NUL-terminator. If the output is NULL,
+ * the buffer is written to standard output right away.
+ */
+int
+output_write(struct output *ou, const struct buffer *bf)
+{
+	struct iovec iov[2];
+	size_t len = output_len(bf);
+	int n = 0;
+
+	if (ou == NULL) {
+		if (output_fd(STDOUT_FILENO, bf)) {
+			warn("write");
+			return 1;
+		}
+		return 0;
+	}
+
+	if (ou->ou_bf->bf_len + len < ou->ou_batch) {
+		buffer_append(ou->ou_bf, bf->bf_ptr, len);
+		return 0;
+	}
+
+	if (ou->ou_bf->bf_len > 0) {
+		iov[n].iov_base = ou->ou_bf->bf_ptr;
+		iov[n].iov_len = ou->ou_bf->bf_len;
+		n++;
+	}
+	iov[n].iov_base = bf->bf_ptr;
+	iov[n].iov_len = len;
+	n++;
+	buffer_reset(ou->ou_bf);
+	if (output_writev(ou->ou_fd, iov, n)) {
+		warn("write");
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Write any pending output. Must be done before anyone else writes to the same
+ * file descriptor.
+ */
+int
+output_flush(struct output *ou)
+{
+	struct iovec iov;
+
+	if (ou == NULL || ou->ou_bf->bf_len == 0)
+		return 0;
+
+	iov.iov_base = ou->ou_bf->bf_ptr;
+	iov.iov_len = ou->ou_bf->bf_len;
+	buffer_reset(ou->ou_bf);
+	if (output_writev(ou->ou_fd, &iov, 1)) {
+		warn("write");
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Write the given buffer to the file descriptor, excluding the NUL-terminator.
+ * Returns non-zero on failure with errno set, leaving any diagnostic to the
+ * caller.
+ */
+int
+output_fd(int fd, const struct buffer *bf)
+{
+	struct iovec iov;
+
+	iov.iov_base = bf->bf_ptr;
+	iov.iov_len = output_len(bf);
+	return output_writev(fd, &iov, 1);
+}
+
+/*
+ * Returns the length of the given buffer, excluding the NUL-terminator.
+ */
+static size_t
+output_len(const struct buffer *bf)
+{
+	if (bf->bf_len == 0)
+		return 0;
+	assert(bf->bf_ptr[bf->bf_len - 1] == '\0');
+	return bf->bf_len - 1;
+}
+
+static int
+output_writev(int fd, struct iovec *iov, int iovcnt)
+{
+	while (iovcnt > 0) {
+		ssize_t nw;
+
+		if (iov->iov_len == 0) {
+			iov++;
+			iovcnt--;
+			continue;
+		}
+
+		nw = writev(fd, iov, iovcnt);
+		if (nw == -1) {
+			if (errno == EINTR)
+				continue;
+			return 1;
+		}
+		for (; iovcnt > 0 && (size_t)nw >= iov->iov_len; iovcnt--) {
+			nw -= iov->iov_len;
+			iov++;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + nw;
+			iov->iov_len -= nw;
+		}
+	}
+	return 0;
+}
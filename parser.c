@@ -1,16 +1,28 @@
+#include <sys/wait.h>
+
 #include <assert.h>
+#include <ctype.h>
 #include <err.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "extern.h"
 
+#ifdef HAVE_PTHREAD
+#  include <pthread.h>
+#endif
+
 /* Sentinel used to signal that the parser consumed something. */
 #define PARSER_OK	0
 /* Sentinel used to signal that nothing was found. */
 #define PARSER_NOTHING	1
 
+#define PARSER_EXEC_DECL_FLAG_ALIGN	0x00000001u	/* align declarations */
+#define PARSER_EXEC_DECL_FLAG_TOP	0x00000002u	/* top-level declarations */
+
 enum parser_peek {
 	PARSER_PEEK_FUNCDECL	= 1,
 	PARSER_PEEK_FUNCIMPL	= 2,
@@ -22,6 +34,7 @@ struct parser {
 	const struct config	*pr_cf;
 	struct lexer		*pr_lx;
 	struct buffer		*pr_bf;
+	struct buffer		*pr_cache;	/* scratch buffer used by cache */
 	struct doc		*pr_dc;
 	unsigned int		 pr_error;
 	unsigned int		 pr_expr;
@@ -29,6 +42,36 @@ struct parser {
 	unsigned int		 pr_dowhile;
 };
 
+struct parser_cache {
+	struct token	*pc_beg;
+	struct token	*pc_end;
+	const char	*pc_src;
+	size_t		 pc_len;
+};
+
+/*
+ * Layout of top-level documents performed by a separate thread while the parser
+ * continues with the next declaration.
+ */
+struct parser_layout {
+#ifdef HAVE_PTHREAD
+	pthread_t	pl_thread;
+	pthread_mutex_t	pl_lock;
+	pthread_cond_t	pl_cond;
+#endif
+	const char		*pl_path;
+	const struct doc	*pl_dc;
+	struct buffer		*pl_bf;
+	const struct config	*pl_cf;
+	size_t			 pl_nfinal;	/* number of final documents */
+	int			 pl_done;
+	int			 pl_abort;
+
+	/* final documents, only accessed while holding the lock */
+	const struct doc	**pl_docs;
+	size_t			  pl_siz;
+};
+
 struct parser_exec_func_proto_arg {
 	struct doc		*pa_dc;
 	struct ruler		*pa_rl;
@@ -37,7 +80,20 @@ struct parser_exec_func_proto_arg {
 	struct doc		*pa_out;
 };
 
-static int	parser_exec_decl(struct parser *, struct doc *, int);
+static int	parser_exec1(struct parser *, const struct token *, int,
+    struct parser_layout *);
+static int	parser_exec_jobs(struct parser *);
+static int	parser_exec_chunk(struct parser *, struct token *,
+    const struct token *, int);
+
+static int	parser_layout_enter(struct parser *, struct parser_layout *);
+static int	parser_layout_leave(struct parser_layout *);
+static void	parser_layout_publish(struct parser_layout *, size_t);
+static void	parser_layout_abort(struct parser_layout *);
+
+static void	parser_exec_range_lines(struct parser *, const struct token *,
+    struct doc *);
+static int	parser_exec_decl(struct parser *, struct doc *, unsigned int);
 static int	parser_exec_decl1(struct parser *, struct doc *,
     struct ruler *);
 static int	parser_exec_decl_init(struct parser *, struct doc *,
@@ -47,6 +103,8 @@ static int	parser_exec_decl_braces1(struct parser *, struct doc *,
     struct ruler *);
 static int	parser_exec_decl_braces_fields(struct parser *, struct doc *,
     struct ruler *, const struct token *);
+static int	parser_exec_decl_braces_literal(struct parser *, struct doc *,
+    const struct token *, unsigned int *);
 static int	parser_exec_decl_braces_field(struct parser *, struct doc *,
     struct ruler *, const struct token *);
 static int	parser_exec_decl_cpp(struct parser *, struct doc *,
@@ -82,6 +140,11 @@ static int	parser_exec_type(struct parser *, struct doc *,
 static int	parser_exec_attributes(struct parser *, struct doc *,
     struct doc **, unsigned int, enum doc_type);
 
+static int	parser_cache_get(struct parser *, struct doc *,
+    struct parser_cache *);
+static void	parser_cache_put(struct parser *, const struct doc *,
+    const struct parser_cache *);
+
 static enum parser_peek	parser_peek_func(struct parser *, struct token **);
 
 static unsigned int	parser_width(struct parser *, const struct doc *);
@@ -95,12 +158,13 @@ static int	parser_ok(const struct parser *);
 static void	parser_reset(struct parser *);
 
 struct parser *
-parser_alloc(const char *path, struct error *er, const struct config *cf)
+parser_alloc(const char *path, struct buffer *bf, struct error *er,
+    const struct config *cf)
 {
 	struct parser *pr;
 	struct lexer *lex;
 
-	lex = lexer_alloc(path, er, cf);
+	lex = lexer_alloc(path, bf, er, cf);
 	if (lex == NULL)
 		return NULL;
 
@@ -123,6 +187,7 @@ parser_free(struct parser *pr)
 	doc_free(pr->pr_dc);
 	lexer_free(pr->pr_lx);
 	buffer_free(pr->pr_bf);
+	buffer_free(pr->pr_cache);
 	free(pr);
 }
 
@@ -134,43 +199,160 @@ parser_get_lexer(struct parser *pr)
 
 const struct buffer *
 parser_exec(struct parser *pr)
+{
+	struct parser_layout pl;
+	const struct config *cf = pr->pr_cf;
+	struct parser_layout *layout = NULL;
+	int layout_done = 0;
+	int error;
+
+	pr->pr_bf = buffer_alloc(lexer_get_buffer(pr->pr_lx)->bf_siz);
+
+	/*
+	 * The cache is only populated by the current process, therefore
+	 * refrain from formatting concurrently.
+	 */
+	if (cf->cf_jobs > 1 && cf->cf_cache == NULL &&
+	    parser_exec_jobs(pr) == 0)
+		return pr->pr_bf;
+
+	pr->pr_dc = doc_alloc(DOC_CONCAT, NULL);
+	/* Traces emitted by both threads would end up interleaved. */
+	if ((cf->cf_flags & CONFIG_FLAG_PIPELINE) && cf->cf_verbose < 2 &&
+	    parser_layout_enter(pr, &pl) == 0)
+		layout = &pl;
+	error = parser_exec1(pr, NULL, 0, layout);
+	if (layout != NULL) {
+		if (error)
+			parser_layout_abort(layout);
+		if (parser_layout_leave(layout) == 0) {
+			/* The parser buffer is used as scratch while parsing. */
+			buffer_free(pr->pr_bf);
+			pr->pr_bf = layout->pl_bf;
+			layout_done = 1;
+		}
+	}
+	if (error) {
+		parser_error(pr);
+		return NULL;
+	}
+	if (!layout_done)
+		doc_exec(pr->pr_dc, pr->pr_bf, pr->pr_cf);
+	return pr->pr_bf;
+}
+
+/*
+ * Format all top-level declarations up to and including the given stop token,
+ * or until EOF if NULL. While formatting a chunk, recovery is not allowed as it
+ * could affect declarations part of another chunk. If layout is not NULL,
+ * top-level documents are handed over to the layout thread once final.
+ */
+static int
+parser_exec1(struct parser *pr, const struct token *stop, int chunk,
+    struct parser_layout *layout)
 {
 	struct lexer_recover_markers lm;
 	struct lexer *lx = pr->pr_lx;
 	struct token *seek;
+	size_t ndocs = 0;
+	int formatted = 0;	/* previous declaration not emitted verbatim */
 	int error = 0;
 
-	pr->pr_bf = buffer_alloc(lexer_get_buffer(lx)->bf_siz);
-	pr->pr_dc = doc_alloc(DOC_CONCAT, NULL);
-
 	if (!lexer_peek(lx, &seek))
 		seek = NULL;
 
 	lexer_recover_enter(&lm);
 	for (;;) {
+		struct parser_cache pc;
 		struct doc *dc;
-		struct token *tk;
+		struct token *beg, *end, *tk;
 		int r;
 
+		if (stop != NULL && lexer_back(lx, &tk)) {
+			if (tk == stop)
+				break;
+			/* Declaration spanning more than one chunk. */
+			if (tk->tk_off > stop->tk_off) {
+				error = 1;
+				break;
+			}
+		}
+
 		dc = doc_alloc(DOC_CONCAT, pr->pr_dc);
+		/*
+		 * Recovery can remove up to NMARKERS documents, including the
+		 * current one. All documents preceding them are final.
+		 */
+		if (layout != NULL && ++ndocs > NMARKERS)
+			parser_layout_publish(layout, ndocs - NMARKERS);
 
 		/* Always emit EOF token as it could have dangling tokens. */
 		if (lexer_if(lx, TOKEN_EOF, &tk)) {
 			doc_token(tk, dc);
+			if (layout != NULL)
+				parser_layout_publish(layout, ndocs);
 			break;
 		}
 
+		lexer_budget_enter(lx);
 		lexer_recover_mark(lx, &lm);
 
-		if (parser_exec_decl(pr, dc, 1) &&
-		    parser_exec_func_impl(pr, dc))
+		if (lexer_range_skip(lx, &beg, &end)) {
+			/* Outside of the line ranges to format. */
+			if (formatted)
+				parser_exec_range_lines(pr, beg, dc);
+			doc_verbatim(beg, end, lexer_get_buffer(lx), dc);
+			doc_alloc(DOC_HARDLINE, dc);
+			/* Nothing to traverse again while branching. */
+			seek = NULL;
+			formatted = 0;
+		} else if (parser_cache_get(pr, dc, &pc)) {
+			/* Formatted output already present in the cache. */
+			formatted = 1;
+		} else if (parser_exec_decl(pr, dc,
+			    PARSER_EXEC_DECL_FLAG_ALIGN |
+			    PARSER_EXEC_DECL_FLAG_TOP) &&
+		    parser_exec_func_impl(pr, dc)) {
 			error = 1;
-		else if (parser_halted(pr))
+		} else if (parser_halted(pr)) {
 			error = 1;
-		else
+		} else {
 			doc_alloc(DOC_HARDLINE, dc);
+			parser_cache_put(pr, dc, &pc);
+			formatted = 1;
+		}
+
+		if (lexer_budget_exhausted(lx)) {
+			/*
+			 * Too much work spent on the current declaration,
+			 * replace whatever has been emitted with the source
+			 * code as is.
+			 */
+			error = 1;
+			if (lexer_budget_recover(lx, &beg, &end)) {
+				doc_remove(dc, pr->pr_dc);
+				dc = doc_alloc(DOC_CONCAT, pr->pr_dc);
+				doc_verbatim(beg, end, lexer_get_buffer(lx),
+				    dc);
+				doc_alloc(DOC_HARDLINE, dc);
+				parser_reset(pr);
+				/* Nothing to traverse again while branching. */
+				seek = NULL;
+				formatted = 0;
+				error = 0;
+			}
+		}
 
-		if (error && (r = lexer_recover(lx, &lm))) {
+		if (error && !chunk && (r = lexer_recover(lx, &lm))) {
+			if (layout != NULL) {
+				/*
+				 * Consecutive recoveries could remove documents
+				 * already handed over to the layout thread.
+				 */
+				if (ndocs - r < layout->pl_nfinal)
+					parser_layout_abort(layout);
+				ndocs -= r;
+			}
 			while (r-- > 0)
 				doc_remove_tail(pr->pr_dc);
 			parser_reset(pr);
@@ -187,15 +369,294 @@ parser_exec(struct parser *pr)
 		}
 	}
 	lexer_recover_leave(&lm);
-	if (error) {
-		parser_error(pr);
-		return NULL;
+	return error;
+}
+
+/*
+ * Format chunks of the source code concurrently, each chunk is formatted by a
+ * separate process inheriting the already lexed tokens. Returns non-zero if
+ * the source code could not be formatted in chunks, the caller is then
+ * expected to format it serially.
+ */
+static int
+parser_exec_jobs(struct parser *pr)
+{
+	struct token **ends;
+	pid_t *pids;
+	int *fds;
+	int error = 0;
+	int i, n;
+	int nchunks = 0;
+
+	ends = reallocarray(NULL, pr->pr_cf->cf_jobs, sizeof(*ends));
+	if (ends == NULL)
+		err(1, NULL);
+	n = lexer_chunks(pr->pr_lx, ends, pr->pr_cf->cf_jobs);
+	if (n == 1) {
+		free(ends);
+		return 1;
+	}
+	pids = reallocarray(NULL, n, sizeof(*pids));
+	fds = reallocarray(NULL, n, sizeof(*fds));
+	if (pids == NULL || fds == NULL)
+		err(1, NULL);
+	/* Prevent pending events from being written by the children. */
+	trace_flush();
+
+	for (i = 0; i < n; i++) {
+		int fd[2];
+
+		if (pipe(fd) == -1) {
+			warn("pipe");
+			error = 1;
+			break;
+		}
+		pids[i] = fork();
+		if (pids[i] == -1) {
+			warn("fork");
+			close(fd[0]);
+			close(fd[1]);
+			error = 1;
+			break;
+		}
+		if (pids[i] == 0) {
+			close(fd[0]);
+			error = parser_exec_chunk(pr,
+			    i > 0 ? ends[i - 1] : NULL, ends[i], fd[1]);
+			trace_flush();
+			_exit(error);
+		}
+		close(fd[1]);
+		fds[i] = fd[0];
+		nchunks++;
+	}
+
+	/* Concatenate the output of all chunks. */
+	for (i = 0; i < nchunks; i++) {
+		char buf[BUFSIZ];
+		int status;
+
+		for (;;) {
+			ssize_t nr;
+
+			nr = read(fds[i], buf, sizeof(buf));
+			if (nr == -1) {
+				if (errno == EINTR)
+					continue;
+				warn("read");
+				error = 1;
+				break;
+			}
+			if (nr == 0)
+				break;
+			if (!error)
+				buffer_append(pr->pr_bf, buf, nr);
+		}
+		close(fds[i]);
+
+		if (waitpid(pids[i], &status, 0) == -1) {
+			warn("waitpid");
+			error = 1;
+		} else if (WIFEXITED(status) == 0 || WEXITSTATUS(status) != 0) {
+			error = 1;
+		}
 	}
 
+	if (error)
+		buffer_reset(pr->pr_bf);
+	else
+		buffer_appendc(pr->pr_bf, '\0');
+	free(fds);
+	free(pids);
+	free(ends);
+	return error;
+}
+
+/*
+ * Format the chunk following the given beg token up to and including the end
+ * token, writing the output to the given file descriptor. Only invoked by a
+ * child process, see parser_exec_jobs().
+ */
+static int
+parser_exec_chunk(struct parser *pr, struct token *beg,
+    const struct token *end, int fd)
+{
+	lexer_chunk_enter(pr->pr_lx, beg);
+	pr->pr_dc = doc_alloc(DOC_CONCAT, NULL);
+	if (parser_exec1(pr, end, 1, NULL))
+		return 1;
 	doc_exec(pr->pr_dc, pr->pr_bf, pr->pr_cf);
-	return pr->pr_bf;
+	return output_fd(fd, pr->pr_bf);
 }
 
+#ifdef HAVE_PTHREAD
+
+static void	*parser_layout(void *);
+
+/*
+ * Start the layout thread. Returns non-zero if the thread could not be
+ * started, the caller is then expected to perform the layout serially.
+ */
+static int
+parser_layout_enter(struct parser *pr, struct parser_layout *pl)
+{
+	memset(pl, 0, sizeof(*pl));
+	pl->pl_path = pr->pr_path;
+	pl->pl_dc = pr->pr_dc;
+	pl->pl_cf = pr->pr_cf;
+	if (pthread_mutex_init(&pl->pl_lock, NULL))
+		return 1;
+	if (pthread_cond_init(&pl->pl_cond, NULL))
+		goto err1;
+	pl->pl_bf = buffer_alloc(pr->pr_bf->bf_siz);
+	if (pthread_create(&pl->pl_thread, NULL, parser_layout, pl))
+		goto err2;
+	return 0;
+
+err2:
+	buffer_free(pl->pl_bf);
+	pthread_cond_destroy(&pl->pl_cond);
+err1:
+	pthread_mutex_destroy(&pl->pl_lock);
+	return 1;
+}
+
+/*
+ * Wait for the layout thread to finish. Returns non-zero if the layout was
+ * aborted, the caller is then expected to perform the layout serially.
+ * Otherwise, the caller takes ownership of the layout buffer.
+ */
+static int
+parser_layout_leave(struct parser_layout *pl)
+{
+	if (!pl->pl_abort) {
+		pthread_mutex_lock(&pl->pl_lock);
+		pl->pl_done = 1;
+		pthread_cond_signal(&pl->pl_cond);
+		pthread_mutex_unlock(&pl->pl_lock);
+		pthread_join(pl->pl_thread, NULL);
+	}
+	pthread_cond_destroy(&pl->pl_cond);
+	pthread_mutex_destroy(&pl->pl_lock);
+	free(pl->pl_docs);
+	if (pl->pl_abort) {
+		buffer_free(pl->pl_bf);
+		pl->pl_bf = NULL;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Hand over the first nfinal top-level documents to the layout thread. The
+ * documents must not be altered by the parser from now on.
+ */
+static void
+parser_layout_publish(struct parser_layout *pl, size_t nfinal)
+{
+	size_t i;
+
+	if (pl->pl_abort || nfinal <= pl->pl_nfinal)
+		return;
+
+	pthread_mutex_lock(&pl->pl_lock);
+	/*
+	 * The children of the top-level document could be reallocated while
+	 * the parser appends to it, the layout thread is therefore handed over
+	 * a copy of the final ones.
+	 */
+	if (nfinal > pl->pl_siz) {
+		const struct doc **docs;
+		size_t siz = pl->pl_siz > 0 ? pl->pl_siz : 64;
+
+		while (siz < nfinal)
+			siz *= 2;
+		docs = reallocarray(pl->pl_docs, siz, sizeof(*docs));
+		if (docs == NULL)
+			err(1, NULL);
+		pl->pl_docs = docs;
+		pl->pl_siz = siz;
+	}
+	for (i = pl->pl_nfinal; i < nfinal; i++)
+		pl->pl_docs[i] = doc_child(pl->pl_dc, i);
+	pl->pl_nfinal = nfinal;
+	pthread_cond_signal(&pl->pl_cond);
+	pthread_mutex_unlock(&pl->pl_lock);
+}
+
+/*
+ * Stop the layout thread, allowing the parser to alter documents already
+ * handed over.
+ */
+static void
+parser_layout_abort(struct parser_layout *pl)
+{
+	if (pl->pl_abort)
+		return;
+
+	pthread_mutex_lock(&pl->pl_lock);
+	pl->pl_abort = 1;
+	pthread_cond_signal(&pl->pl_cond);
+	pthread_mutex_unlock(&pl->pl_lock);
+	pthread_join(pl->pl_thread, NULL);
+}
+
+static void *
+parser_layout(void *arg)
+{
+	struct parser_layout *pl = arg;
+	struct doc_state *st;
+	size_t n = 0;
+
+	/* The binary trace is recorded per thread. */
+	trace_file(pl->pl_cf->cf_trace, pl->pl_path);
+	st = doc_exec_enter(pl->pl_dc, pl->pl_bf, pl->pl_cf);
+	for (;;) {
+		const struct doc *dc = NULL;
+
+		pthread_mutex_lock(&pl->pl_lock);
+		while (n == pl->pl_nfinal && !pl->pl_done && !pl->pl_abort)
+			pthread_cond_wait(&pl->pl_cond, &pl->pl_lock);
+		if (!pl->pl_abort && n < pl->pl_nfinal)
+			dc = pl->pl_docs[n];
+		pthread_mutex_unlock(&pl->pl_lock);
+		if (dc == NULL)
+			break;
+
+		doc_exec_append(dc, st);
+		n++;
+	}
+	doc_exec_leave(pl->pl_dc, st);
+	trace_leave();
+	return NULL;
+}
+
+#else
+
+static int
+parser_layout_enter(struct parser *UNUSED(pr), struct parser_layout *UNUSED(pl))
+{
+	return 1;
+}
+
+static int
+parser_layout_leave(struct parser_layout *UNUSED(pl))
+{
+	return 1;
+}
+
+static void
+parser_layout_publish(struct parser_layout *UNUSED(pl), size_t UNUSED(nfinal))
+{
+}
+
+static void
+parser_layout_abort(struct parser_layout *UNUSED(pl))
+{
+}
+
+#endif
+
 /*
  * Callback routine invoked by expression parser while encountering an invalid
  * expression. This can happen while encountering one of the following
@@ -206,7 +667,7 @@ parser_exec(struct parser *pr)
  * 	cast expression followed by brace initializer
  */
 struct doc *
-parser_exec_expr_recover(void *arg)
+parser_exec_expr_recover(struct doc *parent, void *arg)
 {
 	struct doc *dc = NULL;
 	struct parser *pr = arg;
@@ -220,7 +681,7 @@ parser_exec_expr_recover(void *arg)
 		if (pv != NULL &&
 		    (pv->tk_type == TOKEN_LPAREN ||
 		     pv->tk_type == TOKEN_COMMA)) {
-			dc = doc_alloc(DOC_CONCAT, NULL);
+			dc = doc_alloc(DOC_CONCAT, parent);
 			doc_token(tk, dc);
 		}
 	} else if (lexer_peek_if_type(lx, &tk)) {
@@ -237,7 +698,7 @@ parser_exec_expr_recover(void *arg)
 			    pv->tk_type == TOKEN_SIZEOF) &&
 		    (nx->tk_type == TOKEN_RPAREN ||
 		     nx->tk_type == TOKEN_COMMA || nx->tk_type == TOKEN_EOF)) {
-			dc = doc_alloc(DOC_CONCAT, NULL);
+			dc = doc_alloc(DOC_CONCAT, parent);
 			if (parser_exec_type(pr, dc, tk, NULL)) {
 				doc_free(dc);
 				return NULL;
@@ -251,7 +712,7 @@ parser_exec_expr_recover(void *arg)
 		 * document, compensate for indentation added by
 		 * parser_exec_expr().
 		 */
-		dc = doc_alloc(DOC_GROUP, NULL);
+		dc = doc_alloc(DOC_GROUP, parent);
 		indent = doc_alloc_indent(-pr->pr_cf->cf_sw, dc);
 		if (parser_exec_decl_braces(pr, indent)) {
 			doc_free(dc);
@@ -262,8 +723,48 @@ parser_exec_expr_recover(void *arg)
 	return dc;
 }
 
+/*
+ * Emit the empty lines preceding the given declaration, outside of the line
+ * ranges to format, as is. The preceding formatted declaration has already
+ * emitted the first one.
+ */
+static void
+parser_exec_range_lines(struct parser *pr, const struct token *beg,
+    struct doc *dc)
+{
+	const struct buffer *bf = lexer_get_buffer(pr->pr_lx);
+	const struct token *prev = beg;
+	size_t end, off;
+	int nlines = 0;
+
+	do {
+		prev = TAILQ_PREV(prev, token_list, tk_entry);
+	} while (prev != NULL && (prev->tk_flags & TOKEN_FLAG_FAKE));
+	if (prev == NULL)
+		return;
+
+	end = token_end(prev, bf);
+	for (off = end; off > 0 && isspace((unsigned char)bf->bf_ptr[off - 1]);
+	    off--)
+		continue;
+	/* Skip the end of the line and the first empty line. */
+	for (; off <= end && nlines < 2; off++) {
+		if (bf->bf_ptr[off] == '\n')
+			nlines++;
+	}
+	if (nlines < 2 || off > end)
+		return;
+
+	/*
+	 * The empty literal stops the empty lines from being merged with the
+	 * preceding one.
+	 */
+	doc_literal("", dc);
+	doc_verbatim_str(&bf->bf_ptr[off], end + 1 - off, dc);
+}
+
 static int
-parser_exec_decl(struct parser *pr, struct doc *dc, int align)
+parser_exec_decl(struct parser *pr, struct doc *dc, unsigned int flags)
 {
 	struct lexer_recover_markers lm;
 	struct doc *concat;
@@ -274,13 +775,14 @@ parser_exec_decl(struct parser *pr, struct doc *dc, int align)
 
 	concat = doc_alloc(DOC_CONCAT, dc);
 	memset(&rl, 0, sizeof(rl));
-	ruler_init(&rl, align);
+	ruler_init(&rl, (flags & PARSER_EXEC_DECL_FLAG_ALIGN) ? 1 : 0);
 
 	lexer_recover_enter(&lm);
 	for (;;) {
 		struct token *tk;
 
 		lexer_recover_mark(lx, &lm);
+		lexer_recover_macro(lx);
 
 		if (parser_exec_decl1(pr, concat, &rl)) {
 			int r;
@@ -322,6 +824,17 @@ parser_exec_decl(struct parser *pr, struct doc *dc, int align)
 			break;
 		}
 
+		/*
+		 * A top-level declaration outside of the line ranges to format
+		 * also denotes the end of this block of declarations as it must
+		 * be emitted verbatim.
+		 */
+		if ((flags & PARSER_EXEC_DECL_FLAG_TOP) &&
+		    lexer_is_range_end(lx)) {
+			doc_remove(line, concat);
+			break;
+		}
+
 		/* Take the next branch if available. */
 		if (lexer_branch(lx, NULL, NULL))
 			lexer_recover_purge(&lm);
@@ -382,7 +895,8 @@ parser_exec_decl1(struct parser *pr, struct doc *dc, struct ruler *rl)
 
 		indent = doc_alloc_indent(pr->pr_cf->cf_tw, concat);
 		doc_alloc(DOC_HARDLINE, indent);
-		while (parser_exec_decl(pr, indent, 1) == PARSER_OK)
+		while (parser_exec_decl(pr, indent,
+			    PARSER_EXEC_DECL_FLAG_ALIGN) == PARSER_OK)
 			continue;
 
 		doc_alloc(DOC_HARDLINE, concat);
@@ -532,7 +1046,7 @@ parser_exec_decl_braces1(struct parser *pr, struct doc *dc, struct ruler *rl)
 	struct lexer *lx = pr->pr_lx;
 	struct token *lbrace, *rbrace, *pv, *tk;
 	unsigned int col = 0;
-	unsigned int w = 0;
+	unsigned int ew, w;
 	int align = 1;
 
 	if (!lexer_peek_if_pair(lx, TOKEN_LBRACE, TOKEN_RBRACE, &rbrace))
@@ -583,6 +1097,7 @@ parser_exec_decl_braces1(struct parser *pr, struct doc *dc, struct ruler *rl)
 		 */
 		w = parser_width(pr, braces);
 	} else {
+		w = 0;
 		indent = doc_alloc_indent(pr->pr_cf->cf_tw, braces);
 		doc_alloc(DOC_HARDLINE, indent);
 	}
@@ -597,10 +1112,14 @@ parser_exec_decl_braces1(struct parser *pr, struct doc *dc, struct ruler *rl)
 
 		concat = doc_alloc(DOC_CONCAT, doc_alloc(DOC_GROUP, indent));
 
+		ew = 0;
 		if (lexer_peek_if(lx, TOKEN_LBRACE, NULL)) {
 			if (parser_exec_decl_braces1(pr, concat, rl))
 				return parser_error(pr);
 			expr = concat;
+		} else if (parser_exec_decl_braces_literal(pr, concat, rbrace,
+			    &ew) == PARSER_OK) {
+			expr = concat;
 		} else {
 			if (!lexer_peek_until_loose(lx, TOKEN_COMMA, rbrace,
 				    &tk))
@@ -615,9 +1134,13 @@ parser_exec_decl_braces1(struct parser *pr, struct doc *dc, struct ruler *rl)
 
 			if (align) {
 				if (lexer_peek(lx, &tk) && tk != rbrace) {
+					if (ew > 0 && token_is_plain(comma))
+						ew += comma->tk_len;
+					else
+						ew = parser_width(pr, concat);
 					col++;
 					ruler_insert(rl, comma, concat, col,
-					    parser_width(pr, concat) + w, 0);
+					    ew + w, 0);
 					w = 0;
 				}
 			} else {
@@ -652,6 +1175,55 @@ out:
 	return parser_ok(pr);
 }
 
+/*
+ * Fast path for brace initializers consisting of a single literal or
+ * identifier, optionally preceded by an unary operator, as found in large
+ * generated tables. Emits the same document as the expression parser would
+ * without the overhead and stores the width of the emitted tokens in w.
+ */
+static int
+parser_exec_decl_braces_literal(struct parser *pr, struct doc *dc,
+    const struct token *rbrace, unsigned int *w)
+{
+	struct lexer_state s;
+	struct lexer *lx = pr->pr_lx;
+	struct token *nx;
+	struct token *tk = NULL;
+	struct token *unary = NULL;
+	int peek = 0;
+
+	/* Nested expressions start with a soft line. */
+	if (pr->pr_expr > 0)
+		return PARSER_NOTHING;
+
+	lexer_peek_enter(lx, &s);
+	if (lexer_pop(lx, &tk) &&
+	    (tk->tk_type == TOKEN_MINUS || tk->tk_type == TOKEN_TILDE)) {
+		unary = tk;
+		if (!token_is_plain(unary) || !lexer_pop(lx, &tk))
+			tk = NULL;
+	}
+	if (tk != NULL && token_is_plain(tk) &&
+	    (tk->tk_type == TOKEN_LITERAL || tk->tk_type == TOKEN_IDENT ||
+	     tk->tk_type == TOKEN_STRING) && lexer_pop(lx, &nx) &&
+	    (nx->tk_type == TOKEN_COMMA || nx == rbrace))
+		peek = 1;
+	lexer_peek_leave(lx, &s);
+	if (!peek)
+		return PARSER_NOTHING;
+
+	*w = 0;
+	if (unary != NULL && lexer_if(lx, unary->tk_type, &unary)) {
+		doc_token(unary, dc);
+		*w += unary->tk_len;
+	}
+	if (lexer_if(lx, tk->tk_type, &tk)) {
+		doc_token(tk, dc);
+		*w += tk->tk_len;
+	}
+	return parser_ok(pr);
+}
+
 static int
 parser_exec_decl_braces_fields(struct parser *pr, struct doc *dc,
     struct ruler *rl, const struct token *rbrace)
@@ -1174,7 +1746,11 @@ parser_exec_stmt1(struct parser *pr, struct doc *dc, const struct token *stop)
 	if (parser_exec_stmt_block(pr, dc, dc) == PARSER_OK)
 		return parser_ok(pr);
 
-	if (lexer_peek_if(lx, TOKEN_IF, &tk)) {
+	/*
+	 * Chains of else if statements are handled iteratively as they can be
+	 * arbitrarily long, all emitted using the same document.
+	 */
+	while (lexer_peek_if(lx, TOKEN_IF, &tk)) {
 		int rbrace = 0;
 
 		if (parser_exec_stmt_expr(pr, dc, tk))
@@ -1182,27 +1758,26 @@ parser_exec_stmt1(struct parser *pr, struct doc *dc, const struct token *stop)
 
 		if (lexer_back(lx, &tk) && tk->tk_type == TOKEN_RBRACE)
 			rbrace = 1;
-		if (lexer_if(lx, TOKEN_ELSE, &tk)) {
-			if (rbrace)
-				doc_literal(" ", dc);
-			else
-				doc_alloc(DOC_HARDLINE, dc);
-			doc_token(tk, dc);
-			if (lexer_peek_if(lx, TOKEN_IF, NULL)) {
-				doc_literal(" ", dc);
-			} else {
-				if (lexer_peek_if(lx, TOKEN_LBRACE, NULL)) {
-					doc_literal(" ", dc);
-				} else {
-					dc = doc_alloc_indent(pr->pr_cf->cf_tw,
-					    dc);
-					doc_alloc(DOC_HARDLINE, dc);
-				}
-			}
-			return parser_exec_stmt1(pr, dc, stop);
+		if (!lexer_if(lx, TOKEN_ELSE, &tk))
+			return parser_ok(pr);
+
+		if (rbrace)
+			doc_literal(" ", dc);
+		else
+			doc_alloc(DOC_HARDLINE, dc);
+		doc_token(tk, dc);
+		if (lexer_peek_if(lx, TOKEN_IF, NULL)) {
+			doc_literal(" ", dc);
+			continue;
 		}
 
-		return parser_ok(pr);
+		if (lexer_peek_if(lx, TOKEN_LBRACE, NULL)) {
+			doc_literal(" ", dc);
+		} else {
+			dc = doc_alloc_indent(pr->pr_cf->cf_tw, dc);
+			doc_alloc(DOC_HARDLINE, dc);
+		}
+		return parser_exec_stmt1(pr, dc, stop);
 	}
 
 	if (lexer_peek_if(lx, TOKEN_WHILE, &tk) ||
@@ -1745,6 +2320,53 @@ parser_exec_attributes(struct parser *pr, struct doc *dc, struct doc **out,
 	return parser_ok(pr);
 }
 
+/*
+ * Emit the cached output of the next top-level declaration, if present.
+ * Otherwise, the key used to populate the cache is stored in pc.
+ */
+static int
+parser_cache_get(struct parser *pr, struct doc *dc, struct parser_cache *pc)
+{
+	struct cache *ca = pr->pr_cf->cf_cache;
+	const char *out;
+	size_t len;
+
+	memset(pc, 0, sizeof(*pc));
+	if (ca == NULL ||
+	    !lexer_cache_span(pr->pr_lx, &pc->pc_beg, &pc->pc_end, &pc->pc_src,
+		    &pc->pc_len))
+		return 0;
+
+	out = cache_get(ca, pc->pc_src, pc->pc_len, &len);
+	if (out == NULL)
+		return 0;
+	lexer_cache_skip(pr->pr_lx, pc->pc_beg, pc->pc_end);
+	doc_verbatim_str(out, len, dc);
+	return 1;
+}
+
+/*
+ * Populate the cache with the output of the top-level declaration just
+ * emitted, as long as it covers exactly the tokens denoted by pc.
+ */
+static void
+parser_cache_put(struct parser *pr, const struct doc *dc,
+    const struct parser_cache *pc)
+{
+	struct token *tk;
+
+	if (pc->pc_src == NULL || !lexer_back(pr->pr_lx, &tk) ||
+	    tk != pc->pc_end)
+		return;
+
+	if (pr->pr_cache == NULL)
+		pr->pr_cache = buffer_alloc(1024);
+	doc_exec(dc, pr->pr_cache, pr->pr_cf);
+	/* Exclude the NUL-terminator added by doc_exec(). */
+	cache_put(pr->pr_cf->cf_cache, pc->pc_src, pc->pc_len,
+	    pr->pr_cache->bf_ptr, pr->pr_cache->bf_len - 1);
+}
+
 /*
  * Returns non-zero if the next tokens denotes a function. The type argument
  * points to the last token of the return type.
@@ -1819,8 +2441,11 @@ __parser_error(struct parser *pr, const char *fun, int lno)
 		error_write(pr->pr_er, "%s\n", str);
 		free(str);
 	} else {
+		tk = NULL;
 		error_write(pr->pr_er, "%s", "(null)\n");
 	}
+	if (pr->pr_cf->cf_trace != NULL)
+		trace_token(pr->pr_cf->cf_trace, TRACE_ERROR, tk, lno);
 	return 1;
 }
 
@@ -0,0 +1,517 @@
+#include "config.h"
+
+#ifdef HAVE_IO_URING
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include <linux/io_uring.h>
+#include <linux/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "extern.h"
+
+/*
+ * Read files ahead of the formatter using io_uring. A file is opened and sized
+ * as soon as it is scheduled, followed by being read and closed, all without
+ * waiting. Completions are only reaped once a file is requested and nothing
+ * but the requested file is waited for. Anything out of the ordinary is left
+ * to buffer_read(), making sure the same diagnostics are emitted.
+ */
+
+/* Maximum number of files being read ahead at once. */
+#define READAHEAD_DEPTH	32
+
+enum readahead_state {
+	READAHEAD_QUEUED,	/* waiting for a slot */
+	READAHEAD_OPEN,		/* being opened and sized */
+	READAHEAD_READ,		/* being read */
+	READAHEAD_CLOSE,	/* being closed */
+	READAHEAD_DONE,
+};
+
+struct readahead_entry {
+	char				*re_path;
+	struct buffer			*re_bf;
+	struct statx			 re_stx;
+	enum readahead_state		 re_state;
+	int				 re_fd;
+	int				 re_slot;	/* index in ra_slots or -1 */
+	int				 re_npending;	/* operations in flight */
+	int				 re_discard;	/* free once done */
+
+	TAILQ_ENTRY(readahead_entry)	 re_entry;
+};
+
+TAILQ_HEAD(readahead_list, readahead_entry);
+
+struct readahead_ring {
+	void		*r_ptr;
+	size_t		 r_len;
+	unsigned int	*r_head;
+	unsigned int	*r_tail;
+	unsigned int	*r_mask;
+};
+
+struct readahead {
+	int			 ra_fd;
+	struct readahead_ring	 ra_sq;
+	struct readahead_ring	 ra_cq;
+	unsigned int		*ra_sqarray;
+	struct io_uring_sqe	*ra_sqes;
+	size_t			 ra_sqeslen;
+	struct io_uring_cqe	*ra_cqes;
+	int			 ra_error;
+	struct readahead_list	 ra_entries;	/* scheduled, in order */
+
+	/* entries with operations in flight, including discarded ones */
+	struct readahead_entry	*ra_slots[READAHEAD_DEPTH];
+	unsigned int		 ra_nslots;
+};
+
+static void	readahead_submit(struct readahead *);
+static void	readahead_reap(struct readahead *, int);
+static int	readahead_enter(struct readahead *, unsigned int);
+static void	readahead_prep(struct readahead *, struct readahead_entry *,
+    int);
+static void	readahead_complete(struct readahead_entry *,
+    const struct io_uring_cqe *);
+static void	readahead_advance(struct readahead *, struct readahead_entry *);
+static void	readahead_discard(struct readahead_entry *);
+
+static void	readahead_entry_free(struct readahead_entry *);
+
+/*
+ * Returns NULL if io_uring is unavailable, all other routines then fall back
+ * to reading files synchronously.
+ */
+struct readahead *
+readahead_alloc(void)
+{
+	struct io_uring_params p;
+	struct readahead *ra;
+	char *sq, *cq;
+
+	ra = calloc(1, sizeof(*ra));
+	if (ra == NULL)
+		err(1, NULL);
+	TAILQ_INIT(&ra->ra_entries);
+
+	/* Each slot has at most two operations in flight. */
+	memset(&p, 0, sizeof(p));
+	ra->ra_fd = syscall(__NR_io_uring_setup, 2 * READAHEAD_DEPTH, &p);
+	if (ra->ra_fd == -1) {
+		free(ra);
+		return NULL;
+	}
+
+	ra->ra_sq.r_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ra->ra_cq.r_len = p.cq_off.cqes +
+	    p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ra->ra_cq.r_len > ra->ra_sq.r_len)
+			ra->ra_sq.r_len = ra->ra_cq.r_len;
+		ra->ra_cq.r_len = 0;
+	}
+	ra->ra_sq.r_ptr = mmap(NULL, ra->ra_sq.r_len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ra->ra_fd, IORING_OFF_SQ_RING);
+	if (ra->ra_sq.r_ptr == MAP_FAILED)
+		goto err;
+	if (ra->ra_cq.r_len > 0) {
+		ra->ra_cq.r_ptr = mmap(NULL, ra->ra_cq.r_len,
+		    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		    ra->ra_fd, IORING_OFF_CQ_RING);
+		if (ra->ra_cq.r_ptr == MAP_FAILED)
+			goto err;
+	}
+	ra->ra_sqeslen = p.sq_entries * sizeof(struct io_uring_sqe);
+	ra->ra_sqes = mmap(NULL, ra->ra_sqeslen, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ra->ra_fd, IORING_OFF_SQES);
+	if (ra->ra_sqes == MAP_FAILED)
+		goto err;
+
+	sq = ra->ra_sq.r_ptr;
+	cq = ra->ra_cq.r_len > 0 ? ra->ra_cq.r_ptr : ra->ra_sq.r_ptr;
+	ra->ra_sq.r_head = (unsigned int *)&sq[p.sq_off.head];
+	ra->ra_sq.r_tail = (unsigned int *)&sq[p.sq_off.tail];
+	ra->ra_sq.r_mask = (unsigned int *)&sq[p.sq_off.ring_mask];
+	ra->ra_sqarray = (unsigned int *)&sq[p.sq_off.array];
+	ra->ra_cq.r_head = (unsigned int *)&cq[p.cq_off.head];
+	ra->ra_cq.r_tail = (unsigned int *)&cq[p.cq_off.tail];
+	ra->ra_cq.r_mask = (unsigned int *)&cq[p.cq_off.ring_mask];
+	ra->ra_cqes = (struct io_uring_cqe *)&cq[p.cq_off.cqes];
+	return ra;
+
+err:
+	readahead_free(ra);
+	return NULL;
+}
+
+void
+readahead_free(struct readahead *ra)
+{
+	struct readahead_entry *re;
+	int i;
+
+	if (ra == NULL)
+		return;
+
+	while ((re = TAILQ_FIRST(&ra->ra_entries)) != NULL) {
+		TAILQ_REMOVE(&ra->ra_entries, re, re_entry);
+		readahead_discard(re);
+	}
+	/* The kernel could still write to the entries. */
+	while (ra->ra_nslots > 0 && !ra->ra_error)
+		readahead_reap(ra, 1);
+	if (ra->ra_sqes != NULL && ra->ra_sqes != MAP_FAILED)
+		munmap(ra->ra_sqes, ra->ra_sqeslen);
+	if (ra->ra_cq.r_ptr != NULL && ra->ra_cq.r_ptr != MAP_FAILED)
+		munmap(ra->ra_cq.r_ptr, ra->ra_cq.r_len);
+	if (ra->ra_sq.r_ptr != NULL && ra->ra_sq.r_ptr != MAP_FAILED)
+		munmap(ra->ra_sq.r_ptr, ra->ra_sq.r_len);
+	close(ra->ra_fd);
+	for (i = 0; i < READAHEAD_DEPTH; i++) {
+		if (ra->ra_slots[i] != NULL)
+			readahead_entry_free(ra->ra_slots[i]);
+	}
+	free(ra);
+}
+
+/*
+ * Schedule the file located at path to be read ahead. Files are expected to
+ * be requested using readahead_read() in the same order.
+ */
+void
+readahead_add(struct readahead *ra, const char *path)
+{
+	struct readahead_entry *re;
+
+	if (ra == NULL)
+		return;
+
+	re = calloc(1, sizeof(*re));
+	if (re == NULL)
+		err(1, NULL);
+	re->re_path = strdup(path);
+	if (re->re_path == NULL)
+		err(1, NULL);
+	re->re_fd = -1;
+	re->re_slot = -1;
+	TAILQ_INSERT_TAIL(&ra->ra_entries, re, re_entry);
+	readahead_submit(ra);
+}
+
+/*
+ * Read the file located at path, either from the files read ahead or using
+ * buffer_read(). Files scheduled ahead of the given one are discarded, only the
+ * first files being read ahead are considered as the given path could be
+ * found while traversing a directory.
+ */
+struct buffer *
+readahead_read(struct readahead *ra, const char *path)
+{
+	struct readahead_entry *re, *tmp;
+	struct buffer *bf;
+	int n = 0;
+
+	if (ra == NULL)
+		return buffer_read(path);
+
+	TAILQ_FOREACH(re, &ra->ra_entries, re_entry) {
+		if (n++ == READAHEAD_DEPTH)
+			return buffer_read(path);
+		if (strcmp(re->re_path, path) == 0)
+			break;
+	}
+	if (re == NULL)
+		return buffer_read(path);
+
+	while ((tmp = TAILQ_FIRST(&ra->ra_entries)) != re) {
+		TAILQ_REMOVE(&ra->ra_entries, tmp, re_entry);
+		readahead_discard(tmp);
+	}
+	readahead_submit(ra);
+	while (re->re_state != READAHEAD_DONE && !ra->ra_error)
+		readahead_reap(ra, 1);
+	TAILQ_REMOVE(&ra->ra_entries, re, re_entry);
+	if (re->re_state != READAHEAD_DONE) {
+		/* The ring is no longer usable, nor is the entry. */
+		readahead_discard(re);
+		return buffer_read(path);
+	}
+	bf = re->re_bf;
+	re->re_bf = NULL;
+	readahead_entry_free(re);
+	return bf != NULL ? bf : buffer_read(path);
+}
+
+/*
+ * Start opening and sizing the scheduled files, as long as there are slots
+ * available, and submit all queued operations without waiting.
+ */
+static void
+readahead_submit(struct readahead *ra)
+{
+	struct readahead_entry *re;
+
+	TAILQ_FOREACH(re, &ra->ra_entries, re_entry) {
+		int i;
+
+		if (ra->ra_nslots == READAHEAD_DEPTH)
+			break;
+		if (re->re_state != READAHEAD_QUEUED)
+			continue;
+
+		for (i = 0; ra->ra_slots[i] != NULL; i++)
+			continue;
+		ra->ra_slots[i] = re;
+		ra->ra_nslots++;
+		re->re_slot = i;
+		re->re_state = READAHEAD_OPEN;
+		readahead_prep(ra, re, IORING_OP_OPENAT);
+		readahead_prep(ra, re, IORING_OP_STATX);
+	}
+	(void)readahead_enter(ra, 0);
+}
+
+/*
+ * Handle all available completions. If wait is non-zero and no completion is
+ * available, wait for one.
+ */
+static void
+readahead_reap(struct readahead *ra, int wait)
+{
+	for (;;) {
+		struct readahead_entry *re;
+		const struct io_uring_cqe *cqe;
+		unsigned int head;
+
+		head = *ra->ra_cq.r_head;
+		if (head ==
+		    __atomic_load_n(ra->ra_cq.r_tail, __ATOMIC_ACQUIRE)) {
+			if (!wait || readahead_enter(ra, 1))
+				break;
+			wait = 0;
+			continue;
+		}
+
+		cqe = &ra->ra_cqes[head & *ra->ra_cq.r_mask];
+		re = ra->ra_slots[cqe->user_data & 0xffffffff];
+		readahead_complete(re, cqe);
+		__atomic_store_n(ra->ra_cq.r_head, head + 1, __ATOMIC_RELEASE);
+		if (--re->re_npending == 0)
+			readahead_advance(ra, re);
+		wait = 0;
+	}
+	readahead_submit(ra);
+}
+
+/*
+ * Submit all queued operations and wait for the given number of completions.
+ * Returns non-zero if the ring is no longer usable.
+ */
+static int
+readahead_enter(struct readahead *ra, unsigned int wait)
+{
+	unsigned int nsubmit;
+
+	if (ra->ra_error)
+		return 1;
+
+	nsubmit = *ra->ra_sq.r_tail -
+	    __atomic_load_n(ra->ra_sq.r_head, __ATOMIC_ACQUIRE);
+	if (nsubmit == 0 && wait == 0)
+		return 0;
+	while (syscall(__NR_io_uring_enter, ra->ra_fd, nsubmit, wait,
+		    wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0) == -1) {
+		if (errno != EINTR) {
+			ra->ra_error = 1;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Queue the given operation for the given entry.
+ */
+static void
+readahead_prep(struct readahead *ra, struct readahead_entry *re, int op)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int i, tail;
+
+	tail = *ra->ra_sq.r_tail;
+	i = tail & *ra->ra_sq.r_mask;
+	ra->ra_sqarray[i] = i;
+	sqe = &ra->ra_sqes[i];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->user_data = ((uint64_t)op << 32) | (uint32_t)re->re_slot;
+	switch (op) {
+	case IORING_OP_OPENAT:
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (uintptr_t)re->re_path;
+		sqe->open_flags = O_RDONLY | O_CLOEXEC;
+		break;
+	case IORING_OP_STATX:
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (uintptr_t)re->re_path;
+		sqe->len = STATX_TYPE | STATX_SIZE;
+		sqe->off = (uintptr_t)&re->re_stx;
+		break;
+	case IORING_OP_READ:
+		sqe->fd = re->re_fd;
+		sqe->addr = (uintptr_t)re->re_bf->bf_ptr;
+		sqe->len = re->re_bf->bf_siz - 1;
+		sqe->off = 0;
+		break;
+	case IORING_OP_CLOSE:
+		sqe->fd = re->re_fd;
+		break;
+	}
+	re->re_npending++;
+	__atomic_store_n(ra->ra_sq.r_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static void
+readahead_complete(struct readahead_entry *re, const struct io_uring_cqe *cqe)
+{
+	switch (cqe->user_data >> 32) {
+	case IORING_OP_OPENAT:
+		if (cqe->res >= 0)
+			re->re_fd = cqe->res;
+		break;
+
+	case IORING_OP_STATX:
+		/*
+		 * Let buffer_read() deal with anything but non-empty regular
+		 * files, the size of some pseudo files is not known upfront.
+		 * Like buffer_read(), leave room for the lexer to append a NUL
+		 * and one additional byte used to detect a growing file.
+		 */
+		if (cqe->res == 0 && S_ISREG(re->re_stx.stx_mode) &&
+		    re->re_stx.stx_size > 0)
+			re->re_bf = buffer_alloc(re->re_stx.stx_size + 2);
+		break;
+
+	case IORING_OP_READ:
+		if (cqe->res >= 0 &&
+		    (uint64_t)cqe->res == re->re_stx.stx_size) {
+			re->re_bf->bf_len = cqe->res;
+		} else {
+			/* Short read, the file could have been altered. */
+			buffer_free(re->re_bf);
+			re->re_bf = NULL;
+		}
+		break;
+
+	case IORING_OP_CLOSE:
+		re->re_fd = -1;
+		break;
+	}
+}
+
+/*
+ * Move the given entry to its next state, invoked once all its operations in
+ * flight have completed.
+ */
+static void
+readahead_advance(struct readahead *ra, struct readahead_entry *re)
+{
+	switch (re->re_state) {
+	case READAHEAD_OPEN:
+		if (re->re_fd == -1) {
+			buffer_free(re->re_bf);
+			re->re_bf = NULL;
+			re->re_state = READAHEAD_DONE;
+		} else if (re->re_bf != NULL && !re->re_discard) {
+			re->re_state = READAHEAD_READ;
+			readahead_prep(ra, re, IORING_OP_READ);
+		} else {
+			re->re_state = READAHEAD_CLOSE;
+			readahead_prep(ra, re, IORING_OP_CLOSE);
+		}
+		break;
+
+	case READAHEAD_READ:
+		re->re_state = READAHEAD_CLOSE;
+		readahead_prep(ra, re, IORING_OP_CLOSE);
+		break;
+
+	case READAHEAD_CLOSE:
+		re->re_state = READAHEAD_DONE;
+		break;
+
+	case READAHEAD_QUEUED:
+	case READAHEAD_DONE:
+		break;
+	}
+	if (re->re_state != READAHEAD_DONE)
+		return;
+
+	ra->ra_slots[re->re_slot] = NULL;
+	ra->ra_nslots--;
+	re->re_slot = -1;
+	if (re->re_discard)
+		readahead_entry_free(re);
+}
+
+/*
+ * Free the given entry, which must no longer be scheduled, once its operations
+ * in flight have completed.
+ */
+static void
+readahead_discard(struct readahead_entry *re)
+{
+	if (re->re_slot == -1)
+		readahead_entry_free(re);
+	else
+		re->re_discard = 1;
+}
+
+static void
+readahead_entry_free(struct readahead_entry *re)
+{
+	if (re->re_fd != -1)
+		close(re->re_fd);
+	buffer_free(re->re_bf);
+	free(re->re_path);
+	free(re);
+}
+
+#else
+
+#include "extern.h"
+
+struct readahead *
+readahead_alloc(void)
+{
+	return NULL;
+}
+
+void
+readahead_free(struct readahead *UNUSED(ra))
+{
+}
+
+void
+readahead_add(struct readahead *UNUSED(ra), const char *UNUSED(path))
+{
+}
+
+struct buffer *
+readahead_read(struct readahead *UNUSED(ra), const char *path)
+{
+	return buffer_read(path);
+}
+
+#endif
@@ -0,0 +1,439 @@
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "extern.h"
+
+/*
+ * Protocol, a request is made up of a header line followed by the path and
+ * the source code:
+ *
+ * 	<mode> <path length> <source length>\n<path><source>
+ *
+ * Where mode is either format or diff. The response is made up of a header
+ * line followed by everything the request wrote to standard output and error:
+ *
+ * 	<exit status> <stdout length> <stderr length>\n<stdout><stderr>
+ */
+
+#define SERVER_HDR_SIZE	64
+
+static int	server_handle(int,
+    int (*)(const char *, struct buffer *, struct error *,
+	const struct config *));
+static int	server_alive(const struct sockaddr_un *);
+static int	server_sockaddr(struct sockaddr_un *, const char *);
+static int	server_tmpfd(void);
+
+static int	readhdr(int, char *, size_t);
+static int	readn(int, char *, size_t);
+static int	writen(int, const char *, size_t);
+static int	writefd(int, int);
+
+static void	sighandler(int);
+
+static volatile sig_atomic_t	gotsig;
+
+/*
+ * Serve format requests on the Unix domain socket located at path until
+ * interrupted. Each connection is handled by a forked process in order to
+ * serve requests concurrently, all of them inheriting the already initialized
+ * lexer. The given callback is expected to format the source code according to
+ * the per request configuration.
+ */
+int
+server_exec(const char *path,
+    int (*format)(const char *, struct buffer *, struct error *,
+	const struct config *))
+{
+	struct sigaction sa;
+	struct sockaddr_un sun;
+	struct stat st;
+	int s;
+
+	if (server_sockaddr(&sun, path))
+		return 1;
+
+	/*
+	 * Remove any stale socket left behind by a previous server, unless
+	 * another server is still listening on it.
+	 */
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		if (server_alive(&sun)) {
+			warnx("%s: server already running", path);
+			return 1;
+		}
+		(void)unlink(path);
+	}
+
+	s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (s == -1) {
+		warn("socket");
+		return 1;
+	}
+	if (bind(s, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+		warn("bind: %s", path);
+		close(s);
+		return 1;
+	}
+	if (listen(s, 128) == -1) {
+		warn("listen: %s", path);
+		goto out;
+	}
+
+	/*
+	 * Let the kernel reap terminated children. Intentionally not using
+	 * SA_RESTART in order to interrupt accept(2) once signaled.
+	 */
+	memset(&sa, 0, sizeof(sa));
+	sigemptyset(&sa.sa_mask);
+	sa.sa_handler = SIG_IGN;
+	sa.sa_flags = SA_NOCLDWAIT;
+	if (sigaction(SIGCHLD, &sa, NULL) == -1)
+		err(1, "sigaction");
+	sa.sa_handler = sighandler;
+	sa.sa_flags = 0;
+	if (sigaction(SIGINT, &sa, NULL) == -1 ||
+	    sigaction(SIGTERM, &sa, NULL) == -1)
+		err(1, "sigaction");
+
+	while (!gotsig) {
+		pid_t pid;
+		int c;
+
+		c = accept(s, NULL, NULL);
+		if (c == -1) {
+			if (errno != EINTR && errno != ECONNABORTED)
+				warn("accept");
+			continue;
+		}
+
+		pid = fork();
+		if (pid == -1) {
+			warn("fork");
+			close(c);
+			continue;
+		}
+		if (pid == 0) {
+			close(s);
+			/* Restore signals, needed in order to wait for diff. */
+			sa.sa_handler = SIG_DFL;
+			sa.sa_flags = 0;
+			(void)sigaction(SIGCHLD, &sa, NULL);
+			(void)sigaction(SIGINT, &sa, NULL);
+			(void)sigaction(SIGTERM, &sa, NULL);
+			_exit(server_handle(c, format));
+		}
+		close(c);
+	}
+
+out:
+	close(s);
+	(void)unlink(path);
+	return 0;
+}
+
+/*
+ * Send a request to the server listening on the Unix domain socket located at
+ * sockpath. Everything the request wrote to standard output is returned in out
+ * and anything written to standard error is forwarded. Returns the exit status
+ * of the request.
+ */
+int
+server_request(const char *sockpath, const char *path,
+    const struct buffer *src, const struct config *cf, struct buffer **out)
+{
+	char hdr[SERVER_HDR_SIZE];
+	struct sockaddr_un sun;
+	struct buffer *errbf = NULL;
+	const char *mode;
+	size_t errlen, outlen, pathlen;
+	int n, s, status;
+	int error = 1;
+
+	if (server_sockaddr(&sun, sockpath))
+		return 1;
+
+	s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (s == -1) {
+		warn("socket");
+		return 1;
+	}
+	if (connect(s, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+		warn("connect: %s", sockpath);
+		goto out;
+	}
+
+	mode = (cf->cf_flags & CONFIG_FLAG_DIFF) ? "diff" : "format";
+	pathlen = strlen(path);
+	n = snprintf(hdr, sizeof(hdr), "%s %zu %zu\n", mode, pathlen,
+	    src->bf_len);
+	if (n < 0 || n >= (int)sizeof(hdr)) {
+		warnc(ENAMETOOLONG, "%s", __func__);
+		goto out;
+	}
+	if (writen(s, hdr, n) || writen(s, path, pathlen) ||
+	    writen(s, src->bf_ptr, src->bf_len))
+		goto out;
+
+	if (readhdr(s, hdr, sizeof(hdr)))
+		goto out;
+	if (sscanf(hdr, "%d %zu %zu", &status, &outlen, &errlen) != 3) {
+		warnx("%s: invalid response", sockpath);
+		goto out;
+	}
+
+	*out = buffer_alloc(outlen + 1);
+	if (readn(s, (*out)->bf_ptr, outlen))
+		goto out;
+	(*out)->bf_len = outlen;
+	buffer_appendc(*out, '\0');
+
+	errbf = buffer_alloc(errlen + 1);
+	if (readn(s, errbf->bf_ptr, errlen))
+		goto out;
+	if (writen(STDERR_FILENO, errbf->bf_ptr, errlen))
+		goto out;
+
+	error = status;
+
+out:
+	buffer_free(errbf);
+	close(s);
+	return error;
+}
+
+static int
+server_handle(int c,
+    int (*format)(const char *, struct buffer *, struct error *,
+	const struct config *))
+{
+	char hdr[SERVER_HDR_SIZE], mode[8], path[PATH_MAX];
+	struct buffer *src;
+	struct config cf;
+	struct error er;
+	size_t pathlen, srclen;
+	ssize_t nr;
+	int errfd, n, outfd, status;
+
+	/* Connection closed without a request, see server_alive(). */
+	do {
+		nr = recv(c, hdr, 1, MSG_PEEK);
+	} while (nr == -1 && errno == EINTR);
+	if (nr == 0)
+		return 0;
+
+	if (readhdr(c, hdr, sizeof(hdr)))
+		return 1;
+	if (sscanf(hdr, "%7s %zu %zu", mode, &pathlen, &srclen) != 3 ||
+	    pathlen >= sizeof(path)) {
+		warnx("invalid request");
+		return 1;
+	}
+
+	config_init(&cf);
+	if (strcmp(mode, "diff") == 0) {
+		cf.cf_flags |= CONFIG_FLAG_DIFF;
+	} else if (strcmp(mode, "format") != 0) {
+		warnx("%s: unknown mode", mode);
+		return 1;
+	}
+
+	if (readn(c, path, pathlen))
+		return 1;
+	path[pathlen] = '\0';
+	src = buffer_alloc(srclen + 1);
+	if (readn(c, src->bf_ptr, srclen)) {
+		buffer_free(src);
+		return 1;
+	}
+	src->bf_len = srclen;
+
+	/*
+	 * Capture everything written to standard output and error, including
+	 * the output from diff.
+	 */
+	outfd = server_tmpfd();
+	errfd = server_tmpfd();
+	if (outfd == -1 || errfd == -1)
+		return 1;
+	fflush(stdout);
+	fflush(stderr);
+	if (dup2(outfd, STDOUT_FILENO) == -1 ||
+	    dup2(errfd, STDERR_FILENO) == -1)
+		return 1;
+
+	error_init(&er, &cf);
+	status = format(path, src, &er, &cf);
+	if (status)
+		error_flush(&er);
+	error_close(&er);
+	fflush(stdout);
+	fflush(stderr);
+
+	n = snprintf(hdr, sizeof(hdr), "%d %lld %lld\n", status,
+	    (long long)lseek(outfd, 0, SEEK_END),
+	    (long long)lseek(errfd, 0, SEEK_END));
+	if (n < 0 || n >= (int)sizeof(hdr))
+		return 1;
+	if (writen(c, hdr, n) || writefd(c, outfd) || writefd(c, errfd))
+		return 1;
+	return 0;
+}
+
+/*
+ * Returns non-zero if a server is accepting connections on the given socket.
+ */
+static int
+server_alive(const struct sockaddr_un *sun)
+{
+	int alive, s;
+
+	s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (s == -1)
+		return 0;
+	alive = connect(s, (const struct sockaddr *)sun, sizeof(*sun)) == 0;
+	close(s);
+	return alive;
+}
+
+static int
+server_sockaddr(struct sockaddr_un *sun, const char *path)
+{
+	ssize_t siz = sizeof(sun->sun_path);
+	int n;
+
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	n = snprintf(sun->sun_path, siz, "%s", path);
+	if (n < 0 || n >= siz) {
+		warnc(ENAMETOOLONG, "%s", path);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Get a read/write file descriptor backed by an already removed temporary
+ * file.
+ */
+static int
+server_tmpfd(void)
+{
+	char path[] = "/tmp/knfmt.XXXXXXXX";
+	int fd;
+
+	fd = mkstemp(path);
+	if (fd == -1) {
+		warn("mkstemp: %s", path);
+		return -1;
+	}
+	(void)unlink(path);
+	return fd;
+}
+
+/*
+ * Read a newline terminated header, one byte at a time as the header is
+ * immediately followed by the payload.
+ */
+static int
+readhdr(int fd, char *buf, size_t bufsiz)
+{
+	size_t i;
+
+	for (i = 0; i < bufsiz - 1; i++) {
+		if (readn(fd, &buf[i], 1))
+			return 1;
+		if (buf[i] == '\n') {
+			buf[i] = '\0';
+			return 0;
+		}
+	}
+	warnx("%s: header too long", __func__);
+	return 1;
+}
+
+static int
+readn(int fd, char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t nr;
+
+		nr = read(fd, buf, len);
+		if (nr == -1) {
+			if (errno == EINTR)
+				continue;
+			warn("read");
+			return 1;
+		}
+		if (nr == 0) {
+			warnx("read: unexpected end of file");
+			return 1;
+		}
+		buf += nr;
+		len -= nr;
+	}
+	return 0;
+}
+
+static int
+writen(int fd, const char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t nw;
+
+		nw = write(fd, buf, len);
+		if (nw == -1) {
+			if (errno == EINTR)
+				continue;
+			warn("write");
+			return 1;
+		}
+		buf += nw;
+		len -= nw;
+	}
+	return 0;
+}
+
+/*
+ * Write the contents of the file referred to by src to dst.
+ */
+static int
+writefd(int dst, int src)
+{
+	char buf[BUFSIZ];
+
+	if (lseek(src, 0, SEEK_SET) == -1) {
+		warn("lseek");
+		return 1;
+	}
+	for (;;) {
+		ssize_t nr;
+
+		nr = read(src, buf, sizeof(buf));
+		if (nr == -1) {
+			warn("read");
+			return 1;
+		}
+		if (nr == 0)
+			break;
+		if (writen(dst, buf, nr))
+			return 1;
+	}
+	return 0;
+}
+
+static void
+sighandler(int UNUSED(signo))
+{
+	gotsig = 1;
+}
@@ -7,6 +7,7 @@
 #include <unistd.h>
 
 #include "extern.h"
+#include "knfmt.h"
 
 #define test_expr_exec(a, b)						\
 	__test_expr_exec((a), (b), "test_expr_exec", __LINE__);		\
@@ -27,6 +28,44 @@ static int	__test_lexer_peek_if_type(const char *, const char *,
 static int	__test_lexer_read(const char *, const char *, const char *,
     int);
 
+#define test_knfmt_format(a, b)						\
+	__test_knfmt_format((a), (b), "test_knfmt_format", __LINE__);	\
+	if (xflag && error) goto out
+static int	__test_knfmt_format(const char *, const char *, const char *,
+    int);
+
+#define test_knfmt_config(a, b, c)					\
+	__test_knfmt_config((a), (b), (c), "test_knfmt_config",		\
+		__LINE__);						\
+	if (xflag && error) goto out
+static int	__test_knfmt_config(unsigned int, const char *, const char *,
+    const char *, int);
+
+#define test_knfmt_diagnostics(a, b)					\
+	__test_knfmt_diagnostics((a), (b), "test_knfmt_diagnostics",	\
+		__LINE__);						\
+	if (xflag && error) goto out
+static int	__test_knfmt_diagnostics(const char *, const char *,
+    const char *, int);
+
+#define test_knfmt_nest(a, b, c, d, e)					\
+	__test_knfmt_nest((a), (b), (c), (d), (e), "test_knfmt_nest",	\
+		__LINE__);						\
+	if (xflag && error) goto out
+static int	__test_knfmt_nest(const char *, const char *, const char *,
+    const char *, const char *, const char *, int);
+
+#define test_knfmt_deep(a)						\
+	__test_knfmt_deep((a), "test_knfmt_deep", __LINE__);		\
+	if (xflag && error) goto out
+static int	__test_knfmt_deep(int, const char *, int);
+
+#define test_config_shard(a, b)						\
+	__test_config_shard((a), (b), "test_config_shard", __LINE__);	\
+	if (xflag && error) goto out
+static int	__test_config_shard(const char *, const char *, const char *,
+    int);
+
 struct parser_stub {
 	char		 ps_path[PATH_MAX];
 	struct error	 ps_er;
@@ -40,7 +79,8 @@ static void	parser_stub_destroy(struct parser_stub *);
 
 static __dead void	usage(void);
 
-static struct config	cf;
+static struct config	 cf;
+static struct knfmt	*kn;
 
 int
 main(int argc, char *argv[])
@@ -62,8 +102,6 @@ main(int argc, char *argv[])
 	config_init(&cf);
 	cf.cf_flags |= CONFIG_FLAG_TEST;
 
-	lexer_init();
-
 	error |= test_expr_exec("1", "(1)");
 	error |= test_expr_exec("x", "(x)");
 	error |= test_expr_exec("\"x\"", "(\"x\")");
@@ -192,8 +230,35 @@ main(int argc, char *argv[])
 	error |= test_lexer_read("...", "ELLIPSIS");
 	error |= test_lexer_read(".x", "PERIOD IDENT");
 
+	kn = knfmt_alloc(NULL);
+	error |= test_knfmt_format("int\nmain(void){return 0;}\n",
+	    "int\nmain(void)\n{\n\treturn 0;\n}\n");
+	error |= test_knfmt_format("int  x;\n", "int\tx;\n");
+	error |= test_knfmt_format("", "");
+	error |= test_knfmt_format("int x = ;\n", NULL);
+	error |= test_knfmt_config(40,
+	    "int x = aaaaaaaaaa + bbbbbbbbbb + cccccccccc + dddddddddd;\n",
+	    "int\tx = aaaaaaaaaa + bbbbbbbbbb +\n    cccccccccc + dddddddddd;\n");
+	error |= test_knfmt_diagnostics("int x = ;\n",
+	    "<buffer>: error at EQUAL<1:7>(\"=\")\n");
+	error |= test_knfmt_diagnostics("int x;\n", "");
+
+	error |= test_knfmt_nest("int x = ", "(", "1", ")", ";\n");
+	error |= test_knfmt_nest("int x[] = ", "{", "1", "}", ";\n");
+	error |= test_knfmt_nest("int x = ", "!", "1", "", ";\n");
+	error |= test_knfmt_nest("int x = ", "x = ", "1", "", ";\n");
+	error |= test_knfmt_nest("void\nf(void)\n{\n", "{", "f();", "}",
+	    "\n}\n");
+	error |= test_knfmt_nest("void\nf(void)\n{\n\tif (x)\n\t\tf();\n",
+	    "\telse if (x)\n\t\tf();\n", "", "", "}\n");
+	error |= test_knfmt_deep(200);
+
+	error |= test_config_shard("a.c", "a.c");
+	error |= test_config_shard("a.c", "./a.c");
+	error |= test_config_shard("dir/a.c", ".//./dir/a.c");
+
 out:
-	lexer_shutdown();
+	knfmt_free(kn);
 	return error;
 }
 
@@ -241,6 +306,43 @@ out:
 	return error;
 }
 
+/*
+ * Ensure the given paths belong to one and the same shard.
+ */
+static int
+__test_config_shard(const char *p1, const char *p2, const char *fun, int lno)
+{
+	struct config scf;
+	unsigned int n;
+
+	config_init(&scf);
+	for (n = 1; n <= 8; n++) {
+		unsigned int i;
+		int nshards = 0;
+
+		scf.cf_nshards = n;
+		for (i = 1; i <= n; i++) {
+			int s1, s2;
+
+			scf.cf_shard = i;
+			s1 = config_shard(&scf, p1);
+			s2 = config_shard(&scf, p2);
+			if (s1 != s2) {
+				warnx("%s:%d: %s and %s in different shards",
+				    fun, lno, p1, p2);
+				return 1;
+			}
+			nshards += s1;
+		}
+		if (nshards != 1) {
+			warnx("%s:%d: %s in %d out of %u shard(s)", fun, lno,
+			    p1, nshards, n);
+			return 1;
+		}
+	}
+	return 0;
+}
+
 static int
 __test_lexer_peek_if_type(const char *src, const char *exp, const char *fun,
     int lno)
@@ -329,6 +431,148 @@ __test_lexer_read(const char *src, const char *exp, const char *fun, int lno)
 	return error;
 }
 
+/*
+ * Passing NULL as exp denotes that the source code is expected to be rejected.
+ * All invocations share the same handle.
+ */
+static int
+__test_knfmt_format(const char *src, const char *exp, const char *fun, int lno)
+{
+	const char *out;
+	size_t outlen;
+	int error = 0;
+
+	if (knfmt_format(kn, src, strlen(src), &out, &outlen)) {
+		if (exp != NULL) {
+			warnx("%s:%d: knfmt_format() failure", fun, lno);
+			error = 1;
+		}
+	} else if (exp == NULL) {
+		warnx("%s:%d: knfmt_format() unexpected success", fun, lno);
+		error = 1;
+	} else if (strlen(exp) != outlen || strcmp(exp, out)) {
+		warnx("%s:%d:\n\texp\t\"%s\"\n\tgot\t\"%s\"", fun, lno, exp,
+		    out);
+		error = 1;
+	}
+	return error;
+}
+
+static int
+__test_knfmt_config(unsigned int mw, const char *src, const char *exp,
+    const char *fun, int lno)
+{
+	struct knfmt_config kc;
+	struct knfmt *tmp;
+	int error;
+
+	memset(&kc, 0, sizeof(kc));
+	kc.kc_mw = mw;
+	tmp = kn;
+	kn = knfmt_alloc(&kc);
+	error = __test_knfmt_format(src, exp, fun, lno);
+	knfmt_free(kn);
+	kn = tmp;
+	return error;
+}
+
+static int
+__test_knfmt_diagnostics(const char *src, const char *exp, const char *fun,
+    int lno)
+{
+	const char *act, *out;
+	size_t len, outlen;
+
+	knfmt_format(kn, src, strlen(src), &out, &outlen);
+	act = knfmt_diagnostics(kn, &len);
+	if (strlen(exp) != len || strcmp(exp, act)) {
+		warnx("%s:%d:\n\texp\t\"%s\"\n\tgot\t\"%s\"", fun, lno, exp,
+		    act);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Ensure that deeply nested source code is either formatted or emitted verbatim
+ * as is, which also must be done in linear time.
+ */
+static int
+__test_knfmt_nest(const char *beg, const char *open, const char *mid,
+    const char *close, const char *end, const char *fun, int lno)
+{
+	struct buffer *bf;
+	int error, i;
+	int n = 100000;
+
+	bf = buffer_alloc(128);
+	buffer_append(bf, beg, strlen(beg));
+	for (i = 0; i < n; i++)
+		buffer_append(bf, open, strlen(open));
+	buffer_append(bf, mid, strlen(mid));
+	for (i = 0; i < n; i++)
+		buffer_append(bf, close, strlen(close));
+	buffer_append(bf, end, strlen(end));
+	buffer_appendc(bf, '\0');
+	error = __test_knfmt_format(bf->bf_ptr, bf->bf_ptr, fun, lno);
+	buffer_free(bf);
+	return error;
+}
+
+/*
+ * Ensure that source code nested below the limits is still formatted, as
+ * opposed to being emitted verbatim.
+ */
+static int
+__test_knfmt_deep(int n, const char *fun, int lno)
+{
+	struct buffer *exp, *src;
+	int error, i, j;
+
+	src = buffer_alloc(128);
+	exp = buffer_alloc(128);
+
+	buffer_appendv(src, "int  x = ");
+	buffer_appendv(exp, "int\tx = ");
+	for (i = 0; i < n; i++) {
+		buffer_appendc(src, '(');
+		buffer_appendc(exp, '(');
+	}
+	buffer_appendc(src, '1');
+	buffer_appendc(exp, '1');
+	for (i = 0; i < n; i++) {
+		buffer_appendc(src, ')');
+		buffer_appendc(exp, ')');
+	}
+	buffer_appendv(src, ";\n\nvoid\nf(void){");
+	buffer_appendv(exp, ";\n\nvoid\nf(void)\n{\n");
+	for (i = 1; i <= n; i++) {
+		buffer_appendc(src, '{');
+		for (j = 0; j < i; j++)
+			buffer_appendc(exp, '\t');
+		buffer_appendv(exp, "{\n");
+	}
+	buffer_appendv(src, "f();");
+	for (j = 0; j <= n; j++)
+		buffer_appendc(exp, '\t');
+	buffer_appendv(exp, "f();\n");
+	for (i = n; i > 0; i--) {
+		buffer_appendc(src, '}');
+		for (j = 0; j < i; j++)
+			buffer_appendc(exp, '\t');
+		buffer_appendv(exp, "}\n");
+	}
+	buffer_appendv(src, "}\n");
+	buffer_appendv(exp, "}\n");
+	buffer_appendc(src, '\0');
+	buffer_appendc(exp, '\0');
+
+	error = __test_knfmt_format(src->bf_ptr, exp->bf_ptr, fun, lno);
+	buffer_free(exp);
+	buffer_free(src);
+	return error;
+}
+
 static void
 parser_stub_create(struct parser_stub *ps, const char *src)
 {
@@ -351,7 +595,8 @@ parser_stub_create(struct parser_stub *ps, const char *src)
 		errc(1, ENAMETOOLONG, "%s", __func__);
 
 	error_init(&ps->ps_er, &cf);
-	ps->ps_pr = parser_alloc(ps->ps_path, &ps->ps_er, &cf);
+	ps->ps_pr = parser_alloc(ps->ps_path, buffer_read(ps->ps_path),
+	    &ps->ps_er, &cf);
 	ps->ps_lx = parser_get_lexer(ps->ps_pr);
 }
 
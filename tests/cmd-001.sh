@@ -0,0 +1,40 @@
+# Format using the server and refuse to start another server on the same
+# socket.
+
+set -e
+
+_sock="${WRKDIR}/sock"
+_src="${WRKDIR}/src.c"
+printf 'int  a;\nint\nmain(void){\n\treturn 0;\n}\n' >"$_src"
+
+${EXEC:-} ${KNFMT} -S "$_sock" &
+_pid="$!"
+trap 'kill "$_pid" 2>/dev/null || :' 0
+_i=0
+while ! [ -S "$_sock" ]; do
+	_i="$((_i + 1))"
+	[ "$_i" -lt 50 ] || exit 1
+	sleep 0.1
+done
+
+${EXEC:-} ${KNFMT} "$_src" >"${WRKDIR}/exp"
+${EXEC:-} ${KNFMT} -c "$_sock" "$_src" >"${WRKDIR}/act"
+cmp -s "${WRKDIR}/exp" "${WRKDIR}/act"
+
+# Another server must exit immediately, without taking over the socket.
+${EXEC:-} ${KNFMT} -S "$_sock" 2>/dev/null &
+_pid2="$!"
+_i=0
+while kill -0 "$_pid2" 2>/dev/null; do
+	_i="$((_i + 1))"
+	if [ "$_i" -ge 50 ]; then
+		kill "$_pid2"
+		exit 1
+	fi
+	sleep 0.1
+done
+if wait "$_pid2"; then
+	exit 1
+fi
+${EXEC:-} ${KNFMT} -c "$_sock" "$_src" >"${WRKDIR}/act"
+cmp -s "${WRKDIR}/exp" "${WRKDIR}/act"
@@ -0,0 +1,48 @@
+# Declarations exceeding the budget are emitted verbatim, the budget is
+# restored for each declaration unless given per file.
+
+set -e
+
+_src="${WRKDIR}/src.c"
+cat <<'END' >"$_src"
+int  a;
+
+int
+main(void){
+	int  x = 1 + 2 + 3 + 4 + 5;
+	return x;
+}
+
+int  b;
+END
+
+cat <<'END' >"${WRKDIR}/exp"
+int	a;
+
+int
+main(void){
+	int  x = 1 + 2 + 3 + 4 + 5;
+	return x;
+}
+
+int	b;
+END
+${EXEC:-} ${KNFMT} -v -b 200 "$_src" >"${WRKDIR}/act" 2>"${WRKDIR}/err"
+diff -u "${WRKDIR}/exp" "${WRKDIR}/act"
+# Each declaration emitted verbatim is reported.
+printf '%s:3: declaration emitted verbatim\n' "$_src" |
+diff -u - "${WRKDIR}/err"
+
+cat <<'END' >"${WRKDIR}/exp"
+int	a;
+
+int
+main(void){
+	int  x = 1 + 2 + 3 + 4 + 5;
+	return x;
+}
+
+int  b;
+END
+${EXEC:-} ${KNFMT} -B 200 "$_src" >"${WRKDIR}/act"
+diff -u "${WRKDIR}/exp" "${WRKDIR}/act"
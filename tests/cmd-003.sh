@@ -0,0 +1,19 @@
+# Once the deadline has passed, all remaining declarations are emitted
+# verbatim.
+
+set -e
+
+_src="${WRKDIR}/src.c"
+_i=0
+while [ "$_i" -lt 5000 ]; do
+	echo "int  a${_i} = 1 + 2 + 3;"
+	_i="$((_i + 1))"
+done >"$_src"
+
+${EXEC:-} ${KNFMT} -T 1 "$_src" >"${WRKDIR}/act"
+# Nothing is expected to be formatted after the first verbatim declaration.
+awk '
+/^int  / { v = 1; next }
+v { print "formatted after deadline: " $0; exit 1 }
+END { if (!v) { print "deadline not reached"; exit 1 } }
+' "${WRKDIR}/act"
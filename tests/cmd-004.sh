@@ -0,0 +1,33 @@
+# Output using the cache must be identical to output without it, even when a
+# cached declaration is later aligned with other declarations.
+
+set -e
+
+_cache="${WRKDIR}/cache"
+
+cat <<'END' >"${WRKDIR}/a.c"
+int  a;
+int
+f(void){
+	return 0;
+}
+
+int  x;
+END
+cat <<'END' >"${WRKDIR}/b.c"
+int  a;
+static unsigned long  b;
+
+int  a;
+
+int
+main(void){
+	return 0;
+}
+END
+
+for _f in a.c b.c b.c; do
+	${EXEC:-} ${KNFMT} "${WRKDIR}/${_f}" >"${WRKDIR}/exp"
+	${EXEC:-} ${KNFMT} -C "$_cache" "${WRKDIR}/${_f}" >"${WRKDIR}/act"
+	diff -u "${WRKDIR}/exp" "${WRKDIR}/act"
+done
@@ -0,0 +1,28 @@
+# Files read from a list are formatted as soon as they have been read, without
+# waiting for more of the list.
+
+set -e
+
+_fifo="${WRKDIR}/fifo"
+printf 'int  a;\n' >"${WRKDIR}/a.c"
+printf 'int  b;\n' >"${WRKDIR}/b.c"
+printf 'int\ta;\n' >"${WRKDIR}/exp"
+mkfifo "$_fifo"
+
+${EXEC:-} ${KNFMT} -i -f "$_fifo" &
+_pid="$!"
+exec 3>"$_fifo"
+trap 'exec 3>&-; kill "$_pid" 2>/dev/null || :' 0
+echo "${WRKDIR}/a.c" >&3
+
+_i=0
+while ! cmp -s "${WRKDIR}/exp" "${WRKDIR}/a.c"; do
+	_i="$((_i + 1))"
+	[ "$_i" -lt 50 ] || exit 1
+	sleep 0.1
+done
+
+echo "${WRKDIR}/b.c" >&3
+exec 3>&-
+wait "$_pid"
+printf 'int\tb;\n' | cmp -s - "${WRKDIR}/b.c"
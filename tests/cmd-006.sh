@@ -0,0 +1,13 @@
+# Sharding requires files, standard input cannot be assigned to a shard.
+
+set -e
+
+printf 'int  a;\n' >"${WRKDIR}/a.c"
+if ${EXEC:-} ${KNFMT} -s 1/2 <"${WRKDIR}/a.c" >/dev/null 2>&1; then
+	exit 1
+fi
+
+# Each file is formatted by exactly one shard.
+${EXEC:-} ${KNFMT} -s 1/2 "${WRKDIR}/a.c" >"${WRKDIR}/act"
+${EXEC:-} ${KNFMT} -s 2/2 "${WRKDIR}/a.c" >>"${WRKDIR}/act"
+printf 'int\ta;\n' | cmp -s - "${WRKDIR}/act"
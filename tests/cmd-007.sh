@@ -0,0 +1,21 @@
+# Long left associative chains of binary expressions must be formatted instead
+# of being emitted verbatim.
+
+set -e
+
+awk 'BEGIN {
+	printf("int x = 1");
+	for (i = 0; i < 1100; i++)
+		printf(" + 1");
+	printf(";\n");
+	printf("const char *s[] = {\n\t");
+	for (i = 0; i < 1500; i++)
+		printf("\"a\" ");
+	printf("\"a\"\n};\n");
+}' >"${WRKDIR}/a.c"
+
+${EXEC:-} ${KNFMT} -v "${WRKDIR}/a.c" >"${WRKDIR}/act" 2>"${WRKDIR}/err"
+if grep -q verbatim "${WRKDIR}/err"; then
+	exit 1
+fi
+awk 'length > 80 { exit 1 }' "${WRKDIR}/act"
@@ -0,0 +1,23 @@
+# Recording a trace must not affect the output and the trace must be possible
+# to decode.
+
+set -e
+
+_trace="${WRKDIR}/trace"
+
+printf 'int  a;\nint\nf(void){\n\treturn 0;\n}\n' >"${WRKDIR}/a.c"
+${EXEC:-} ${KNFMT} "${WRKDIR}/a.c" >"${WRKDIR}/exp"
+${EXEC:-} ${KNFMT} -t "$_trace" "${WRKDIR}/a.c" >"${WRKDIR}/act"
+diff -u "${WRKDIR}/exp" "${WRKDIR}/act"
+
+${EXEC:-} ${KNFMT} -D "$_trace" >"${WRKDIR}/decode"
+grep -q "^\[[0-9]*:1\] \[F\] ${WRKDIR}/a.c$" "${WRKDIR}/decode"
+grep -q '^\[[0-9]*:1\] \[D\] ' "${WRKDIR}/decode"
+
+# The layout thread records its own events.
+${EXEC:-} ${KNFMT} -p -t "$_trace" "${WRKDIR}/a.c" >"${WRKDIR}/act"
+diff -u "${WRKDIR}/exp" "${WRKDIR}/act"
+${EXEC:-} ${KNFMT} -D "$_trace" >"${WRKDIR}/decode"
+grep -q "^\[[0-9]*:1\] \[F\] ${WRKDIR}/a.c$" "${WRKDIR}/decode"
+grep -q "^\[[0-9]*:2\] \[F\] ${WRKDIR}/a.c$" "${WRKDIR}/decode"
+grep -q '^\[[0-9]*:2\] \[D\] ' "${WRKDIR}/decode"
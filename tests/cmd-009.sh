@@ -0,0 +1,13 @@
+# Decoding a truncated trace must fail.
+
+set -e
+
+_trace="${WRKDIR}/trace"
+
+printf 'int  a;\n' >"${WRKDIR}/a.c"
+${EXEC:-} ${KNFMT} -t "$_trace" "${WRKDIR}/a.c" >/dev/null
+_len="$(wc -c <"$_trace")"
+head -c "$((_len - 1))" "$_trace" >"${WRKDIR}/truncated"
+if ${EXEC:-} ${KNFMT} -D "${WRKDIR}/truncated" >/dev/null 2>&1; then
+	exit 1
+fi
@@ -0,0 +1,23 @@
+# A macro learned by the database must not affect the output, neither while
+# being learned nor once loaded.
+
+set -e
+
+_macros="${WRKDIR}/macros"
+
+cat <<'END' >"${WRKDIR}/a.c"
+FOO_DECLARE(bar)
+
+int  x;
+
+int
+main(void){
+	return 0;
+}
+END
+${EXEC:-} ${KNFMT} "${WRKDIR}/a.c" >"${WRKDIR}/exp"
+for _i in 1 2; do
+	${EXEC:-} ${KNFMT} -M "$_macros" "${WRKDIR}/a.c" >"${WRKDIR}/act"
+	diff -u "${WRKDIR}/exp" "${WRKDIR}/act"
+done
+grep -q '^decl FOO_DECLARE$' "$_macros"
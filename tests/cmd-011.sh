@@ -0,0 +1,33 @@
+# Format in place using the server, unless a diff is requested in which case
+# the files must be left untouched.
+
+set -e
+
+_sock="${WRKDIR}/sock"
+printf 'int  a;\n' >"${WRKDIR}/a.c"
+printf 'int\ta;\n' >"${WRKDIR}/b.c"
+cp "${WRKDIR}/a.c" "${WRKDIR}/a.orig"
+cp "${WRKDIR}/b.c" "${WRKDIR}/b.orig"
+
+${EXEC:-} ${KNFMT} -S "$_sock" &
+_pid="$!"
+trap 'kill "$_pid" 2>/dev/null || :' 0
+_i=0
+while ! [ -S "$_sock" ]; do
+	_i="$((_i + 1))"
+	[ "$_i" -lt 50 ] || exit 1
+	sleep 0.1
+done
+
+if ${EXEC:-} ${KNFMT} -c "$_sock" -d -i "${WRKDIR}/a.c" >"${WRKDIR}/diff"; then
+	exit 1
+fi
+grep -q '^+int	a;$' "${WRKDIR}/diff"
+${EXEC:-} ${KNFMT} -c "$_sock" -d -i "${WRKDIR}/b.c" >"${WRKDIR}/diff"
+cmp -s /dev/null "${WRKDIR}/diff"
+cmp -s "${WRKDIR}/a.orig" "${WRKDIR}/a.c"
+cmp -s "${WRKDIR}/b.orig" "${WRKDIR}/b.c"
+
+${EXEC:-} ${KNFMT} -c "$_sock" -i "${WRKDIR}/a.c" "${WRKDIR}/b.c"
+cmp -s "${WRKDIR}/b.orig" "${WRKDIR}/a.c"
+cmp -s "${WRKDIR}/b.orig" "${WRKDIR}/b.c"
@@ -0,0 +1,23 @@
+# Recursively format all source files, skipping hidden files and directories,
+# other files and symbolic links.
+
+set -e
+
+_dir="${WRKDIR}/dir"
+mkdir -p "${_dir}/.hidden" "${_dir}/sub/nested" "${WRKDIR}/ext"
+for _f in a.c b.h sub/c.c sub/nested/d.c .hidden/e.c .f.c README x.cc; do
+	printf 'int  a;\n' >"${_dir}/${_f}"
+done
+printf 'int  a;\n' >"${WRKDIR}/ext/g.c"
+ln -s ../ext "${_dir}/link"
+ln -s ../ext/g.c "${_dir}/g.c"
+
+${EXEC:-} ${KNFMT} -ri "$_dir"
+
+for _f in a.c b.h sub/c.c sub/nested/d.c; do
+	printf 'int\ta;\n' | cmp -s - "${_dir}/${_f}"
+done
+for _f in .hidden/e.c .f.c README x.cc; do
+	printf 'int  a;\n' | cmp -s - "${_dir}/${_f}"
+done
+printf 'int  a;\n' | cmp -s - "${WRKDIR}/ext/g.c"
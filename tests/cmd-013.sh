@@ -0,0 +1,20 @@
+# Generated files are only left untouched if their marker is given.
+
+set -e
+
+_file="${WRKDIR}/a.c"
+_out="${WRKDIR}/out"
+
+printf '/* Code generated by a tool. DO NOT EDIT. */\n\nint  a;\n' >"$_file"
+${EXEC:-} ${KNFMT} "$_file" >"$_out"
+printf '/* Code generated by a tool. DO NOT EDIT. */\n\nint\ta;\n' |
+cmp -s - "$_out"
+
+${EXEC:-} ${KNFMT} -v -g 'DO NOT EDIT' "$_file" >"$_out" 2>"${WRKDIR}/err"
+cmp -s "$_file" "$_out"
+grep -q 'generated file' "${WRKDIR}/err"
+
+# The marker must be present in the first comment.
+printf 'int  a;\n/* DO NOT EDIT */\n' >"$_file"
+${EXEC:-} ${KNFMT} -g 'DO NOT EDIT' "$_file" >"$_out"
+printf 'int\ta;\n/* DO NOT EDIT */\n' | cmp -s - "$_out"
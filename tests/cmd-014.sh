@@ -0,0 +1,78 @@
+# Formatting using concurrent jobs must yield the same output as formatting
+# serially, also when preprocessor branches are present near the boundaries of
+# the chunks.
+
+set -e
+
+_file="${WRKDIR}/a.c"
+_serial="${WRKDIR}/serial"
+_out="${WRKDIR}/out"
+
+cat <<'__EOF__' >"$_file"
+int
+f1(void)
+{
+	return  1;
+}
+
+#if defined(A)
+int
+f2(void)
+{
+	return  2;
+}
+
+int
+f3(void)
+{
+	return  3;
+}
+#else
+int
+f2(void)
+{
+	return  -2;
+}
+#endif
+
+int
+f4(void)
+{
+	if (x) {
+		return  4;
+	}
+	return 0;
+}
+
+#ifdef B
+static void
+f5(void)
+{
+}
+#endif
+
+int
+f6(void)
+{
+	return  6;
+}
+
+int
+f7(void)
+{
+	return  7;
+}
+__EOF__
+
+${EXEC:-} ${KNFMT} -j 1 "$_file" >"$_serial"
+if grep -q 'return  ' "$_serial"; then
+	exit 1
+fi
+for _jobs in 2 3 4 8; do
+	${EXEC:-} ${KNFMT} -j "$_jobs" "$_file" >"$_out"
+	cmp -s "$_serial" "$_out"
+done
+
+# Ensure the file is actually divided into chunks.
+${EXEC:-} ${KNFMT} -vvvvv -j 4 "$_file" 2>&1 >/dev/null |
+grep -q 'chunk 2 ends'
@@ -0,0 +1,48 @@
+# Watch a directory and ensure each written file is formatted exactly once, the
+# files written by the formatter itself must not be formatted again.
+
+set -e
+
+_dir="${WRKDIR}/dir"
+_trace="${WRKDIR}/trace"
+mkdir "$_dir"
+
+${EXEC:-} ${KNFMT} -i -t "$_trace" -w "$_dir" &
+_pid="$!"
+trap 'kill "$_pid" 2>/dev/null || :' 0
+sleep 1
+# Watch mode is not supported on all systems.
+kill -0 "$_pid" 2>/dev/null || exit 0
+
+# waitfile file
+#
+# Wait until the given file is formatted.
+waitfile() {
+	_i=0
+	while ! printf 'int\ta;\nint\tb;\n' | cmp -s - "$1"; do
+		_i="$((_i + 1))"
+		[ "$_i" -lt 50 ] || exit 1
+		sleep 0.1
+	done
+}
+
+# Consecutive writes in a short period are expected to be debounced.
+printf 'int  a;\n' >"${_dir}/a.c"
+sleep 0.02
+printf 'int  b;\n' >>"${_dir}/a.c"
+waitfile "${_dir}/a.c"
+
+# Subdirectories created while watching are also watched.
+mkdir "${_dir}/sub"
+sleep 1
+printf 'int  a;\nint  b;\n' >"${_dir}/sub/b.c"
+waitfile "${_dir}/sub/b.c"
+
+# Give any spurious formatting a chance to happen.
+sleep 1
+kill "$_pid"
+wait "$_pid" || :
+
+${EXEC:-} ${KNFMT} -D "$_trace" >"${WRKDIR}/out"
+[ "$(grep -c '\[F\] .*/a\.c$' "${WRKDIR}/out")" -eq 1 ]
+[ "$(grep -c '\[F\] .*/b\.c$' "${WRKDIR}/out")" -eq 1 ]
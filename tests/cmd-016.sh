@@ -0,0 +1,28 @@
+# Formatting in place must preserve the mode and ownership of the file.
+
+set -e
+
+# attr file
+#
+# Print the mode and numeric ownership of the given file.
+attr() {
+	ls -ln "$1" | awk '{print $1, $3, $4}'
+}
+
+_dir="${WRKDIR}/dir"
+_file="${_dir}/a.c"
+mkdir "$_dir"
+printf 'int  a;\n' >"$_file"
+chmod 0640 "$_file"
+# Only the superuser can give away files.
+if [ "$(id -u)" -eq 0 ]; then
+	chown 1:1 "$_file"
+fi
+_before="$(attr "$_file")"
+
+${EXEC:-} ${KNFMT} -i "$_file"
+printf 'int\ta;\n' | cmp -s - "$_file"
+[ "$(attr "$_file")" = "$_before" ]
+
+# No temporary file must be left behind.
+[ "$(ls "$_dir")" = "a.c" ]
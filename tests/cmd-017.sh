@@ -0,0 +1,27 @@
+# Laying out declarations in a separate thread must yield the same output as
+# laying them out serially, also when recovering.
+
+set -e
+
+_file="${WRKDIR}/a.c"
+_serial="${WRKDIR}/serial"
+_out="${WRKDIR}/out"
+
+awk 'BEGIN {
+	for (i = 0; i < 50; i++) {
+		printf("int\nf%d(void){\n\treturn  %d;\n}\n\n", i, i);
+		if (i == 25) {
+			printf("#ifdef A\nint\ng(void)\n{\n#else\n");
+			printf("int\ng(int x)\n{\n#endif\n");
+			printf("\treturn  0;\n}\n\n");
+		}
+	}
+	printf("int  x;\n");
+}' >"$_file"
+
+${EXEC:-} ${KNFMT} "$_file" >"$_serial"
+${EXEC:-} ${KNFMT} -p "$_file" >"$_out"
+cmp -s "$_serial" "$_out"
+if grep -q 'return  ' "$_out"; then
+	exit 1
+fi
@@ -14,6 +14,15 @@ trap "rm -rf ${_wrkdir}" 0
 _out="${_wrkdir}/out"
 
 case "$1" in
+cmd-*)
+	if ! env KNFMT="$KNFMT" WRKDIR="$_wrkdir" sh "$1" \
+		>"$_out" 2>&1
+	then
+		cat "$_out" 1>&2
+		echo "${1}; expected exit 0" 1>&2
+		exit 1
+	fi
+	;;
 error-*)
 	_err=0
 	${EXEC:-} ${KNFMT} "$1" >"$_out" 2>&1 || _err="$?"
@@ -26,9 +35,11 @@ error-*)
 *)
 	_ok="${1%.c}.ok"
 	if [ -e "$_ok" ]; then
+		_args=""
+		[ -e "${1%.c}.args" ] && _args="$(cat "${1%.c}.args")"
 		_tmp="${_wrkdir}/tmp"
 		commstrip "$1" >"$_tmp"
-		if ! ${EXEC:-} "${KNFMT}" -v "$_tmp" 2>&1 |
+		if ! ${EXEC:-} "${KNFMT}" -v ${_args} "$_tmp" 2>&1 |
 			diff -u -L "$1" -L "$_ok" "$_ok" - >"$_out" 2>&1
 		then
 			cat "$_out" 1>&2
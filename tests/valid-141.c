@@ -0,0 +1,28 @@
+/*
+ * Dangling tokens while traversing branches.
+ */
+
+#ifdef FOO
+static int	foo = 1; /* foo */
+#else
+static int	foo = 2; /* bar */
+#endif
+
+int
+main(void)
+{
+	int x = 0; /* leading */
+
+	/* block */
+	x++;
+#if defined(A)
+	x = 1;
+#elif defined(B)
+	x = 2; /* two */
+#else
+	x = 3;
+#endif
+	if (x)
+		return 1;
+	return 0;
+}
@@ -0,0 +1,20 @@
+/*
+ * Regions with formatting disabled.
+ */
+
+/* knfmt off */
+static const int table[] = {
+	1,   2,   3,
+	4,   5,   6,
+};
+/* knfmt on */
+
+int
+main(void)
+{
+	/* knfmt off */
+	int   x = table[0]   +   table[5];
+	/* knfmt on */
+
+	return x;
+}
@@ -0,0 +1,16 @@
+/*
+ * Brace initializers consisting of literals, identifiers and unary operators.
+ */
+
+static const int table[] = {
+	0x00,  -1,   ~0, FOO,
+	0x1,  1 + 2, -BAR,   "x",
+	-1, /* comment */ 2,
+};
+
+static const int row[] = { 1, -2, ~3, FOO, "bar", sizeof(int), 4 };
+
+static const int nested[][2] = {
+	{ 1,  -2 },
+	{ -3, 4 },
+};
@@ -0,0 +1,17 @@
+/*
+ * Line ranges, given in valid-145.args. Leading preprocessor directives are
+ * not part of the range of a declaration, a range does not extend to other
+ * declarations in the same block and empty lines outside of the ranges are
+ * preserved. Line numbers are relative to the end of this comment.
+ */
+
+#include <stdio.h>
+
+int  a;
+int  b;
+int  c;
+
+int  d;
+
+
+int  e;
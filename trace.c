@@ -0,0 +1,508 @@
+#include <sys/uio.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "extern.h"
+
+#ifdef HAVE_PTHREAD
+#  include <pthread.h>
+#  define TRACE_THREAD	__thread
+#else
+#  define TRACE_THREAD
+#endif
+
+/*
+ * Binary trace of the lexer, parser and document execution. As opposed to the
+ * textual trace enabled by -vv, recording an event only amounts to storing a
+ * fixed size record in a ring owned by the current thread. The ring is
+ * drained to the trace file once full, making it possible to capture the
+ * trace of slow files at near-native speed. The trace is later turned into
+ * text by trace_decode().
+ *
+ * The trace file starts with TRACE_MAGIC followed by blocks, each one
+ * consisting of a header and a payload. Blocks written by different threads
+ * and processes may be interleaved but the blocks of a single thread always
+ * appear in order. Records are stored using the byte order of the host.
+ */
+
+#define TRACE_MAGIC	"knfmttr1"
+
+/* Number of events per ring. */
+#define TRACE_RING	4096
+
+struct trace_event {
+	uint8_t		te_id;		/* see enum trace_id */
+	uint8_t		te_mode;	/* document mode */
+	uint16_t	te_type;	/* document or token type */
+	int32_t		te_val;		/* event specific value */
+	union {
+		/* token events */
+		struct {
+			uint32_t	te_lno;
+			uint32_t	te_cno;
+		};
+
+		/* document events */
+		struct {
+			uint32_t	te_doc;		/* index of flat document */
+			uint32_t	te_depth;
+		};
+	};
+	uint32_t	te_pos;		/* document position */
+};
+
+struct trace_block {
+	uint32_t	tb_type;
+#define TRACE_BLOCK_EVENTS	1
+#define TRACE_BLOCK_PATH	2
+
+	uint32_t	tb_pid;
+	uint32_t	tb_tid;		/* 1-based thread within process */
+	uint32_t	tb_len;		/* length of payload in bytes */
+};
+
+struct trace {
+	int		t_fd;
+	int		t_error;
+	uint32_t	t_ntids;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t	t_lock;
+#endif
+};
+
+struct trace_ring {
+	struct trace_event	 tr_events[TRACE_RING];
+	size_t			 tr_len;
+	struct trace		*tr_trace;	/* trace drained to */
+	uint32_t		 tr_tid;
+};
+
+static struct trace_ring	*trace_ring_get(struct trace *);
+static void			 trace_ring_drain(struct trace_ring *);
+static void			 trace_write(struct trace *,
+    const struct trace_block *, const void *);
+
+static int	trace_decode_block(const struct trace_block *, const char *);
+static void	trace_decode_event(const struct trace_block *,
+    const struct trace_event *);
+
+static const char	*strtrace(enum trace_id);
+static const char	*strtype(const struct trace_event *);
+
+/*
+ * The ring of the current thread, bound to the trace it was last used with.
+ */
+static TRACE_THREAD struct trace_ring	*trace_ring;
+
+/*
+ * Open the trace file at the given path, any existing trace is truncated.
+ * Returns NULL on failure with errno set.
+ */
+struct trace *
+trace_alloc(const char *path)
+{
+	struct trace *t;
+	int fd;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+	    0644);
+	if (fd == -1)
+		return NULL;
+	if (write(fd, TRACE_MAGIC, sizeof(TRACE_MAGIC) - 1) == -1) {
+		int serrno = errno;
+
+		close(fd);
+		errno = serrno;
+		return NULL;
+	}
+
+	t = calloc(1, sizeof(*t));
+	if (t == NULL)
+		err(1, NULL);
+	t->t_fd = fd;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_init(&t->t_lock, NULL);
+#endif
+	return t;
+}
+
+/*
+ * Drain the ring of the current thread and close the trace file. Returns
+ * non-zero if any event could not be written. All other threads must already
+ * have left the trace, see trace_leave().
+ */
+int
+trace_free(struct trace *t)
+{
+	int error;
+
+	if (t == NULL)
+		return 0;
+
+	if (trace_ring != NULL && trace_ring->tr_trace == t)
+		trace_leave();
+	close(t->t_fd);
+#ifdef HAVE_PTHREAD
+	pthread_mutex_destroy(&t->t_lock);
+#endif
+	error = t->t_error;
+	free(t);
+	return error;
+}
+
+/*
+ * Mark the start of the given file, all events recorded by the current thread
+ * from now on concern the same file.
+ */
+void
+trace_file(struct trace *t, const char *path)
+{
+	struct trace_block tb;
+	struct trace_ring *tr;
+
+	if (t == NULL)
+		return;
+
+	tr = trace_ring_get(t);
+	trace_ring_drain(tr);
+	tb.tb_type = TRACE_BLOCK_PATH;
+	tb.tb_pid = getpid();
+	tb.tb_tid = tr->tr_tid;
+	tb.tb_len = strlen(path);
+	trace_write(t, &tb, path);
+}
+
+/*
+ * Drain the ring of the current thread. Must be called before forking as the
+ * ring would otherwise be written by both processes.
+ */
+void
+trace_flush(void)
+{
+	if (trace_ring != NULL)
+		trace_ring_drain(trace_ring);
+}
+
+/*
+ * Drain and free the ring of the current thread, must be called by every
+ * thread recording events before exiting.
+ */
+void
+trace_leave(void)
+{
+	trace_flush();
+	free(trace_ring);
+	trace_ring = NULL;
+}
+
+void
+trace_doc(struct trace *t, enum trace_id id, unsigned int doc,
+    enum doc_type type, unsigned char mode, unsigned int pos,
+    unsigned int depth, int val)
+{
+	struct trace_event *te;
+	struct trace_ring *tr;
+
+	tr = trace_ring_get(t);
+	te = &tr->tr_events[tr->tr_len];
+	te->te_id = id;
+	te->te_mode = mode;
+	te->te_type = type;
+	te->te_val = val;
+	te->te_doc = doc;
+	te->te_depth = depth;
+	te->te_pos = pos;
+	if (++tr->tr_len == TRACE_RING)
+		trace_ring_drain(tr);
+}
+
+void
+trace_token(struct trace *t, enum trace_id id, const struct token *tk, int val)
+{
+	struct trace_event *te;
+	struct trace_ring *tr;
+
+	tr = trace_ring_get(t);
+	te = &tr->tr_events[tr->tr_len];
+	memset(te, 0, sizeof(*te));
+	te->te_id = id;
+	te->te_val = val;
+	if (tk != NULL) {
+		te->te_type = tk->tk_type;
+		te->te_lno = tk->tk_lno;
+		te->te_cno = tk->tk_cno;
+	} else {
+		te->te_type = TOKEN_NONE;
+	}
+	if (++tr->tr_len == TRACE_RING)
+		trace_ring_drain(tr);
+}
+
+/*
+ * Write the trace file at the given path as text to standard output.
+ */
+int
+trace_decode(const char *path)
+{
+	struct trace_block tb;
+	struct buffer *bf;
+	size_t off;
+	int error = 0;
+
+	bf = buffer_read(path);
+	if (bf == NULL)
+		return 1;
+
+	off = sizeof(TRACE_MAGIC) - 1;
+	if (bf->bf_len < off ||
+	    memcmp(bf->bf_ptr, TRACE_MAGIC, sizeof(TRACE_MAGIC) - 1) != 0) {
+		warnx("%s: not a trace file", path);
+		error = 1;
+		goto out;
+	}
+
+	while (off < bf->bf_len) {
+		if (bf->bf_len - off < sizeof(tb)) {
+			warnx("%s: truncated block header", path);
+			error = 1;
+			break;
+		}
+		memcpy(&tb, &bf->bf_ptr[off], sizeof(tb));
+		off += sizeof(tb);
+		if (bf->bf_len - off < tb.tb_len) {
+			warnx("%s: truncated block", path);
+			error = 1;
+			break;
+		}
+		if (trace_decode_block(&tb, &bf->bf_ptr[off])) {
+			warnx("%s: invalid block", path);
+			error = 1;
+			break;
+		}
+		off += tb.tb_len;
+	}
+
+out:
+	buffer_free(bf);
+	return error;
+}
+
+static struct trace_ring *
+trace_ring_get(struct trace *t)
+{
+	struct trace_ring *tr = trace_ring;
+
+	if (tr != NULL && tr->tr_trace == t)
+		return tr;
+
+	if (tr == NULL) {
+		tr = malloc(sizeof(*tr));
+		if (tr == NULL)
+			err(1, NULL);
+		tr->tr_len = 0;
+		trace_ring = tr;
+	} else {
+		/* Bound to another trace, drain it before switching. */
+		trace_ring_drain(tr);
+	}
+	tr->tr_trace = t;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&t->t_lock);
+#endif
+	tr->tr_tid = ++t->t_ntids;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&t->t_lock);
+#endif
+	return tr;
+}
+
+static void
+trace_ring_drain(struct trace_ring *tr)
+{
+	struct trace_block tb;
+
+	if (tr->tr_len == 0)
+		return;
+
+	tb.tb_type = TRACE_BLOCK_EVENTS;
+	tb.tb_pid = getpid();
+	tb.tb_tid = tr->tr_tid;
+	tb.tb_len = tr->tr_len * sizeof(tr->tr_events[0]);
+	trace_write(tr->tr_trace, &tb, tr->tr_events);
+	tr->tr_len = 0;
+}
+
+/*
+ * Write the given block. Each block is written using a single writev(2) to a
+ * file opened in append mode while holding the lock, preventing blocks from
+ * different processes and threads from being interleaved.
+ */
+static void
+trace_write(struct trace *t, const struct trace_block *tb, const void *payload)
+{
+	struct iovec iov[2];
+	size_t len;
+	ssize_t nw;
+
+	iov[0].iov_base = (void *)tb;
+	iov[0].iov_len = sizeof(*tb);
+	iov[1].iov_base = (void *)payload;
+	iov[1].iov_len = tb->tb_len;
+	len = iov[0].iov_len + iov[1].iov_len;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&t->t_lock);
+#endif
+	do {
+		nw = writev(t->t_fd, iov, 2);
+	} while (nw == -1 && errno == EINTR);
+	if (nw == -1 || (size_t)nw != len) {
+		if (!t->t_error)
+			warn("trace");
+		t->t_error = 1;
+	}
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&t->t_lock);
+#endif
+}
+
+static int
+trace_decode_block(const struct trace_block *tb, const char *payload)
+{
+	switch (tb->tb_type) {
+	case TRACE_BLOCK_EVENTS: {
+		struct trace_event te;
+		size_t off;
+
+		if (tb->tb_len % sizeof(te) != 0)
+			return 1;
+		for (off = 0; off < tb->tb_len; off += sizeof(te)) {
+			memcpy(&te, &payload[off], sizeof(te));
+			trace_decode_event(tb, &te);
+		}
+		break;
+	}
+
+	case TRACE_BLOCK_PATH:
+		if (tb->tb_len > INT_MAX)
+			return 1;
+		printf("[%u:%u] [F] %.*s\n", tb->tb_pid, tb->tb_tid,
+		    (int)tb->tb_len, payload);
+		break;
+
+	default:
+		return 1;
+	}
+
+	return 0;
+}
+
+static void
+trace_decode_event(const struct trace_block *tb, const struct trace_event *te)
+{
+	const char *name = strtrace(te->te_id);
+	int depth = te->te_depth * 2;
+
+	printf("[%u:%u] ", tb->tb_pid, tb->tb_tid);
+	switch (te->te_id) {
+	case TRACE_DOC_ENTER:
+		printf("[D] [%c,%3u,%3u] %*s%s#%u(%d)\n", te->te_mode,
+		    te->te_pos, te->te_depth, depth, "", strtype(te),
+		    te->te_doc, te->te_val);
+		break;
+
+	case TRACE_DOC_LEAVE:
+		printf("[D] [%c,%3u,%3u] %*s)\n", te->te_mode, te->te_pos,
+		    te->te_depth, depth, "");
+		break;
+
+	case TRACE_DOC_FITS:
+		printf("[D] [%c,%3u,%3u] %*s%s: #%u %s%s\n", te->te_mode,
+		    te->te_pos, te->te_depth, depth, "", name, te->te_doc,
+		    (te->te_val & TRACE_FITS) ? "fits" : "breaks",
+		    (te->te_val & TRACE_FITS_CACHED) ? " (cached)" : "");
+		break;
+
+	case TRACE_DOC_REFIT:
+	case TRACE_DOC_TRIM:
+		printf("[D] [%c,%3u,%3u] %*s%s: #%u %d\n", te->te_mode,
+		    te->te_pos, te->te_depth, depth, "", name, te->te_doc,
+		    te->te_val);
+		break;
+
+	case TRACE_LEXER_RECOVER:
+	case TRACE_LEXER_BRANCH:
+	case TRACE_LEXER_SEEK:
+	case TRACE_LEXER_HALT:
+	case TRACE_LEXER_EXHAUST:
+		printf("[L] %s: %s<%u:%u> %d\n", name, strtype(te), te->te_lno,
+		    te->te_cno, te->te_val);
+		break;
+
+	case TRACE_ERROR:
+		printf("[E] %s<%u:%u> %d\n", strtype(te), te->te_lno,
+		    te->te_cno, te->te_val);
+		break;
+
+	default:
+		printf("[?] %u\n", te->te_id);
+		break;
+	}
+}
+
+static const char *
+strtrace(enum trace_id id)
+{
+	switch (id) {
+#define CASE(t) case t: return &#t[sizeof("TRACE_") - 1]
+	CASE(TRACE_DOC_ENTER);
+	CASE(TRACE_DOC_LEAVE);
+	CASE(TRACE_DOC_FITS);
+	CASE(TRACE_DOC_REFIT);
+	CASE(TRACE_DOC_TRIM);
+	CASE(TRACE_LEXER_RECOVER);
+	CASE(TRACE_LEXER_BRANCH);
+	CASE(TRACE_LEXER_SEEK);
+	CASE(TRACE_LEXER_HALT);
+	CASE(TRACE_LEXER_EXHAUST);
+	CASE(TRACE_ERROR);
+#undef CASE
+	}
+	return "UNKNOWN";
+}
+
+static const char *
+strtype(const struct trace_event *te)
+{
+	const char *str = NULL;
+
+	switch (te->te_id) {
+	case TRACE_DOC_ENTER:
+	case TRACE_DOC_LEAVE:
+	case TRACE_DOC_FITS:
+	case TRACE_DOC_REFIT:
+	case TRACE_DOC_TRIM:
+		str = doc_type_str(te->te_type);
+		break;
+
+	case TRACE_LEXER_RECOVER:
+	case TRACE_LEXER_BRANCH:
+	case TRACE_LEXER_SEEK:
+	case TRACE_LEXER_HALT:
+	case TRACE_LEXER_EXHAUST:
+	case TRACE_ERROR:
+		switch (te->te_type) {
+#define T(t, s, f) case t: str = &#t[sizeof("TOKEN_") - 1]; break;
+#include "token.h"
+		}
+		break;
+	}
+	return str != NULL ? str : "UNKNOWN";
+}
@@ -1,4 +1,5 @@
 #include <err.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -13,6 +14,30 @@ config_init(struct config *cf)
 	cf->cf_sw = 4;
 }
 
+/*
+ * Returns non-zero if the file located at path belongs to the configured shard.
+ * The assignment is based on a hash of the path and therefore stable across
+ * processes and machines, given the same relative paths.
+ */
+int
+config_shard(const struct config *cf, const char *path)
+{
+	uint32_t h = 2166136261u;
+
+	if (cf->cf_nshards == 0)
+		return 1;
+
+	while (path[0] == '.' && path[1] == '/') {
+		for (path += 2; path[0] == '/'; path++)
+			continue;
+	}
+	for (; *path != '\0'; path++) {
+		h ^= (unsigned char)*path;
+		h *= 16777619u;
+	}
+	return h % cf->cf_nshards == cf->cf_shard - 1;
+}
+
 char *
 strnice(const char *str, size_t len)
 {
@@ -39,3 +64,16 @@ strnice(const char *str, size_t len)
 	*buf = '\0';
 	return p;
 }
+
+/*
+ * Returns non-zero if the given path refers to a C source or header file.
+ */
+int
+issource(const char *path)
+{
+	size_t len;
+
+	len = strlen(path);
+	return len >= 2 && path[len - 2] == '.' &&
+	    (path[len - 1] == 'c' || path[len - 1] == 'h');
+}
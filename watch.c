@@ -0,0 +1,388 @@
+#include "config.h"
+
+#ifdef HAVE_INOTIFY
+
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "extern.h"
+
+#ifdef HAVE_UTHASH
+#  include <uthash.h>
+#else
+#  include "compat-uthash.h"
+#endif
+
+/* Period in milliseconds without any events before acting upon them. */
+#define WATCH_DEBOUNCE	100
+
+#define WATCH_MASK \
+	(IN_CLOSE_WRITE | IN_CREATE | IN_MOVED_TO | IN_ONLYDIR)
+
+struct watch_file {
+	char	*wf_path;
+	int	 wf_pending;
+
+	/* attributes of the file as written by ourselves */
+	int		wf_written;
+	dev_t		wf_dev;
+	ino_t		wf_ino;
+	struct timespec	wf_mtim;
+
+	UT_hash_handle		wf_hh;
+	TAILQ_ENTRY(watch_file)	wf_entry;
+};
+
+TAILQ_HEAD(watch_file_list, watch_file);
+
+struct watch {
+	const struct config	*w_cf;
+	struct error		*w_er;
+	int			 w_fd;
+
+	/* directory paths indexed by watch descriptor */
+	char	**w_dirs;
+	size_t	  w_ndirs;
+
+	struct watch_file	*w_files;
+	struct watch_file_list	 w_pending;
+
+	int	(*w_format)(const char *, struct error *, const struct config *);
+};
+
+static int	watch_add(struct watch *, const char *);
+static int	watch_read(struct watch *);
+static void	watch_pend(struct watch *, const char *);
+static int	watch_flush(struct watch *);
+static void	watch_free(struct watch *);
+
+static void	sighandler(int);
+
+static volatile sig_atomic_t	gotsig;
+
+/*
+ * Watch the given directories recursively and format source code files as
+ * soon as they are written until interrupted. Events caused by the formatter
+ * itself writing files in place are ignored.
+ */
+int
+watch_exec(char *const *dirs, int ndirs,
+    int (*format)(const char *, struct error *, const struct config *),
+    struct error *er, const struct config *cf)
+{
+	struct sigaction sa;
+	struct watch w;
+	int error = 0;
+	int i;
+
+	memset(&w, 0, sizeof(w));
+	w.w_cf = cf;
+	w.w_er = er;
+	w.w_format = format;
+	TAILQ_INIT(&w.w_pending);
+	w.w_fd = inotify_init1(IN_CLOEXEC);
+	if (w.w_fd == -1) {
+		warn("inotify_init1");
+		return 1;
+	}
+	for (i = 0; i < ndirs; i++) {
+		if (watch_add(&w, dirs[i])) {
+			error = 1;
+			goto out;
+		}
+	}
+
+	/* Intentionally not using SA_RESTART in order to interrupt poll(2). */
+	memset(&sa, 0, sizeof(sa));
+	sigemptyset(&sa.sa_mask);
+	sa.sa_handler = sighandler;
+	if (sigaction(SIGINT, &sa, NULL) == -1 ||
+	    sigaction(SIGTERM, &sa, NULL) == -1)
+		err(1, "sigaction");
+
+	while (!gotsig) {
+		struct pollfd pfd;
+		int n;
+
+		pfd.fd = w.w_fd;
+		pfd.events = POLLIN;
+		n = poll(&pfd, 1,
+		    TAILQ_EMPTY(&w.w_pending) ? -1 : WATCH_DEBOUNCE);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			warn("poll");
+			error = 1;
+			break;
+		}
+		if (n == 0) {
+			if (watch_flush(&w))
+				error = 1;
+			continue;
+		}
+		if (watch_read(&w)) {
+			error = 1;
+			break;
+		}
+	}
+
+out:
+	watch_free(&w);
+	return error;
+}
+
+/*
+ * Watch the given directory and all its subdirectories, except hidden ones.
+ */
+static int
+watch_add(struct watch *w, const char *path)
+{
+	char buf[PATH_MAX];
+	struct dirent *de;
+	DIR *dir;
+	int error = 0;
+	int siz = sizeof(buf);
+	int wd;
+
+	wd = inotify_add_watch(w->w_fd, path, WATCH_MASK);
+	if (wd == -1) {
+		warn("inotify_add_watch: %s", path);
+		return 1;
+	}
+	if ((size_t)wd >= w->w_ndirs) {
+		size_t ndirs = wd + 1;
+
+		w->w_dirs = reallocarray(w->w_dirs, ndirs, sizeof(*w->w_dirs));
+		if (w->w_dirs == NULL)
+			err(1, NULL);
+		memset(&w->w_dirs[w->w_ndirs], 0,
+		    (ndirs - w->w_ndirs) * sizeof(*w->w_dirs));
+		w->w_ndirs = ndirs;
+	}
+	free(w->w_dirs[wd]);
+	w->w_dirs[wd] = strdup(path);
+	if (w->w_dirs[wd] == NULL)
+		err(1, NULL);
+
+	dir = opendir(path);
+	if (dir == NULL) {
+		warn("opendir: %s", path);
+		return 1;
+	}
+	while ((de = readdir(dir)) != NULL) {
+		const char *name = de->d_name;
+		int n;
+
+		if (name[0] == '.')
+			continue;
+
+		if (de->d_type == DT_UNKNOWN) {
+			struct stat st;
+
+			if (fstatat(dirfd(dir), name, &st,
+				    AT_SYMLINK_NOFOLLOW) == -1 ||
+			    !S_ISDIR(st.st_mode))
+				continue;
+		} else if (de->d_type != DT_DIR) {
+			continue;
+		}
+
+		n = snprintf(buf, siz, "%s/%s", path, name);
+		if (n < 0 || n >= siz) {
+			warnc(ENAMETOOLONG, "%s/%s", path, name);
+			error = 1;
+			continue;
+		}
+		if (watch_add(w, buf))
+			error = 1;
+	}
+	closedir(dir);
+	return error;
+}
+
+static int
+watch_read(struct watch *w)
+{
+	union {
+		struct inotify_event	ev;	/* alignment */
+		char			buf[4096];
+	} u;
+	char path[PATH_MAX];
+	ssize_t len, off;
+	int siz = sizeof(path);
+
+	len = read(w->w_fd, u.buf, sizeof(u.buf));
+	if (len == -1) {
+		if (errno == EINTR)
+			return 0;
+		warn("read");
+		return 1;
+	}
+
+	for (off = 0; off < len;) {
+		const struct inotify_event *ev;
+		const char *dir;
+		int n;
+
+		ev = (const struct inotify_event *)&u.buf[off];
+		off += sizeof(*ev) + ev->len;
+
+		if (ev->mask & IN_Q_OVERFLOW) {
+			warnx("%s: event queue overflow", __func__);
+			continue;
+		}
+		if (ev->wd < 0 || (size_t)ev->wd >= w->w_ndirs)
+			continue;
+		if (ev->mask & IN_IGNORED) {
+			/* Directory removed. */
+			free(w->w_dirs[ev->wd]);
+			w->w_dirs[ev->wd] = NULL;
+			continue;
+		}
+		dir = w->w_dirs[ev->wd];
+		if (dir == NULL || ev->len == 0)
+			continue;
+
+		n = snprintf(path, siz, "%s/%s", dir, ev->name);
+		if (n < 0 || n >= siz) {
+			warnc(ENAMETOOLONG, "%s/%s", dir, ev->name);
+			continue;
+		}
+		if (ev->mask & IN_ISDIR) {
+			if (ev->name[0] != '.')
+				(void)watch_add(w, path);
+		} else if ((ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) &&
+		    issource(ev->name)) {
+			watch_pend(w, path);
+		}
+	}
+
+	return 0;
+}
+
+static void
+watch_pend(struct watch *w, const char *path)
+{
+	struct watch_file *wf;
+
+	HASH_FIND(wf_hh, w->w_files, path, strlen(path), wf);
+	if (wf == NULL) {
+		wf = calloc(1, sizeof(*wf));
+		if (wf == NULL)
+			err(1, NULL);
+		wf->wf_path = strdup(path);
+		if (wf->wf_path == NULL)
+			err(1, NULL);
+		HASH_ADD_KEYPTR(wf_hh, w->w_files, wf->wf_path,
+		    strlen(wf->wf_path), wf);
+	}
+	if (!wf->wf_pending) {
+		wf->wf_pending = 1;
+		TAILQ_INSERT_TAIL(&w->w_pending, wf, wf_entry);
+	}
+}
+
+/*
+ * Format all files changed since the last flush.
+ */
+static int
+watch_flush(struct watch *w)
+{
+	struct watch_file *wf;
+	int error = 0;
+
+	while ((wf = TAILQ_FIRST(&w->w_pending)) != NULL) {
+		struct stat after, before;
+
+		TAILQ_REMOVE(&w->w_pending, wf, wf_entry);
+		wf->wf_pending = 0;
+
+		if (stat(wf->wf_path, &before) == -1)
+			continue;
+		/* Ignore the file as written by ourselves. */
+		if (wf->wf_written && wf->wf_dev == before.st_dev &&
+		    wf->wf_ino == before.st_ino &&
+		    wf->wf_mtim.tv_sec == before.st_mtim.tv_sec &&
+		    wf->wf_mtim.tv_nsec == before.st_mtim.tv_nsec)
+			continue;
+		wf->wf_written = 0;
+
+		if (w->w_format(wf->wf_path, w->w_er, w->w_cf)) {
+			error = 1;
+			error_flush(w->w_er);
+		}
+		error_reset(w->w_er);
+
+		if (stat(wf->wf_path, &after) == 0 &&
+		    (after.st_ino != before.st_ino ||
+		     after.st_mtim.tv_sec != before.st_mtim.tv_sec ||
+		     after.st_mtim.tv_nsec != before.st_mtim.tv_nsec)) {
+			wf->wf_written = 1;
+			wf->wf_dev = after.st_dev;
+			wf->wf_ino = after.st_ino;
+			wf->wf_mtim = after.st_mtim;
+		}
+	}
+	if (output_flush(w->w_cf->cf_output))
+		error = 1;
+
+	if (w->w_cf->cf_cache != NULL && cache_write(w->w_cf->cf_cache))
+		error = 1;
+	if (w->w_cf->cf_macros != NULL && macros_write(w->w_cf->cf_macros))
+		error = 1;
+
+	return error;
+}
+
+static void
+watch_free(struct watch *w)
+{
+	struct watch_file *tmp, *wf;
+	size_t i;
+
+	HASH_ITER(wf_hh, w->w_files, wf, tmp) {
+		HASH_DELETE(wf_hh, w->w_files, wf);
+		free(wf->wf_path);
+		free(wf);
+	}
+	for (i = 0; i < w->w_ndirs; i++)
+		free(w->w_dirs[i]);
+	free(w->w_dirs);
+	close(w->w_fd);
+}
+
+static void
+sighandler(int UNUSED(signo))
+{
+	gotsig = 1;
+}
+
+#else
+
+#include <err.h>
+
+#include "extern.h"
+
+int
+watch_exec(char *const *UNUSED(dirs), int UNUSED(ndirs),
+    int (*format)(const char *, struct error *, const struct config *),
+    struct error *UNUSED(er), const struct config *UNUSED(cf))
+{
+	(void)format;
+	warnx("watch mode not supported");
+	return 1;
+}
+
+#endif